@@ -0,0 +1,274 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "commandline.h"
+#include "config.h"
+#include "log.h"
+#include "tokoloshinterface.h"
+
+QString resultToString(const QVariant &var)
+{
+    if (var.type() == QVariant::StringList) {
+        return var.toStringList().join("\n");
+    } else {
+        return var.toString();
+    }
+}
+
+BatchRunner::BatchRunner(TokoloshInterface *interface)
+{
+    d.interface = interface;
+    d.useControl = false;
+}
+
+int BatchRunner::run(QIODevice *input)
+{
+    if (Config::isEnabled("fastpath", true) && d.control.connectToServer())
+        d.useControl = describe();
+    LOG(10) << "Running batch over" << (d.useControl ? "the control socket" : "D-Bus");
+
+    static const int window = qMax(1, Config::value<int>("batchwindow", 128));
+    QQueue<Pending> inFlight;
+    int ret = 0;
+    int count = 0;
+    QTime timer;
+    timer.start();
+    QTextStream in(input);
+    QStringList operations;
+    bool inBatch = false;
+    forever {
+        const QString line = in.readLine();
+        if (line.isNull()) {
+            if (!inBatch)
+                break;
+            Pending pending;
+            pending.command = "begin";
+            pending.error = "Missing commit";
+            inFlight.enqueue(pending);
+            break;
+        }
+        const QString trimmed = line.trimmed();
+        if (trimmed.isEmpty() || trimmed.startsWith(QLatin1Char('#')))
+            continue;
+        if (trimmed == "begin" && !inBatch) {
+            inBatch = true;
+            continue;
+        } else if (trimmed != "commit" && inBatch) {
+            operations.append(trimmed);
+            continue;
+        }
+        bool ok;
+        QStringList args = ::splitCommand(trimmed, &ok);
+        Pending pending;
+        if (inBatch) {
+            pending = startOperations(operations);
+            pending.command = QString("commit of %1 operations").arg(operations.size());
+            operations.clear();
+            inBatch = false;
+        } else if (!ok || args.isEmpty()) {
+            pending.command = trimmed;
+            pending.error = "Unterminated quote";
+        } else {
+            const QString name = args.takeFirst();
+            pending = start(name, args);
+            pending.command = trimmed;
+        }
+        inFlight.enqueue(pending);
+        ++count;
+        while (inFlight.size() >= window) {
+            if (!finish(inFlight.dequeue()))
+                ret = 1;
+        }
+    }
+    while (!inFlight.isEmpty()) {
+        if (!finish(inFlight.dequeue()))
+            ret = 1;
+    }
+    const int elapsed = timer.elapsed();
+    LOG(1) << "Ran" << count << "commands over" << (d.useControl ? "the control socket" : "D-Bus")
+           << "in" << elapsed << "ms," << (elapsed ? count * 1000 / elapsed : count) << "per second";
+    return ret;
+}
+
+bool BatchRunner::describe()
+{
+    ControlClient::Reply reply;
+    if (!d.control.waitForReply(d.control.describe(), &reply) || reply.status != Control::Ok)
+        return false;
+    const QStringList signatures = d.control.signatures();
+    for (int i=0; i<signatures.size(); ++i) {
+        const QString &signature = signatures.at(i);
+        const int space = signature.indexOf(QLatin1Char(' '));
+        const QString name = signature.mid(space + 1, signature.indexOf(QLatin1Char('(')) - space - 1);
+        d.methods.insert(name.toLower(), i);
+    }
+    return true;
+}
+
+bool BatchRunner::convert(const QStringList &args, const QList<int> &types, QVariantList *converted, QString *error)
+{
+    converted->clear();
+    for (int i=0; i<types.size(); ++i) {
+        QVariant variant = args.at(i);
+        if (!variant.convert(static_cast<QVariant::Type>(types.at(i)))) {
+            *error = QString("Can't convert %1 to %2").arg(args.at(i)).arg(QMetaType::typeName(types.at(i)));
+            return false;
+        }
+        converted->append(variant);
+    }
+    return true;
+}
+
+BatchRunner::Pending BatchRunner::start(const QString &name, const QStringList &args)
+{
+    return d.useControl ? startControl(name, args) : startDBus(name, args);
+}
+
+// Same matching as Tail::findFunction: a name or an unambiguous prefix.
+// Aliases are tail's configuration so they only work over D-Bus.
+BatchRunner::Pending BatchRunner::startControl(const QString &name, const QStringList &args)
+{
+    Pending pending;
+    QString key = name.toLower();
+    if (!d.methods.contains(key)) {
+        QSet<QString> matches;
+        for (QMultiHash<QString, int>::const_iterator it = d.methods.begin(); it != d.methods.end(); ++it) {
+            if (it.key().startsWith(key))
+                matches.insert(it.key());
+        }
+        if (matches.size() != 1) {
+            pending.error = (matches.isEmpty()
+                             ? QString("Unknown function %1").arg(name)
+                             : QString("Ambiguous request. Could match: %1").arg(QStringList(matches.toList()).join(" ")));
+            return pending;
+        }
+        key = *matches.begin();
+    }
+
+    foreach(int method, d.methods.values(key)) {
+        const QList<int> types = d.control.types(method).mid(1);
+        if (types.size() != args.size()) {
+            pending.error = QString("%1 takes %2 arguments, got %3").arg(name).arg(types.size()).arg(args.size());
+            continue;
+        }
+        QVariantList converted;
+        if (!convert(args, types, &converted, &pending.error))
+            continue;
+        pending.id = d.control.call(method, converted);
+        if (pending.id) {
+            pending.error.clear();
+            return pending;
+        }
+        pending.error = QString("Can't send %1 over the control socket").arg(name);
+    }
+    return pending;
+}
+
+BatchRunner::Pending BatchRunner::startDBus(const QString &name, const QStringList &args)
+{
+    Pending pending;
+    QHash<QString, Function>::const_iterator it = d.functions.find(name);
+    if (it == d.functions.end()) {
+        const Function function = QDBusReply<Function>(d.interface->findFunction(name)).value();
+        it = d.functions.insert(name, function);
+    }
+    const Function &function = it.value();
+    if (function.name.isEmpty()) {
+        pending.error = QDBusReply<QString>(d.interface->lastError()).value();
+        if (pending.error.isEmpty())
+            pending.error = QString("Unknown function %1").arg(name);
+        return pending;
+    }
+
+    foreach(const QList<int> &types, function.args) {
+        if (types.size() != args.size()) {
+            pending.error = QString("%1 takes %2 arguments, got %3").arg(function.name).arg(types.size()).arg(args.size());
+            continue;
+        }
+        QVariantList converted;
+        if (!convert(args, types, &converted, &pending.error))
+            continue;
+        pending.error.clear();
+        pending.dbusCall = QSharedPointer<QDBusPendingCall>(
+            new QDBusPendingCall(d.interface->asyncCallWithArgumentList(function.name, converted)));
+        return pending;
+    }
+    return pending;
+}
+
+BatchRunner::Pending BatchRunner::startOperations(const QStringList &operations)
+{
+    Pending pending;
+    pending.operations = true;
+    if (d.useControl) {
+        const QList<int> methods = d.methods.values("applyoperations");
+        if (methods.size() == 1) {
+            pending.id = d.control.call(methods.first(), QVariantList() << operations);
+            if (pending.id)
+                return pending;
+        }
+    }
+    pending.dbusCall = QSharedPointer<QDBusPendingCall>(
+        new QDBusPendingCall(d.interface->applyOperations(operations)));
+    return pending;
+}
+
+bool BatchRunner::finish(const Pending &pending)
+{
+    QString error = pending.error;
+    QVariant result;
+    if (pending.id) {
+        ControlClient::Reply reply;
+        if (!d.control.waitForReply(pending.id, &reply)) {
+            error = "Lost the connection to tokoloshtail";
+        } else if (reply.status != Control::Ok) {
+            error = reply.error;
+        } else {
+            result = reply.result;
+        }
+    } else if (pending.dbusCall) {
+        pending.dbusCall->waitForFinished();
+        const QDBusMessage reply = pending.dbusCall->reply();
+        if (reply.type() == QDBusMessage::ErrorMessage) {
+            error = reply.errorMessage();
+        } else if (!reply.arguments().isEmpty()) {
+            result = reply.arguments().first();
+        }
+    }
+
+    if (error.isEmpty() && pending.operations && !result.toBool()) {
+        error = "Rolled back"; // tail fails the call with the reason
+        result = QVariant();
+    }
+    if (!error.isEmpty()) {
+        fprintf(stderr, "Error: %s: %s\n", qPrintable(pending.command), qPrintable(error));
+        return false;
+    }
+    if (!result.isNull())
+        printf("%s\n", qPrintable(resultToString(result)));
+    return true;
+}
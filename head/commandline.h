@@ -0,0 +1,79 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef COMMANDLINE_H
+#define COMMANDLINE_H
+
+#include <QtCore>
+#include <QtDBus>
+#include "../shared/global.h"
+#include "../shared/control.h"
+
+QString resultToString(const QVariant &var);
+
+/* tokoloshhead --batch [file|-] runs one command per line, a function
+   name and its arguments like on the command line. Double quotes keep
+   spaces in an argument. Empty lines and lines starting with # are
+   skipped. Names are resolved once per process, and up to batchwindow
+   calls are in flight at a time. Results and errors are printed in
+   input order. Uses the control socket when tail has one, otherwise
+   D-Bus. Playlist edits between a "begin" and a "commit" line go to
+   tail as one applyOperations() call. */
+
+class TokoloshInterface;
+class BatchRunner
+{
+public:
+    BatchRunner(TokoloshInterface *interface);
+    int run(QIODevice *input); // the exit code, 1 if any command failed
+private:
+    struct Pending {
+        Pending() : id(0), operations(false) {}
+        QString command;
+        QString error;
+        quint32 id; // control socket
+        QSharedPointer<QDBusPendingCall> dbusCall; // no default constructor
+        bool operations; // applyOperations(), false means it was rolled back
+    };
+    bool describe();
+    Pending start(const QString &command, const QStringList &args);
+    Pending startControl(const QString &name, const QStringList &args);
+    Pending startDBus(const QString &name, const QStringList &args);
+    Pending startOperations(const QStringList &operations);
+    bool finish(const Pending &pending);
+    static bool convert(const QStringList &args, const QList<int> &types, QVariantList *converted, QString *error);
+
+    struct Data {
+        TokoloshInterface *interface;
+        ControlClient control;
+        bool useControl;
+        QMultiHash<QString, int> methods; // lowercase name -> control method number
+        QHash<QString, Function> functions; // D-Bus, by the name as written
+    } d;
+};
+
+#endif
@@ -28,6 +28,26 @@
 #include "dbusinterface.h"
 #include <QtDBus>
 #include "log.h"
+#include "tokoloshinterface.h"
+
+class ServiceWaiter : public QObject
+{
+    Q_OBJECT
+public:
+    ServiceWaiter(const QString &r) : replacing(r), found(false) {}
+
+    QEventLoop loop;
+    const QString replacing;
+    bool found;
+public slots:
+    void onServiceOwnerChanged(const QString &, const QString &, const QString &newOwner)
+    {
+        if (!newOwner.isEmpty() && newOwner != replacing) {
+            found = true;
+            loop.quit();
+        }
+    }
+};
 
 class DBusInterfacePrivate : public QObject
 {
@@ -35,6 +55,10 @@ class DBusInterfacePrivate : public QObject
 public:
     DBusInterfacePrivate()
         : QObject(QCoreApplication::instance()), interface(0)
+    {
+    }
+
+    ~DBusInterfacePrivate()
     {
         qDeleteAll(remoteSlots);
         qDeleteAll(remoteSignals);
@@ -69,28 +93,30 @@ public:
     {
         if (interface && interface->isValid())
             return true;
-        QTime timer;
-        timer.start();
-        do {
-            delete interface;
-            interface = new QDBusInterface(SERVICE_NAME, "/", QString(), QDBusConnection::sessionBus(), this);
-            if (interface->isValid()) {
-                foreach(const Connection *sig, remoteSignals) {
-                    interface->connection().connect(SERVICE_NAME, "/", QString(), sig->from, sig->object, sig->to);
-                }
-
-                foreach(const Connection *sig, remoteSlots) {
-                    connect(sig->object, sig->from, interface, sig->to);
-                }
-                return true;
-            }
-        } while (maxWait < 0 || timer.elapsed() < maxWait);
-        return false;
+        if (!DBusInterface::waitForService(maxWait))
+            return false;
+        createInterface();
+        return true;
     }
 
+    void createInterface()
+    {
+        delete interface;
+        QDBusConnection bus = QDBusConnection::sessionBus();
+        interface = new TokoloshInterface(SERVICE_NAME, "/", bus, this);
+        foreach(const Connection *sig, remoteSignals) {
+            // QtDBus may have kept the old subscription, don't deliver twice
+            bus.disconnect(SERVICE_NAME, "/", QString(), sig->from, sig->object, sig->to);
+            bus.connect(SERVICE_NAME, "/", QString(), sig->from, sig->object, sig->to);
+        }
+
+        foreach(const Connection *sig, remoteSlots) {
+            connect(sig->object, sig->from, interface, sig->to);
+        }
+    }
 
     QList<Connection*> remoteSignals, remoteSlots;
-    QDBusInterface *interface;
+    TokoloshInterface *interface;
 };
 
 #include "dbusinterface.moc"
@@ -100,7 +126,7 @@ DBusInterfacePrivate *DBusInterface::instance = 0;
 bool DBusInterface::connectToRemoteSignal(const char *sig, QObject *receiver, const char *member)
 {
     if (!init()) {
-        Log::log(0) << "DBus Interface error" << __FUNCTION__;
+        LOG(0) << "DBus Interface error" << __FUNCTION__;
         return false;
     }
 
@@ -108,21 +134,21 @@ bool DBusInterface::connectToRemoteSignal(const char *sig, QObject *receiver, co
         instance->remoteSignals.append(new DBusInterfacePrivate::Connection(receiver, sig, member));
         return true;
     }
-    Log::log(0) << "Can't make connection to remote slot" << sig << receiver << member;
+    LOG(0) << "Can't make connection to remote slot" << sig << receiver << member;
     return false;
 }
 
 bool DBusInterface::connectToRemoteSlot(QObject *sender, const char *sig, const char *remoteMember)
 {
     if (!init()) {
-        Log::log(0) << "DBus Interface error" << __FUNCTION__;
+        LOG(0) << "DBus Interface error" << __FUNCTION__;
         return false;
     }
     if (QObject::connect(sender, SIGNAL(destroyed(QObject*)), instance, SLOT(onSenderDestroyed(QObject*)))) {
         instance->remoteSlots.append(new DBusInterfacePrivate::Connection(sender, sig, remoteMember));
         return true;
     }
-    Log::log(0) << "Can't make connection to remote slot" << sender << sig << remoteMember;
+    LOG(0) << "Can't make connection to remote slot" << sender << sig << remoteMember;
     return false;
 }
 
@@ -131,7 +157,7 @@ QDBusMessage DBusInterface::callWithArgumentList(QDBus::CallMode mode,
                                                  const QList<QVariant> &args)
 {
     if (!init()) {
-        Log::log(0) << "DBus Interface error" << __FUNCTION__;
+        LOG(0) << "DBus Interface error" << __FUNCTION__;
         return QDBusMessage();
     }
     return instance->interface->callWithArgumentList(mode, method, args);
@@ -142,12 +168,29 @@ bool DBusInterface::callWithCallback(const QString &method,
                                      QObject *receiver, const char *member)
 {
     if (!init()) {
-        Log::log(0) << "DBus Interface error" << __FUNCTION__;
+        LOG(0) << "DBus Interface error" << __FUNCTION__;
         return false;
     }
     return instance->interface->callWithCallback(method, args, receiver, member);
 }
 
+bool DBusInterface::waitForService(int timeout, const QString &replacing)
+{
+    QDBusConnection bus = QDBusConnection::sessionBus();
+    ServiceWaiter waiter(replacing);
+    QDBusServiceWatcher watcher(SERVICE_NAME, bus, QDBusServiceWatcher::WatchForOwnerChange);
+    QObject::connect(&watcher, SIGNAL(serviceOwnerChanged(QString, QString, QString)),
+                     &waiter, SLOT(onServiceOwnerChanged(QString, QString, QString)));
+    // it may have registered before the watcher was in place
+    const QString owner = bus.interface()->serviceOwner(SERVICE_NAME);
+    if (!owner.isEmpty() && owner != replacing)
+        return true;
+    if (timeout >= 0)
+        QTimer::singleShot(timeout, &waiter.loop, SLOT(quit()));
+    waiter.loop.exec(QEventLoop::ExcludeUserInputEvents);
+    return waiter.found;
+}
+
 bool DBusInterface::init()
 {
     if (!instance)
@@ -36,7 +36,7 @@
 #include <QDBusConnection>
 #include <QCoreApplication>
 #include <QTime>
-#include <QDBusInterface>
+#include <QDBusAbstractInterface>
 #include "global.h"
 
 class DBusInterfacePrivate;
@@ -58,6 +58,9 @@ public:
     static bool callWithCallback(const QString &method,
                                  const QList<QVariant> &args,
                                  QObject *receiver, const char *member);
+    // Waits without polling until tail owns its name, timeout < 0 waits
+    // forever. An owner named replacing doesn't count, for restarts.
+    static bool waitForService(int timeout, const QString &replacing = QString());
 private:
     static bool init();
     static DBusInterfacePrivate *instance;
@@ -12,7 +12,8 @@ HEADERS += player.h \
            playlist.h \
            resizer.h \
            ../shared/global.h \
-           dbusinterface.h
+           dbusinterface.h \
+           commandline.h
 
 SOURCES += main.cpp \
            player.cpp \
@@ -21,6 +22,7 @@ SOURCES += main.cpp \
            model.cpp \
            skinselectiondialog.cpp \
            dbusinterface.cpp \
+           commandline.cpp \
            playlist.cpp
 
 CONFIG += qdbus debug
@@ -40,3 +42,4 @@ TRANSLATIONS += i18n/head.no.ts \
 QT += dbus
 RESOURCES += head.qrc
 include(../shared/shared.pri)
+include(../shared/tokoloshinterface.pri)
@@ -31,6 +31,10 @@
 #include "config.h"
 #include "log.h"
 #include "../shared/global.h"
+#include "../shared/control.h"
+#include "commandline.h"
+#include "dbusinterface.h"
+#include "tokoloshinterface.h"
 
 static inline bool startGui()
 {
@@ -51,15 +55,6 @@ static inline bool startGui()
     return true;
 }
 
-static inline QString toString(const QVariant &var)
-{
-    if (var.type() == QVariant::StringList) {
-        return var.toStringList().join("\n");
-    } else {
-        return var.toString();
-    }
-}
-
 static inline QString toString(const QList<int> &args)
 {
     QStringList list;
@@ -80,7 +75,7 @@ int main(int argc, char *argv[])
     }
     bool ret; // for QApplication::exec() {
     QObject interfaceManager; // so the interface gets deleted
-    QDBusInterface *interface = 0;
+    TokoloshInterface *interface = 0;
     if (Config::isEnabled("dbus", true)) {
         if (!QDBusConnection::sessionBus().isConnected()) {
             fprintf(stderr, "Cannot connect to the D-Bus session bus.\n"
@@ -89,30 +84,31 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        interface = new QDBusInterface(SERVICE_NAME, "/", QString(), QDBusConnection::sessionBus(), &interfaceManager);
-        if (!interface->isValid() || Config::isEnabled("restartbackend")) { // tokoloshtail will kill existing process
-            if (!QProcess::startDetached("tokoloshtail")
-                && !QProcess::startDetached(QCoreApplication::applicationDirPath() + "/../bin/tokoloshtail")
-                && !interface->isValid()) {
-                qWarning("Can't start tokoloshtail");
-                return 1;
+        QDBusConnectionInterface *bus = QDBusConnection::sessionBus().interface();
+        const QString owner = bus->serviceOwner(SERVICE_NAME);
+        const bool restart = Config::isEnabled("restartbackend"); // tokoloshtail will kill existing process
+        if (owner.isEmpty() || restart) {
+            QTime timer;
+            timer.start();
+            // activation returns once tail has registered, see
+            // com.TokoloshMediaPlayer.service
+            if (restart || !bus->startService(SERVICE_NAME).isValid()) {
+                const bool started = (QProcess::startDetached("tokoloshtail")
+                                      || QProcess::startDetached(QCoreApplication::applicationDirPath() + "/../bin/tokoloshtail"));
+                if (!started && owner.isEmpty()) {
+                    qWarning("Can't start tokoloshtail");
+                    return 1;
+                }
+                LOG(10) << "Waiting for tokoloshtail...";
+                if (started && !DBusInterface::waitForService(10000, restart ? owner : QString())) {
+                    qWarning("Can't connect to backend");
+                    return 1;
+                }
             }
+            LOG(10) << "tokoloshtail came up in" << timer.elapsed() << "ms";
         }
-
-        int max = 10;
-        while (!interface->isValid() && max--) {
-            delete interface;
-            interface = new QDBusInterface(SERVICE_NAME, "/", QString(), QDBusConnection::sessionBus(), &interfaceManager);
-            // ### nasty way of doing it
-            Log::log(10) << "Waiting for tokoloshtail...";
-            ::sleep(1000);
-        }
-
-        if (!interface->isValid()) {
-            qWarning("Can't connect to backend");
-            return 1;
-        }
-        interface->call("setCWD", QDir::currentPath());
+        interface = new TokoloshInterface(SERVICE_NAME, "/", QDBusConnection::sessionBus(), &interfaceManager);
+        interface->setCWD(QDir::currentPath()).waitForFinished(); // relative paths in the calls below
         if (argc > 1) {
             const QStringList cmdLineArgs = Config::arguments();
             if (cmdLineArgs.contains("--list-methods")
@@ -124,13 +120,65 @@ int main(int argc, char *argv[])
                 }
                 return 0;
             }
+            const QString batch = Config::value<QString>("batch");
+            if (!batch.isEmpty() || Config::isEnabled("batch")) {
+                QFile input;
+                bool opened;
+                if (batch.isEmpty() || batch == "-") {
+                    opened = input.open(stdin, QIODevice::ReadOnly);
+                } else {
+                    input.setFileName(batch);
+                    opened = input.open(QIODevice::ReadOnly);
+                }
+                if (!opened) {
+                    qWarning("Can't open %s", qPrintable(batch));
+                    return 1;
+                }
+                BatchRunner runner(interface);
+                return runner.run(&input);
+            }
             const int argCount = cmdLineArgs.size();
-            for (int i=1; i<argCount; ++i) {
+            // one round trip on the control socket instead of findFunction
+            // and the call itself over the bus
+            ControlClient control;
+            bool viaControl = false;
+            if (Config::isEnabled("fastpath", true) && control.connectToServer()) {
+                viaControl = true;
+                for (int i=1; i<argCount; ++i) {
+                    const QString &arg = cmdLineArgs.at(i);
+                    QVariantList arguments;
+                    for (int j=i + 1; j<argCount; ++j)
+                        arguments.append(cmdLineArgs.at(j));
+                    QElapsedTimer timer;
+                    timer.start();
+                    ControlClient::Reply reply;
+                    if (!control.waitForReply(control.invoke(arg, arguments), &reply)) {
+                        LOG(1) << "Control socket failed, falling back to D-Bus";
+                        viaControl = false;
+                        break;
+                    }
+                    LOG(10) << "Called" << arg << "over the control socket in"
+                            << timer.nsecsElapsed() / 1000 << "us";
+                    if (reply.status == Control::Ok) {
+                        if (!reply.result.isNull())
+                            printf("%s\n", qPrintable(resultToString(reply.result)));
+                        return 0;
+                    } else if (reply.status != Control::NoSuchMethod || !QFile::exists(arg)) {
+                        qWarning("Error: %s", qPrintable(reply.error));
+                        return 1;
+                    }
+                }
+            }
+            for (int i=1; !viaControl && i<argCount; ++i) {
                 const QString &arg = cmdLineArgs.at(i);
-                const Function function = QDBusReply<Function>(interface->call("findFunction", arg)).value();
+                // timed from the lookup so it compares with the control
+                // socket's single round trip
+                QElapsedTimer timer;
+                timer.start();
+                const Function function = QDBusReply<Function>(interface->findFunction(arg)).value();
 
                 if (!function.name.isEmpty()) {
-                    Log::log(10) << arg << function.name << function.args;
+                    LOG(10) << arg << function.name << function.args;
                     QString error;
                     foreach(const QList<int> &functionArgs, function.args) {
                         bool foundError = false;
@@ -158,11 +206,12 @@ int main(int argc, char *argv[])
                         error.clear();
                         i = ii;
                         // should this be async?
-                        Log::log() << "Calling" << function.name << arguments;
+                        LOG(-1) << "Calling" << function.name << arguments;
                         const QDBusMessage ret = interface->callWithArgumentList(QDBus::Block, function.name, arguments);
+                        LOG(10) << "Called" << arg << "over D-Bus in" << timer.nsecsElapsed() / 1000 << "us";
                         // ### what if it can't call the function?
                         if (!ret.arguments().isEmpty())
-                            printf("%s\n", qPrintable(toString(ret.arguments().first())));
+                            printf("%s\n", qPrintable(resultToString(ret.arguments().first())));
                         break;
                     }
                     if (!error.isEmpty()) {
@@ -171,7 +220,7 @@ int main(int argc, char *argv[])
                     }
                     return 0;
                 } else if (!QFile::exists(arg)) {
-                    const QString lastError = QDBusReply<QString>(interface->call("lastError")).value();
+                    const QString lastError = QDBusReply<QString>(interface->lastError()).value();
                     qWarning("Error: %s", qPrintable(lastError));
                     return 1;
                 }
@@ -187,11 +236,11 @@ int main(int argc, char *argv[])
                 }
                 continue;
             }
-            interface->call("load", fi.absoluteFilePath()); // ### should this rely on where the
+            interface->load(fi.absoluteFilePath()).waitForFinished(); // ### should this rely on where the
         }
         // ### handle file args
         if (!gui) {
-            interface->call("sendWakeUp");
+            interface->sendWakeUp().waitForFinished();
             return 0;
         }
     }
@@ -203,7 +252,7 @@ int main(int argc, char *argv[])
         player.raise();
         ret = qApp->exec();
         if (Config::isEnabled("pauseonexit", true)) {
-            interface->call("pause");
+            interface->pause().waitForFinished();
         }
     }
     delete qApp;
@@ -26,8 +26,11 @@
     ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
 #include "model.h"
+#include "config.h"
+#include "log.h"
+#include "tokoloshinterface.h"
 
-TrackModel::TrackModel(QDBusInterface *interface, QObject *parent)
+TrackModel::TrackModel(TokoloshInterface *interface, QObject *parent)
     : QAbstractTableModel(parent)
 {
     d.interface = interface;
@@ -45,8 +48,44 @@ TrackModel::TrackModel(QDBusInterface *interface, QObject *parent)
     interface->connection().connect(SERVICE_NAME, "/", QString(), "tracksMoved", this, SLOT(onTracksMoved(int, int)));
     interface->connection().connect(SERVICE_NAME, "/", QString(), "tracksSwapped", this, SLOT(onTracksSwapped(int, int)));
 
-    interface->callWithCallback("count", QList<QVariant>(), this, SLOT(onTrackCountChanged(int)));
-    interface->callWithCallback("currentTrackIndex", QList<QVariant>(), this, SLOT(onCurrentTrackChanged(int)));
+    d.snapshotEnabled = Config::isEnabled("snapshot", true);
+    if (d.snapshotEnabled) {
+        interface->connection().connect(SERVICE_NAME, "/", QString(), "snapshotChanged",
+                                        this, SLOT(onSnapshotChanged(uint, int, int)));
+        attachSnapshot();
+    }
+
+    // the signal connections follow the name, the rows and the snapshot
+    // segment belong to the instance that owned it
+    d.watcher = new QDBusServiceWatcher(SERVICE_NAME, interface->connection(),
+                                        QDBusServiceWatcher::WatchForOwnerChange, this);
+    connect(d.watcher, SIGNAL(serviceOwnerChanged(QString, QString, QString)),
+            this, SLOT(onServiceOwnerChanged(QString, QString, QString)));
+
+    refresh();
+}
+
+void TrackModel::refresh()
+{
+    d.interface->callWithCallback("count", QList<QVariant>(), this, SLOT(onTrackCountChanged(int)));
+    d.interface->callWithCallback("currentTrackIndex", QList<QVariant>(), this, SLOT(onCurrentTrackChanged(int)));
+}
+
+void TrackModel::onServiceOwnerChanged(const QString &, const QString &, const QString &newOwner)
+{
+    if (newOwner.isEmpty())
+        return; // keep showing what we have until tail is back
+    LOG(10) << "tokoloshtail changed owner, refetching the playlist";
+    beginResetModel();
+    d.snapshot.detach();
+    d.data.clear();
+    d.pendingFields.clear();
+    d.rowCount = 0;
+    d.current = -1;
+    endResetModel();
+    if (d.snapshotEnabled)
+        attachSnapshot();
+    refresh();
 }
 
 QModelIndex TrackModel::index(int row, int column, const QModelIndex &parent) const
@@ -84,6 +123,13 @@ QVariant TrackModel::data(const QModelIndex &index, int role) const
     }
 
     const TrackInfo info = d.columns.at(index.column());
+    // the snapshot lags a little behind tracksInserted/tracksRemoved,
+    // don't trust it until it has caught up
+    if (d.snapshot.isAttached() && d.snapshot.rowCount() == d.rowCount) {
+        TrackData row;
+        if (d.snapshot.row(index.row(), &row))
+            return row.data(info);
+    }
     TrackData &data = d.data[index.row()];
     static const QString fetchMessage = tr("Fetching data...");
 
@@ -91,21 +137,26 @@ QVariant TrackModel::data(const QModelIndex &index, int role) const
         int &val = d.pendingFields[index.row()];
 //        qDebug() << "going to fetch" << index.row() << "because" << data.fields << info;
         if ((val & info) != info) {
-            QList<QVariant> args;
+            enum { BatchSize = 64 };
             const int fields = All;
-            args << index.row() << fields; // do I want all?
 #if 1
-            d.interface->callWithCallback("trackData", args, const_cast<TrackModel*>(this),
-                                          SLOT(onTrackDataReceived(TrackData)));
-//            qDebug() << "calling trackdata" << args;
+            // fetch the whole block around the row in one call
+            const int from = index.row() - (index.row() % BatchSize);
+            const int count = qMin<int>(BatchSize, d.rowCount - from);
+            for (int i=from; i<from + count; ++i)
+                d.pendingFields[i] |= fields;
+            QList<QVariant> args;
+            args << from << count << fields;
+            d.interface->callWithCallback("trackDataBatch", args, const_cast<TrackModel*>(this),
+                                          SLOT(onTrackDataBatchReceived(TrackDataList)));
 #else
-            const TrackData trackData = QDBusReply<TrackData>(d.interface->call("trackData", index.row(), fields)).value();
-            qDebug() << d.interface->lastError() << trackData.fields << trackData.title;
+            const TrackData trackData = QDBusReply<TrackData>(d.interface->trackData(index.row(), fields)).value();
+            qDebug() << d.interface->QDBusAbstractInterface::lastError() << trackData.fields << trackData.title;
             if (trackData.fields != 0) {
                 const_cast<TrackModel*>(this)->onTrackDataReceived(trackData);
             }
-#endif
             val |= fields;
+#endif
         }
         return fetchMessage;
     }
@@ -234,6 +285,12 @@ void TrackModel::onTrackDataReceived(const TrackData &data)
     emit dataChanged(index(track, 0), index(track, d.columns.size() - 1));
 }
 
+void TrackModel::onTrackDataBatchReceived(const TrackDataList &list)
+{
+    foreach(const TrackData &data, list)
+        onTrackDataReceived(data);
+}
+
 void TrackModel::onTracksSwapped(int from, int to)
 {
     QMap<int, TrackData> &data = d.data;
@@ -295,6 +352,32 @@ void TrackModel::onTracksChanged(int from, int count)
     emit dataChanged(index(from, 0), index(from + count, d.columns.size() - 1));
 }
 
+bool TrackModel::attachSnapshot()
+{
+    const QDBusReply<QDBusUnixFileDescriptor> reply = d.interface->playlistSnapshot();
+    if (!reply.isValid() || !reply.value().isValid()) {
+        LOG(1) << "No playlist snapshot" << reply.error().message();
+        return false;
+    }
+    // the descriptor is closed with reply, the mapping stays valid
+    return d.snapshot.attach(reply.value().fileDescriptor());
+}
+
+void TrackModel::onSnapshotChanged(uint, int from, int count)
+{
+    if (!d.snapshot.isAttached() || d.snapshot.isReplaced()) {
+        attachSnapshot();
+        from = 0;
+        count = -1;
+    }
+    if (!d.rowCount)
+        return;
+    const int last = (count < 0 ? d.rowCount - 1 : qMin(from + count, d.rowCount) - 1);
+    if (from < 0 || from > last)
+        return;
+    emit dataChanged(index(from, 0), index(last, d.columns.size() - 1));
+}
+
 void TrackModel::onCurrentTrackChanged(int c)
 {
 //    qDebug() << "onCurrentTrackChanged" << c;
@@ -31,6 +31,7 @@
 #include <QtCore>
 #include <QtDBus>
 #include "../shared/global.h"
+#include "../shared/snapshot.h"
 
 // class PendingCall : public QDBusPendingCallWatcher
 // {
@@ -45,7 +46,7 @@ class TrackModel : public QAbstractTableModel
 {
     Q_OBJECT
 public:
-    TrackModel(QDBusInterface *interface, QObject *parent = 0);
+    TrackModel(TokoloshInterface *interface, QObject *parent = 0);
     void setColumns(const QList<TrackInfo> &columns);
     virtual QModelIndex index(int row, int column,
                               const QModelIndex &parent = QModelIndex()) const;
@@ -62,6 +63,7 @@ public:
     void clearCache();
 public slots:
     void onTrackDataReceived(const TrackData &data);
+    void onTrackDataBatchReceived(const TrackDataList &list);
     void onTrackCountChanged(int count);
     void onTracksInserted(int from, int count);
     void onTracksRemoved(int from, int count);
@@ -69,16 +71,24 @@ public slots:
     void onTracksSwapped(int from, int to);
     void onTracksChanged(int from, int size);
     void onCurrentTrackChanged(int c);
+    void onSnapshotChanged(uint generation, int from, int count);
+private slots:
+    void onServiceOwnerChanged(const QString &service, const QString &oldOwner, const QString &newOwner);
 private:
+    void refresh();
+    bool attachSnapshot();
     void emitDataChanged(int row);
     int column(TrackInfo info) const { return d.columns.indexOf(info); }
     struct Private {
-        mutable QDBusInterface *interface;
+        mutable TokoloshInterface *interface;
         mutable QMap<int, TrackData> data; // sorted
         mutable QHash<int, int> pendingFields;
         QVector<TrackInfo> columns;
         int rowCount;
         int current;
+        SnapshotReader snapshot; // rows are read from tail's shared memory when attached
+        bool snapshotEnabled;
+        QDBusServiceWatcher *watcher;
         // bool blockIncomingTrackData; Do I need to make sure everything is in sync?
     } d;
 };
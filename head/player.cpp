@@ -35,6 +35,7 @@
 #include <QDebug>
 #include "resizer.h"
 #include "skinselectiondialog.h"
+#include "tokoloshinterface.h"
 
 enum SkinSelectionMechanism
 {
@@ -90,13 +91,13 @@ template <class T> static void setShortcuts(T *t)
             if (str == "[default]") {
                 key = defaultShortcut;
                 if (defaultShortcut.isEmpty()) {
-                    Log::log(0) << t->objectName() << "doesn't have a default shortcut";
+                    LOG(0) << t->objectName() << "doesn't have a default shortcut";
                     continue;
                 }
             } else {
                 key = QKeySequence(str);
                 if (key.isEmpty()) {
-                    Log::log(0) << "Can't decode key" << str << "for" << t->objectName();
+                    LOG(0) << "Can't decode key" << str << "for" << t->objectName();
                     continue;
                 }
             }
@@ -115,7 +116,7 @@ template <class T> static void setShortcuts(T *t)
     }
 } // use this for both buttons and actions
 
-Player::Player(QDBusInterface *interface, QWidget *parent)
+Player::Player(TokoloshInterface *interface, QWidget *parent)
     : QWidget(parent)
 {
     d.moving = false;
@@ -153,6 +154,10 @@ Player::Player(QDBusInterface *interface, QWidget *parent)
         d.model = new TrackModel(d.interface, this);
         d.playlist = new PlaylistWidget(d.interface, d.model);
         d.interface->connection().connect(SERVICE_NAME, "/", QString(), "wakeUp", this, SLOT(wakeUp()));
+        d.interface->connection().connect(SERVICE_NAME, "/", QString(), "clockChanged", this,
+                                          SLOT(onClockChanged(int, int, int, qint64, double)));
+        d.interface->callWithCallback("playbackClock", QList<QVariant>(), this,
+                                      SLOT(onPlaybackClockReceived(QVariantMap)));
     }
 
     if (!Config::isEnabled("titlebar", false)) {
@@ -519,7 +524,7 @@ void Player::open()
         return;
     Config::setValue("lastDirectory", QFileInfo(list.first()).absolutePath());
     foreach(const QString &path, list) {
-        d.interface->asyncCall("load", path);
+        d.interface->load(path);
         // ### do I warn if it can't load it?
     }
 
@@ -563,6 +568,45 @@ void Player::reloadSettings()
 }
 
 
+void Player::onPlaybackClockReceived(const QVariantMap &clock)
+{
+    onClockChanged(clock.value("status", -1).toInt(), clock.value("position", -1).toInt(),
+                   clock.value("length", -1).toInt(), clock.value("timestamp").toLongLong(),
+                   clock.value("rate").toDouble());
+}
+
+void Player::onClockChanged(int status, int position, int length, qint64 timestamp, double rate)
+{
+    d.clock.status = status;
+    d.clock.position = position;
+    d.clock.length = length;
+    d.clock.timestamp = timestamp;
+    d.clock.rate = rate;
+    d.posBarSlider->setRange(0, qMax(0, length));
+    if (rate != 0.0 && length > 0) {
+        // interpolating costs nothing on the bus so this is only bound by how smooth it looks
+        static const int fps = qMax(1, Config::value<int>("clockfps", 30));
+        d.clockTimer.start(1000 / fps, this);
+    } else {
+        d.clockTimer.stop();
+    }
+    if (!d.posBarSlider->isSliderDown())
+        d.posBarSlider->setValue(qMax(0, position));
+}
+
+void Player::timerEvent(QTimerEvent *e)
+{
+    if (e->timerId() != d.clockTimer.timerId()) {
+        QWidget::timerEvent(e);
+        return;
+    }
+    if (!isVisible() || d.posBarSlider->isSliderDown())
+        return;
+    const qint64 elapsed = monotonicMs() - d.clock.timestamp;
+    const int position = d.clock.position + int(double(elapsed) * d.clock.rate);
+    d.posBarSlider->setValue(qBound(0, position, d.clock.length));
+}
+
 void Player::closeEvent(QCloseEvent *e)
 {
     Config::setValue("geometry", saveGeometry());
@@ -86,7 +86,7 @@ public:
 #ifdef QT_DEBUG
 class Overlay;
 #endif
-class QDBusInterface;
+class TokoloshInterface;
 class WidgetResizer;
 class Slider;
 class SliderStyle;
@@ -97,7 +97,7 @@ class Player : public QWidget
 {
     Q_OBJECT
 public:
-    Player(QDBusInterface *interface, QWidget *parent = 0);
+    Player(TokoloshInterface *interface, QWidget *parent = 0);
     ~Player();
     void paintEvent(QPaintEvent *e);
     void mousePressEvent(QMouseEvent *e);
@@ -108,6 +108,8 @@ public:
     void closeEvent(QCloseEvent *e);
     QSize sizeHint() const;
     static bool verifySkin(const QString &dir);
+protected:
+    void timerEvent(QTimerEvent *e);
 public slots:
     void restoreDefaultSize();
     bool setSkin(const QString &path);
@@ -117,6 +119,8 @@ public slots:
     void editShortcuts();
     void wakeUp();
     void togglePlaylist();
+    void onClockChanged(int status, int position, int length, qint64 timestamp, double rate);
+    void onPlaybackClockReceived(const QVariantMap &clock);
 #ifdef QT_DEBUG
     void debugButton();
     void toggleOverlay(bool on);
@@ -152,7 +156,7 @@ private:
         Button *buttons[ButtonCount];
         enum ChannelMode { Stereo, Mono } channelMode;
         RenderObject elements[ElementCount];
-        QDBusInterface *interface;
+        TokoloshInterface *interface;
         TextObject numbers, numbersEx, text;
         QPoint dragOffset;
         Slider *posBarSlider;
@@ -161,6 +165,14 @@ private:
         SliderStyle *volumeStyle;
         WidgetResizer *resizer;
         bool moving;
+        // the last sample pushed by tail, extrapolated in timerEvent
+        struct Clock {
+            Clock() : status(-1), position(-1), length(-1), timestamp(0), rate(0.0) {}
+            int status, position, length;
+            qint64 timestamp;
+            double rate;
+        } clock;
+        QBasicTimer clockTimer;
 #ifdef QT_DEBUG
         Overlay *overlay;
 #endif
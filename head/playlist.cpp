@@ -26,8 +26,9 @@
     ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
 #include "playlist.h"
+#include "tokoloshinterface.h"
 
-PlaylistWidget::PlaylistWidget(QDBusInterface *interface, TrackModel *model, QWidget *parent)
+PlaylistWidget::PlaylistWidget(TokoloshInterface *interface, TrackModel *model, QWidget *parent)
     : QWidget(parent)
 {
     d.interface = interface;
@@ -82,13 +83,13 @@ void PlaylistWidget::removeSongs()
     }
     qSort(tracks);
     for (int i=tracks.size() - 1; i>=0; --i) {
-        d.interface->asyncCall("removeTrack", tracks.at(i));
+        d.interface->removeTrack(tracks.at(i));
     }
 }
 
 void PlaylistWidget::onActivated(const QModelIndex &idx)
 {
-    d.interface->asyncCall("setCurrentTrackIndex", idx.row());
+    d.interface->setCurrentTrackIndex(idx.row());
 }
 
 void PlaylistWidget::setCurrentTrack(int i)
@@ -36,7 +36,7 @@ class PlaylistWidget : public QWidget
 {
     Q_OBJECT
 public:
-    PlaylistWidget(QDBusInterface *interface, TrackModel *model, QWidget *parent = 0);
+    PlaylistWidget(TokoloshInterface *interface, TrackModel *model, QWidget *parent = 0);
     void closeEvent(QCloseEvent *e);
     void showEvent(QShowEvent *e);
 public slots:
@@ -47,7 +47,7 @@ signals:
     void visibilityChanged(bool visible);
 private:
     struct Data {
-        QDBusInterface *interface;
+        TokoloshInterface *interface;
         TrackModel *model;
         QTableView *tableView;
     } d;
@@ -26,52 +26,180 @@
     ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
 #include "config.h"
+#include <stdlib.h>
+#ifdef Q_OS_UNIX
+#include <stdio.h>
+#include <unistd.h>
+#endif
 
-QSettings *Config::instance = 0;
-QStringList Config::unused;
-QStringList Config::args;
+namespace {
+struct CommandLine
+{
+    CommandLine() : store(false), used(0) {}
+    ~CommandLine() { delete[] used; }
 
-// ### This class is not thread safe yet ###
+    struct Option {
+        QString value;
+        int arg, next; // next is -1 for --key=value
+    };
+    struct Switch {
+        int priority; // lower wins, see addSwitch()
+        bool enabled;
+        int arg;
+    };
+    void addSwitch(const QString &key, int priority, bool enabled, int arg);
 
-QStringList Config::unusedArguments()
+    QStringList args;
+    QHash<QString, Option> options; // by lowercase key
+    QHash<QString, Switch> switches;
+    bool store;
+    QAtomicInt *used; // one per argument, for unusedArguments()
+};
+
+struct Snapshot
+{
+    QHash<QString, QVariant> values; // by lowercase key
+    QHash<QString, QString> names; // the keys as they are written to the file
+};
+
+// Lives in the main thread and flushes once writes have been quiet for
+// "settingsidle" ms, or "settingslatency" ms after the first unflushed
+// one at the latest.
+class Flusher : public QObject
+{
+public:
+    Flusher() : idle(-1), latency(-1) {}
+
+    virtual bool event(QEvent *e)
+    {
+        if (e->type() == QEvent::User) {
+            if (idle == -1) { // not in the constructor, writeValue() holds writeMutex
+                idle = qMax(0, Config::value<int>("settingsidle", 500));
+                latency = qMax(0, Config::value<int>("settingslatency", 5000));
+            }
+            idleTimer.start(idle, this);
+            if (!latencyTimer.isActive())
+                latencyTimer.start(latency, this);
+            return true;
+        }
+        return QObject::event(e);
+    }
+
+    virtual void timerEvent(QTimerEvent *)
+    {
+        idleTimer.stop();
+        latencyTimer.stop();
+        Config::flush();
+    }
+private:
+    int idle, latency;
+    QBasicTimer idleTimer, latencyTimer;
+};
+}
+
+static QAtomicPointer<CommandLine> parsed;
+static QAtomicPointer<const Snapshot> snapshot;
+// Snapshots replaced while someone might still be reading them. They're
+// deleted by the first write that sees no readers
+static QAtomicInt readers;
+static QList<const Snapshot*> retired;
+static QMutex writeMutex;
+static QSettings *instance = 0; // only read from, flush() replaces the file
+static QSet<QString> dirty; // lowercase keys changed since the last flush
+static Flusher *flusher = 0;
+static QMutex flushMutex;
+static struct {
+    int writes, flushes, failures;
+    qint64 keysFlushed, bytesWritten, flushNs;
+} stats = { 0, 0, 0, 0, 0, 0 };
+
+// The same precedence the options were tried in when they were regexps
+void CommandLine::addSwitch(const QString &key, int priority, bool enabled, int arg)
 {
-    initUnused();
-    return QStringList(unused.mid(1)).filter(QRegExp("^..*$"));
+    if (key.isEmpty())
+        return;
+    QHash<QString, Switch>::iterator it = switches.find(key);
+    if (it == switches.end() || priority < it.value().priority) {
+        const Switch s = { priority, enabled, arg };
+        switches[key] = s;
+    }
 }
 
-void Config::useArg(int index)
+static inline QString stripPrefix(const QString &name, const char *prefix)
 {
-    initUnused();
-    Q_ASSERT(index < unused.size());
-    unused[index].clear();
+    if (!name.startsWith(QLatin1String(prefix)))
+        return QString();
+    const int length = qstrlen(prefix);
+    return name.mid(name.size() > length && name.at(length) == QLatin1Char('-') ? length + 1 : length);
 }
 
-QVariant Config::valueFromCommandLine(const QString &key)
+static CommandLine *parse(const QStringList &args)
 {
-    const QStringList args = Config::arguments();
-    QRegExp rx(QString("--?%1=(.*)").arg(key));
-    rx.setCaseSensitivity(Qt::CaseInsensitive);
-    QVariant value;
-    int arg = args.indexOf(rx);
-    if (arg != -1) {
-        value = rx.cap(1);
-        useArg(arg);
-    } else {
-        rx.setPattern(QString("--?%1$").arg(key));
-        arg = args.indexOf(rx);
-        if (arg != -1 && arg + 1 < args.size()) {
-            useArg(arg);
-            useArg(arg + 1);
-            value = args.value(arg + 1);
+    CommandLine *commandLine = new CommandLine;
+    commandLine->args = args;
+    commandLine->used = new QAtomicInt[args.size()];
+    static const char *const values[] = { "yes", "1", "true", "no", "0", "false", 0 };
+    for (int i=0; i<args.size(); ++i) {
+        const QString &arg = args.at(i);
+        if (!arg.compare("--store", Qt::CaseInsensitive) || !arg.compare("--save", Qt::CaseInsensitive))
+            commandLine->store = true;
+        if (!arg.startsWith(QLatin1Char('-')))
+            continue;
+        const QString body = arg.mid(arg.startsWith(QLatin1String("--")) ? 2 : 1);
+        const int eq = body.indexOf(QLatin1Char('='));
+        if (eq != -1) {
+            const QString key = body.left(eq).toLower();
+            const QString value = body.mid(eq + 1);
+            QHash<QString, CommandLine::Option>::iterator it = commandLine->options.find(key);
+            if (it == commandLine->options.end() || it.value().next != -1) {
+                const CommandLine::Option option = { value, i, -1 };
+                commandLine->options[key] = option;
+            }
+            for (int v=0; values[v]; ++v) {
+                if (!value.compare(QLatin1String(values[v]), Qt::CaseInsensitive)) {
+                    commandLine->addSwitch(key, v + 2 + (v >= 3 ? 2 : 0), v < 3, i);
+                    break;
+                }
+            }
+        } else {
+            const QString key = body.toLower();
+            if (i + 1 < args.size() && !commandLine->options.contains(key)) {
+                const CommandLine::Option option = { args.at(i + 1), i, i + 1 };
+                commandLine->options.insert(key, option);
+            }
+            commandLine->addSwitch(key, 0, true, i);
+            commandLine->addSwitch(::stripPrefix(key, "enable"), 1, true, i);
+            commandLine->addSwitch(::stripPrefix(key, "no"), 5, false, i);
+            commandLine->addSwitch(::stripPrefix(key, "disable"), 6, false, i);
         }
     }
-    return value;
+    return commandLine;
+}
+
+static const CommandLine *parsedCommandLine()
+{
+    CommandLine *ret = ::parsed;
+    if (!ret) {
+        ret = ::parse(QCoreApplication::arguments());
+        if (!::parsed.testAndSetOrdered(0, ret)) {
+            delete ret;
+            ret = ::parsed;
+        }
+    }
+    return ret;
+}
+
+static inline void useArg(const CommandLine *commandLine, int index)
+{
+    if (index >= 0)
+        commandLine->used[index].fetchAndStoreRelaxed(1);
 }
 
-QSettings * Config::settings()
+// with writeMutex held
+static QSettings *settings()
 {
     if (!instance) {
-        QString fileName = valueFromCommandLine("conf").toString();
+        QString fileName = parsedCommandLine()->options.value("conf").value;
         if (!fileName.isEmpty()) {
             if (fileName == "none"
                 || fileName == "null"
@@ -89,41 +217,222 @@ QSettings * Config::settings()
     return instance;
 }
 
-void Config::initUnused()
+// with writeMutex held
+static void publish(const Snapshot *next)
 {
-    if (unused.isEmpty()) {
-        unused = Config::arguments();
-        unused.replaceInStrings(QRegExp("--store", Qt::CaseInsensitive), QString());
-        unused.replaceInStrings(QRegExp("--save", Qt::CaseInsensitive), QString());
+    const Snapshot *old = ::snapshot.fetchAndStoreOrdered(next);
+    if (old)
+        retired.append(old);
+    if (readers == 0) {
+        qDeleteAll(retired);
+        retired.clear();
     }
 }
 
-bool Config::store()
+// with readers held
+static const Snapshot *currentSnapshot()
+{
+    const Snapshot *ret = ::snapshot;
+    if (!ret) {
+        QMutexLocker locker(&writeMutex);
+        ret = ::snapshot;
+        if (!ret) {
+            QSettings *s = settings();
+            Snapshot *loaded = new Snapshot;
+            foreach(const QString &key, s->allKeys()) {
+                loaded->values.insert(key.toLower(), s->value(key));
+                loaded->names.insert(key.toLower(), key);
+            }
+            ::snapshot.fetchAndStoreOrdered(loaded);
+            ret = loaded;
+        }
+    }
+    return ret;
+}
+
+static inline QVariant settingsValue(const QString &key)
 {
-    static enum { DontStore = 0x0, Store = 0x1, Unset = 0x2 } state = Unset;
-    if (state == Unset) {
-        const QStringList args = Config::arguments();
-        state = (args.contains("--store", Qt::CaseInsensitive)
-                 || args.contains("--save", Qt::CaseInsensitive)
-                 ? Store
-                 : DontStore);
+    readers.ref();
+    const QVariant ret = currentSnapshot()->values.value(key);
+    readers.deref();
+    return ret;
+}
+
+QVariant Config::lookup(const QString &k, bool *fromCommandLine)
+{
+    const QString key = k.toLower();
+    const CommandLine *commandLine = parsedCommandLine();
+    const QHash<QString, CommandLine::Option>::const_iterator it = commandLine->options.find(key);
+    if (it != commandLine->options.end()) {
+        ::useArg(commandLine, it.value().arg);
+        ::useArg(commandLine, it.value().next);
+        *fromCommandLine = true;
+        return it.value().value;
+    }
+    *fromCommandLine = false;
+    return ::settingsValue(key);
+}
+
+int Config::lookupSwitch(const QString &k, bool *fromCommandLine)
+{
+    const QString key = k.toLower();
+    const CommandLine *commandLine = parsedCommandLine();
+    const QHash<QString, CommandLine::Switch>::const_iterator it = commandLine->switches.find(key);
+    if (it != commandLine->switches.end()) {
+        ::useArg(commandLine, it.value().arg);
+        *fromCommandLine = true;
+        return it.value().enabled ? 1 : 0;
+    }
+    *fromCommandLine = false;
+    const QVariant value = ::settingsValue(key);
+    return value.isNull() ? -1 : (value.toBool() ? 1 : 0);
+}
+
+void Config::writeValue(const QString &key, const QVariant &value)
+{
+    readers.ref();
+    (void)currentSnapshot(); // loading it takes writeMutex
+    readers.deref();
+
+    QMutexLocker locker(&writeMutex);
+    readers.ref();
+    Snapshot *next = new Snapshot(*currentSnapshot());
+    readers.deref();
+    const QString lower = key.toLower();
+    next->values.insert(lower, value);
+    next->names.insert(lower, key);
+    ::publish(next);
+    ++stats.writes;
+    dirty.insert(lower);
+
+    QCoreApplication *app = QCoreApplication::instance();
+    if (!app) {
+        locker.unlock();
+        flush();
+        return;
+    }
+    if (!flusher) {
+        flusher = new Flusher;
+        flusher->moveToThread(app->thread());
+        // the application is going away. Not a post routine, heads return
+        // from main() without deleting theirs
+        ::atexit(Config::flush);
+    }
+    QCoreApplication::postEvent(flusher, new QEvent(QEvent::User));
+}
+
+// Rewrites the whole file from the snapshot. It's written next to the
+// real one, synced to disk and renamed over it so a crash leaves either
+// the old or the new file, never half of one.
+void Config::flush()
+{
+    QMutexLocker flushLocker(&flushMutex);
+    QElapsedTimer timer;
+    timer.start();
+    QHash<QString, QVariant> values;
+    QHash<QString, QString> names;
+    QString fileName;
+    QSet<QString> keys;
+    {
+        QMutexLocker locker(&writeMutex);
+        if (dirty.isEmpty())
+            return;
+        keys = dirty;
+        dirty.clear();
+        readers.ref();
+        const Snapshot *snapshot = currentSnapshot();
+        values = snapshot->values;
+        names = snapshot->names;
+        readers.deref();
+        fileName = settings()->fileName();
     }
+    if (fileName.isEmpty()) // --conf=none
+        return;
 
-    return (state == Store);
+    const QString temp = fileName + QLatin1String(".new");
+    QFile::remove(temp);
+    bool ok;
+    {
+        QSettings out(temp, QSettings::IniFormat);
+        for (QHash<QString, QVariant>::const_iterator it = values.begin(); it != values.end(); ++it)
+            out.setValue(names.value(it.key(), it.key()), it.value());
+        out.sync();
+        ok = (out.status() == QSettings::NoError);
+    }
+    const qint64 size = QFileInfo(temp).size();
+    if (ok) {
+#ifdef Q_OS_UNIX
+        QFile file(temp);
+        ok = file.open(QIODevice::ReadOnly) && !::fsync(file.handle());
+        file.close();
+        ok = ok && !::rename(QFile::encodeName(temp).constData(), QFile::encodeName(fileName).constData());
+#else
+        QFile::remove(fileName);
+        ok = QFile::rename(temp, fileName);
+#endif
+    }
+
+    QMutexLocker locker(&writeMutex);
+    if (ok) {
+        ++stats.flushes;
+        stats.keysFlushed += keys.size();
+        stats.bytesWritten += size;
+    } else {
+        qWarning("Can't write settings to %s", qPrintable(fileName));
+        QFile::remove(temp);
+        ++stats.failures;
+        dirty.unite(keys); // retried with the next write
+    }
+    stats.flushNs += timer.nsecsElapsed();
+}
+
+QVariantMap Config::statistics()
+{
+    QMutexLocker locker(&writeMutex);
+    QVariantMap ret;
+    ret["writes"] = stats.writes;
+    ret["pendingKeys"] = dirty.size();
+    ret["flushes"] = stats.flushes;
+    ret["failures"] = stats.failures;
+    ret["keysFlushed"] = stats.keysFlushed;
+    ret["bytesWritten"] = stats.bytesWritten;
+    ret["averageFlushMs"] = stats.flushes ? double(stats.flushNs) / stats.flushes / 1000000.0 : 0.0;
+    return ret;
+}
+
+QStringList Config::unusedArguments()
+{
+    const CommandLine *commandLine = parsedCommandLine();
+    QStringList ret;
+    for (int i=1; i<commandLine->args.size(); ++i) {
+        const QString &arg = commandLine->args.at(i);
+        if (!arg.isEmpty() && commandLine->used[i] == 0
+            && arg.compare("--store", Qt::CaseInsensitive) && arg.compare("--save", Qt::CaseInsensitive)) {
+            ret.append(arg);
+        }
+    }
+    return ret;
+}
+
+bool Config::store()
+{
+    return parsedCommandLine()->store;
 }
 
 QStringList Config::arguments()
 {
-    if (args.isEmpty())
-        args = QCoreApplication::arguments();
-    return args;
+    return parsedCommandLine()->args;
 }
 
+// Call before any other threads are started
 void Config::init(int argc, char **argv)
 {
-    args.clear();
+    QStringList args;
     for (int i=0; i<argc; ++i) {
         args.append(QString::fromLocal8Bit(argv[i]));
     }
-    (void)settings();
+    delete ::parsed.fetchAndStoreOrdered(::parse(args));
+    readers.ref();
+    (void)currentSnapshot();
+    readers.deref();
 }
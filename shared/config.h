@@ -33,33 +33,26 @@
 #include <QtCore>
 #endif
 
-/* not thread safe */
+/* The command line is parsed once and the settings are read into an
+   immutable snapshot that setValue() replaces, so lookups don't parse,
+   lock or touch QSettings and can be done from any thread. Writes are
+   serialized and reach the file later, see Config::flush(). */
 
-template <typename T> bool read(const QVariant &, T &)
+// the raw form toVariant() stores types without CONFIG_TYPE in
+template <typename T> bool read(const QVariant &v, T &t)
 {
-    return false;
+    if (v.type() != QVariant::ByteArray)
+        return false;
+    const QByteArray data = v.toByteArray();
+    if (data.size() != sizeof(T))
+        return false;
+    memcpy(reinterpret_cast<char*>(&t), data.constData(), sizeof(T));
+    return true;
 }
 
-template <typename T> static bool read(QSettings *settings, const QString &str, T &t)
+template <typename T> static QVariant toVariant(const T &t)
 {
-    const QByteArray data = settings->value(str).toByteArray();
-    if (!data.isEmpty()) {
-        if (data.size() != sizeof(T)) {
-            qWarning("Mismatched data for %s. Expected %d bytes, got %d",
-                     qPrintable(str), int(sizeof(T)), data.size());
-            return false;
-        }
-        memcpy(reinterpret_cast<char*>(&t), data.constData(), sizeof(T));
-        return true;
-    }
-    return false;
-}
-
-template <typename T> static void write(QSettings *settings, const QString &str, const T &t)
-{
-    QByteArray byteArray(sizeof(T), 0);
-    memcpy(byteArray.data(), reinterpret_cast<const char*>(&t), sizeof(T));
-    settings->setValue(str, byteArray);
+    return QByteArray(reinterpret_cast<const char*>(&t), sizeof(T));
 }
 
 #define CONFIG_TYPE(T)                                                  \
@@ -71,18 +64,8 @@ template <typename T> static void write(QSettings *settings, const QString &str,
         }                                                               \
         return false;                                                   \
     }                                                                   \
-    static inline bool read(QSettings *settings, const QString &key,    \
-                            T &t) {                                     \
-        const QVariant var = settings->value(key);                      \
-        if (!var.isNull() && qVariantCanConvert<T>(var)) {              \
-            t = qVariantValue<T>(var);                                  \
-            return true;                                                \
-        }                                                               \
-        return false;                                                   \
-    }                                                                   \
-    static inline void write(QSettings *settings, const QString &key,   \
-                             const T &t) {                              \
-        settings->setValue(key, qVariantFromValue<T>(t));               \
+    static inline QVariant toVariant(const T &t) {                      \
+        return qVariantFromValue<T>(t);                                 \
     }                                                                   \
 
 CONFIG_TYPE(bool);
@@ -139,53 +122,15 @@ public:
         return !isEnabled(k, !defaultValue);
     }
 
-    static bool isEnabled(const QString &k, bool defaultValue = false)
+    static bool isEnabled(const QString &key, bool defaultValue = false)
     {
-        const QString key = k.toLower();
-        const QStringList args = Config::arguments();
-        enum { Unset = -1, False = 0, True = 1 } value = Unset;
-        struct {
-            const char *prefix;
-            const char *suffix;
-            const bool enable;
-        } const options[] = {
-            { "", "", true, },
-            { "enable-?", "", true },
-            { "", "=yes", true },
-            { "", "=1", true },
-            { "", "=true", true },
-            { "no-?", "", false },
-            { "disable-?", "", false },
-            { "", "=no", false },
-            { "", "=0", false },
-            { "", "=false", false },
-            { 0, 0, false }
-        };
-        QRegExp rx;
-        rx.setCaseSensitivity(Qt::CaseInsensitive);
-
-        for (int i=0; options[i].prefix; ++i) {
-            rx.setPattern(QString("--?%1%2%3").
-                          arg(options[i].prefix).
-                          arg(key).
-                          arg(options[i].suffix));
-            const int arg = args.indexOf(rx);
-            if (arg != -1) {
-                useArg(arg);
-                value = options[i].enable ? True : False;
-                break;
-            }
-        }
-
-        QSettings *s = settings();
-        if (value == Unset) {
-            if (s->contains(key)) {
-                value = s->value(key).toBool() ? True : False;
-            }
-        } else if (store()) {
-            s->setValue(key, (value == True));
-        }
-        return value == Unset ? defaultValue : (value == True);
+        bool fromCommandLine;
+        const int value = lookupSwitch(key, &fromCommandLine);
+        if (value == -1)
+            return defaultValue;
+        if (fromCommandLine && store())
+            Config::setValue(key, QVariant(value == 1));
+        return value == 1;
     }
 
     template <typename T> static bool contains(const QString &key)
@@ -195,22 +140,14 @@ public:
         return ok;
     }
 
-    template <typename T> static T value(const QString &k, const T &defaultValue = T(), bool *ok_in = 0)
+    template <typename T> static T value(const QString &key, const T &defaultValue = T(), bool *ok_in = 0)
     {
-        const QString key = k.toLower();
-        QVariant value = valueFromCommandLine(key);
+        bool fromCommandLine;
+        const QVariant value = lookup(key, &fromCommandLine);
         T t;
-        bool ok = false;
-        QSettings *s = settings();
-        if (!value.isNull()) {
-            ok = ::read(value, t);
-            if (ok && store()) {
-                Config::setValue<T>(key, t);
-            }
-        } else {
-            ok = ::read(s, k, t);
-        }
-
+        const bool ok = !value.isNull() && ::read(value, t);
+        if (ok && fromCommandLine && store())
+            Config::setValue<T>(key, t);
         if (ok_in)
             *ok_in = ok;
         return ok ? t : defaultValue;
@@ -218,47 +155,40 @@ public:
 
     template <typename T> static void setValue(const QString &key, const T &t)
     {
-        arguments();
-        QSettings *s = settings();
-        ::write(s, key, t);
-        s->sync();
+        writeValue(key, ::toVariant(t));
     }
 
     static void setValue(const QString &key, const QVariant &value)
     {
-        arguments();
-        QSettings *s = settings();
-        s->setValue(key.toLower(), value);
+        writeValue(key, value);
     }
 
-    static QVariant value(const QString &k, const QVariant &defaultValue)
+    static QVariant value(const QString &key, const QVariant &defaultValue)
     {
-        const QString key = k.toLower();
-        QVariant value = valueFromCommandLine(key);
-        QSettings *s = settings();
-        if (value.isNull()) {
-            value = s->value(key, defaultValue);
-        } else if (store()) {
+        bool fromCommandLine;
+        const QVariant value = lookup(key, &fromCommandLine);
+        if (value.isNull())
+            return defaultValue;
+        if (fromCommandLine && store())
             Config::setValue(key, value);
-        }
-
         return value;
     }
 
-
     static QStringList unusedArguments();
     static QStringList arguments();
     static void init(int argc, char **argv);
+    // writes pending changes now instead of when the write behind timer fires
+    static void flush();
+    static QVariantMap statistics();
 private:
-    static QSettings *settings();
-    static void initUnused();
-    static bool store();
     Config() {}
-    static QVariant valueFromCommandLine(const QString &key);
-    static void useArg(int index);
-
-    static QStringList unused, args;
-    static QSettings *instance;
+    // --key=value or --key value, otherwise the settings
+    static QVariant lookup(const QString &key, bool *fromCommandLine);
+    // --key, --no-key, --key=yes etc, otherwise the settings. -1 when unset
+    static int lookupSwitch(const QString &key, bool *fromCommandLine);
+    static bool store();
+    // visible right away, written to disk by flush()
+    static void writeValue(const QString &key, const QVariant &value);
 };
 
 #endif
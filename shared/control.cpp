@@ -0,0 +1,224 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "control.h"
+#include "config.h"
+#include "log.h"
+
+QString Control::socketPath()
+{
+    return Config::value<QString>("controlsocket", cacheDirectory() + "/control");
+}
+
+bool Control::readFrame(QIODevice *device, QByteArray *frame, bool *corrupt)
+{
+    *corrupt = false;
+    quint32 size;
+    if (device->peek(reinterpret_cast<char*>(&size), sizeof(size)) != sizeof(size))
+        return false;
+    size = qFromBigEndian(size);
+    if (size > MaxFrameSize) {
+        *corrupt = true;
+        return false;
+    }
+    if (device->bytesAvailable() < qint64(sizeof(size) + size))
+        return false;
+    device->read(sizeof(size));
+    *frame = device->read(size);
+    return true;
+}
+
+void Control::writeFrame(QIODevice *device, const QByteArray &frame)
+{
+    const quint32 size = qToBigEndian<quint32>(frame.size());
+    device->write(reinterpret_cast<const char*>(&size), sizeof(size));
+    device->write(frame);
+}
+
+// "int foo(QString,int)" -> [int, QString, int]
+static QList<int> typesFromSignature(const QString &signature)
+{
+    QList<int> types;
+    const int space = signature.indexOf(' ');
+    const QString ret = signature.left(space);
+    types.append(ret == QLatin1String("void") ? int(QMetaType::Void) : QMetaType::type(qPrintable(ret)));
+    const int open = signature.indexOf('(');
+    const QString args = signature.mid(open + 1, signature.size() - open - 2);
+    foreach(const QString &arg, args.split(',', QString::SkipEmptyParts))
+        types.append(QMetaType::type(qPrintable(arg)));
+    return types;
+}
+
+ControlClient::ControlClient()
+{
+    d.socket = new QLocalSocket;
+    d.nextId = 1;
+}
+
+ControlClient::~ControlClient()
+{
+    delete d.socket;
+}
+
+bool ControlClient::connectToServer(int timeout)
+{
+    d.socket->connectToServer(Control::socketPath());
+    return d.socket->waitForConnected(timeout);
+}
+
+bool ControlClient::isConnected() const
+{
+    return d.socket->state() == QLocalSocket::ConnectedState;
+}
+
+quint32 ControlClient::send(Control::Op op, int method, const QByteArray &payload)
+{
+    const quint32 id = d.nextId++;
+    QByteArray frame;
+    {
+        QDataStream ds(&frame, QIODevice::WriteOnly);
+        ds.setVersion(QDataStream::Qt_4_6);
+        ds << id << quint8(op);
+    }
+    frame += payload;
+    Control::writeFrame(d.socket, frame);
+    const Pending pending = { op, method };
+    d.pending[id] = pending;
+    return id;
+}
+
+quint32 ControlClient::describe()
+{
+    return send(Control::Describe, -1, QByteArray());
+}
+
+quint32 ControlClient::call(int method, const QVariantList &args)
+{
+    if (method < 0 || method >= d.types.size() || args.size() != d.types.at(method).size() - 1)
+        return 0;
+    QByteArray payload;
+    QDataStream ds(&payload, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_4_6);
+    ds << quint16(method);
+    for (int i=0; i<args.size(); ++i) {
+        const int type = d.types.at(method).at(i + 1);
+        QVariant arg = args.at(i);
+        if (!arg.convert(static_cast<QVariant::Type>(type)) || !QMetaType::save(ds, type, arg.constData()))
+            return 0;
+    }
+    return send(Control::Call, method, payload);
+}
+
+quint32 ControlClient::invoke(const QString &name, const QVariantList &args)
+{
+    QByteArray payload;
+    QDataStream ds(&payload, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_4_6);
+    ds << name << args;
+    return send(Control::Invoke, -1, payload);
+}
+
+int ControlClient::method(const QString &signature) const
+{
+    for (int i=0; i<d.signatures.size(); ++i) {
+        const QString &s = d.signatures.at(i);
+        if (s.mid(s.indexOf(' ') + 1) == signature)
+            return i;
+    }
+    return -1;
+}
+
+bool ControlClient::waitForReply(quint32 id, Reply *reply, int timeout)
+{
+    if (!id || !d.pending.contains(id))
+        return false;
+    QTime timer;
+    timer.start();
+    d.socket->flush();
+    forever {
+        if (d.replies.contains(id)) {
+            *reply = d.replies.take(id);
+            return true;
+        }
+        QByteArray frame;
+        bool corrupt;
+        if (Control::readFrame(d.socket, &frame, &corrupt)) {
+            if (!parse(frame)) {
+                d.socket->abort();
+                return false;
+            }
+            continue;
+        }
+        const int remaining = timeout - timer.elapsed();
+        if (corrupt || remaining <= 0 || !d.socket->waitForReadyRead(remaining))
+            return false;
+    }
+}
+
+bool ControlClient::parse(const QByteArray &frame)
+{
+    QDataStream ds(frame);
+    ds.setVersion(QDataStream::Qt_4_6);
+    quint32 id;
+    quint8 status;
+    ds >> id >> status;
+    if (!d.pending.contains(id))
+        return false;
+    const Pending pending = d.pending.take(id);
+    Reply reply;
+    reply.status = static_cast<Control::Status>(status);
+    if (reply.status != Control::Ok) {
+        ds >> reply.error;
+    } else {
+        switch (pending.op) {
+        case Control::Describe:
+            ds >> d.signatures;
+            d.types.clear();
+            foreach(const QString &signature, d.signatures)
+                d.types.append(::typesFromSignature(signature));
+            reply.result = d.signatures;
+            break;
+        case Control::Call: {
+            const int type = d.types.value(pending.method).value(0, QMetaType::Void);
+            if (type != QMetaType::Void) {
+                reply.result = QVariant(type, static_cast<const void*>(0));
+                if (!QMetaType::load(ds, type, reply.result.data()))
+                    return false;
+            }
+            break; }
+        case Control::Invoke: {
+            quint8 consumed;
+            ds >> consumed >> reply.result;
+            reply.consumed = consumed;
+            break; }
+        }
+    }
+    if (ds.status() != QDataStream::Ok)
+        return false;
+    d.replies[id] = reply;
+    return true;
+}
@@ -0,0 +1,124 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <QtCore>
+#include <QtNetwork>
+#include "global.h"
+
+/* The control socket is a faster way to talk to tail than the session
+   bus for clients on the same machine. It serves the same Q_SCRIPTABLE
+   methods.
+
+   Every message is a frame: a quint32 with the size of the rest, then
+   the rest in QDataStream format (Qt_4_6, big endian). A request starts
+   with a quint32 id and a quint8 Op. The reply has the same id, a
+   quint8 Status, and either the result or a QString error. Clients can
+   write any number of requests before reading anything. Tail answers
+   each connection's requests in order.
+
+   Describe: no arguments. Replies with a QStringList of the methods as
+   "<return type> <signature>", void for none. A method's index in the
+   list is its number for Call.
+   Call: a quint16 method number, then each argument as its own type
+   (QMetaType::save). Replies with the return value the same way, or
+   nothing for void methods.
+   Invoke: a QString name, resolved like findFunction, so abbreviations
+   and aliases work, and a QVariantList of arguments. The first overload
+   that has enough arguments and can convert them is used. Replies with
+   a quint8 count of the arguments used and the result as a QVariant. */
+
+namespace Control {
+enum Op {
+    Describe = 0,
+    Call = 1,
+    Invoke = 2
+};
+
+enum Status {
+    Ok = 0,
+    NoSuchMethod = 1,
+    BadArguments = 2,
+    Failed = 3
+};
+
+enum { MaxFrameSize = 16 * 1024 * 1024 };
+
+QString socketPath();
+// reads one frame if a whole one is buffered, false if the stream is corrupt
+bool readFrame(QIODevice *device, QByteArray *frame, bool *corrupt);
+void writeFrame(QIODevice *device, const QByteArray &frame);
+}
+
+class ControlClient
+{
+public:
+    ControlClient();
+    ~ControlClient();
+    bool connectToServer(int timeout = 1000);
+    bool isConnected() const;
+
+    // These queue a request and return its id without waiting. Pass
+    // the id to waitForReply to get the result.
+    quint32 describe();
+    quint32 call(int method, const QVariantList &args);
+    quint32 invoke(const QString &name, const QVariantList &args);
+
+    // -1 if the method isn't in the table from the last describe()
+    int method(const QString &signature) const;
+    QStringList signatures() const { return d.signatures; }
+    QList<int> types(int method) const { return d.types.value(method); } // [0] is the return type
+
+    struct Reply {
+        Reply() : status(Control::Failed), consumed(0) {}
+        Control::Status status;
+        QVariant result;
+        QString error;
+        int consumed; // Invoke only
+    };
+    bool waitForReply(quint32 id, Reply *reply, int timeout = 30000);
+private:
+    Q_DISABLE_COPY(ControlClient);
+    quint32 send(Control::Op op, int method, const QByteArray &payload);
+    bool parse(const QByteArray &frame);
+    struct Pending {
+        Control::Op op;
+        int method; // Call only
+    };
+    struct Data {
+        QLocalSocket *socket;
+        quint32 nextId;
+        QHash<quint32, Pending> pending;
+        QHash<quint32, Reply> replies;
+        QStringList signatures;
+        QList<QList<int> > types; // [0] is the return type
+    } d;
+};
+
+#endif
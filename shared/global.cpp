@@ -32,12 +32,70 @@ void initApp(const QString &appname, int argc, char **argv)
     QCoreApplication::setApplicationName(appname);
     QCoreApplication::setOrganizationName("Donders");
     qDBusRegisterMetaType<TrackData>();
+    qDBusRegisterMetaType<TrackDataList>();
     qDBusRegisterMetaType<QHash<int, int> >();
+    qDBusRegisterMetaType<IntList>();
     qDBusRegisterMetaType<Function>();
+    // so they can go over the control socket
+    qRegisterMetaTypeStreamOperators<IntHash>("IntHash");
+    qRegisterMetaTypeStreamOperators<IntList>("IntList");
 
     Config::init(argc, argv);
 }
 
+QString cacheDirectory(const QString &subdir)
+{
+    QString dir = Config::value<QString>("cachedir", QDir::homePath() + "/.tokolosh");
+    if (!subdir.isEmpty())
+        dir += QLatin1Char('/') + subdir;
+    if (!QDir().mkpath(dir))
+        qWarning("Can't create cache directory %s", qPrintable(dir));
+    return dir;
+}
+
+QString urlToString(const QUrl &url)
+{
+    return QString::fromLatin1(url.toEncoded());
+}
+
+QUrl urlFromString(const QString &string)
+{
+    return QUrl::fromEncoded(string.toLatin1(), QUrl::StrictMode);
+}
+
+QStringList splitCommand(const QString &line, bool *ok)
+{
+    QStringList ret;
+    QString current;
+    bool quoted = false, inToken = false;
+    for (int i=0; i<line.size(); ++i) {
+        const QChar ch = line.at(i);
+        if (quoted) {
+            if (ch == QLatin1Char('\\') && i + 1 < line.size()) {
+                current += line.at(++i);
+            } else if (ch == QLatin1Char('"')) {
+                quoted = false;
+            } else {
+                current += ch;
+            }
+        } else if (ch == QLatin1Char('"')) {
+            quoted = inToken = true;
+        } else if (ch.isSpace()) {
+            if (inToken)
+                ret.append(current);
+            current.clear();
+            inToken = false;
+        } else {
+            current += ch;
+            inToken = true;
+        }
+    }
+    if (inToken)
+        ret.append(current);
+    *ok = !quoted;
+    return ret;
+}
+
 TrackData &TrackData::operator|=(const TrackData &other)
 {
     for (int i=0; trackInfos[i] != None; ++i) {
@@ -119,72 +177,293 @@ QString TrackData::toString() const
 }
 
 
+QByteArray encodeTrackData(const TrackData &trackData)
+{
+    // enum { Version = 1 }; ### Version stuff?
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds << qint32(trackData.fields);
+    if (trackData.fields & URL)
+        ds << trackData.url;
+    if (trackData.fields & Title)
+        ds << trackData.title;
+    if (trackData.fields & Artist)
+        ds << trackData.artist;
+    if (trackData.fields & Album)
+        ds << trackData.album;
+    if (trackData.fields & Genre)
+        ds << trackData.genre;
+    if (trackData.fields & TrackLength)
+        ds << trackData.trackLength;
+    if (trackData.fields & AlbumIndex)
+        ds << trackData.albumIndex;
+    if (trackData.fields & Year)
+        ds << trackData.year;
+    if (trackData.fields & PlaylistIndex)
+        ds << trackData.playlistIndex;
+    return data;
+}
+
+bool decodeTrackData(const QByteArray &data, TrackData *trackData)
+{
+    QDataStream ds(data);
+    // enum { Version = 1 }; ### Version stuff?
+    qint32 tmp;
+    ds >> tmp;
+    trackData->fields = tmp;
+    if (trackData->fields & URL)
+        ds >> trackData->url;
+    if (trackData->fields & Title)
+        ds >> trackData->title;
+    if (trackData->fields & Artist)
+        ds >> trackData->artist;
+    if (trackData->fields & Album)
+        ds >> trackData->album;
+    if (trackData->fields & Genre)
+        ds >> trackData->genre;
+    if (trackData->fields & TrackLength)
+        ds >> trackData->trackLength;
+    if (trackData->fields & AlbumIndex)
+        ds >> trackData->albumIndex;
+    if (trackData->fields & Year)
+        ds >> trackData->year;
+    if (trackData->fields & PlaylistIndex)
+        ds >> trackData->playlistIndex;
+    return ds.status() == QDataStream::Ok;
+}
+
 QDBusArgument &operator<<(QDBusArgument &arg, const TrackData &trackData)
 {
     arg.beginStructure();
-    // enum { Version = 1 }; ### Version stuff?
+    arg << encodeTrackData(trackData);
+    arg.endStructure();
+    return arg;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &arg, TrackData &trackData)
+{
+    arg.beginStructure();
     QByteArray data;
+    arg >> data;
+    decodeTrackData(data, &trackData);
+    arg.endStructure();
+    return arg;
+}
+
+/*
+  Batch format, all numbers are LEB128 varints, signed ones zigzag encoded:
+
+  version (1 byte)
+  string count, then per string its UTF-8 length and bytes
+  track count, then per track:
+      fields
+      URL: directory and file name, as string indexes
+      Title, Artist, Album, Genre: string indexes
+      TrackLength, AlbumIndex, Year: signed
+      PlaylistIndex: signed delta from the previous track's
+*/
+enum { TrackDataListVersion = 2 }; // 2: urls percent encoded
+
+static inline void writeVarint(QByteArray &out, quint32 value)
+{
+    while (value >= 0x80) {
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+static inline void writeSigned(QByteArray &out, qint32 value)
+{
+    writeVarint(out, (quint32(value) << 1) ^ quint32(value >> 31));
+}
+
+static inline bool readVarint(const char *&pos, const char *end, quint32 *value)
+{
+    quint32 ret = 0;
+    for (int shift=0; shift<35 && pos < end; shift += 7) {
+        const uchar byte = *pos++;
+        ret |= quint32(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = ret;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool readSigned(const char *&pos, const char *end, qint32 *value)
+{
+    quint32 raw;
+    if (!readVarint(pos, end, &raw))
+        return false;
+    *value = qint32(raw >> 1) ^ -qint32(raw & 1);
+    return true;
+}
+
+static inline bool readString(const char *&pos, const char *end, const QVector<QString> &strings, QString *string)
+{
+    quint32 index;
+    if (!readVarint(pos, end, &index) || index >= quint32(strings.size()))
+        return false;
+    *string = strings.at(index);
+    return true;
+}
+
+class StringTable
+{
+public:
+    quint32 index(const QString &string)
     {
-        QDataStream ds(&data, QIODevice::WriteOnly);
-        ds << qint32(trackData.fields);
-        if (trackData.fields & URL)
-            ds << trackData.url;
+        QHash<QString, quint32>::const_iterator it = indexes.find(string);
+        if (it != indexes.end())
+            return it.value();
+        const quint32 ret = strings.size();
+        indexes.insert(string, ret);
+        strings.append(string);
+        return ret;
+    }
+
+    QStringList strings;
+private:
+    QHash<QString, quint32> indexes;
+};
+
+QByteArray encodeTrackDataList(const TrackDataList &list)
+{
+    StringTable table;
+    QByteArray body;
+    body.reserve(list.size() * 16);
+    writeVarint(body, list.size());
+    int playlistIndex = 0;
+    foreach(const TrackData &trackData, list) {
+        writeVarint(body, trackData.fields);
+        if (trackData.fields & URL) {
+            const QString url = ::urlToString(trackData.url);
+            const int slash = url.lastIndexOf(QLatin1Char('/')) + 1;
+            writeVarint(body, table.index(url.left(slash)));
+            writeVarint(body, table.index(url.mid(slash)));
+        }
         if (trackData.fields & Title)
-            ds << trackData.title;
+            writeVarint(body, table.index(trackData.title));
         if (trackData.fields & Artist)
-            ds << trackData.artist;
+            writeVarint(body, table.index(trackData.artist));
         if (trackData.fields & Album)
-            ds << trackData.album;
+            writeVarint(body, table.index(trackData.album));
         if (trackData.fields & Genre)
-            ds << trackData.genre;
+            writeVarint(body, table.index(trackData.genre));
         if (trackData.fields & TrackLength)
-            ds << trackData.trackLength;
+            writeSigned(body, trackData.trackLength);
         if (trackData.fields & AlbumIndex)
-            ds << trackData.albumIndex;
+            writeSigned(body, trackData.albumIndex);
         if (trackData.fields & Year)
-            ds << trackData.year;
-        if (trackData.fields & PlaylistIndex)
-            ds << trackData.playlistIndex;
+            writeSigned(body, trackData.year);
+        if (trackData.fields & PlaylistIndex) {
+            writeSigned(body, trackData.playlistIndex - playlistIndex);
+            playlistIndex = trackData.playlistIndex;
+        }
+    }
+
+    QByteArray out;
+    out.append(char(TrackDataListVersion));
+    writeVarint(out, table.strings.size());
+    foreach(const QString &string, table.strings) {
+        const QByteArray utf8 = string.toUtf8();
+        writeVarint(out, utf8.size());
+        out.append(utf8);
+    }
+    out.append(body);
+    return out;
+}
+
+bool decodeTrackDataList(const QByteArray &data, TrackDataList *list)
+{
+    Q_ASSERT(list);
+    list->clear();
+    const char *pos = data.constData();
+    const char *end = pos + data.size();
+    if (pos == end || *pos++ != char(TrackDataListVersion))
+        return false;
+    quint32 count;
+    if (!readVarint(pos, end, &count) || count > quint32(end - pos))
+        return false;
+    QVector<QString> strings(count);
+    for (quint32 i=0; i<count; ++i) {
+        quint32 size;
+        if (!readVarint(pos, end, &size) || size > quint32(end - pos))
+            return false;
+        strings[i] = QString::fromUtf8(pos, size);
+        pos += size;
+    }
+    if (!readVarint(pos, end, &count) || count > quint32(end - pos))
+        return false;
+    int playlistIndex = 0;
+    for (quint32 i=0; i<count; ++i) {
+        TrackData trackData;
+        quint32 fields;
+        qint32 value;
+        if (!readVarint(pos, end, &fields))
+            return false;
+        trackData.fields = fields;
+        if (fields & URL) {
+            QString directory, name;
+            if (!readString(pos, end, strings, &directory) || !readString(pos, end, strings, &name))
+                return false;
+            trackData.url = ::urlFromString(directory + name);
+        }
+        if (fields & Title && !readString(pos, end, strings, &trackData.title))
+            return false;
+        if (fields & Artist && !readString(pos, end, strings, &trackData.artist))
+            return false;
+        if (fields & Album && !readString(pos, end, strings, &trackData.album))
+            return false;
+        if (fields & Genre && !readString(pos, end, strings, &trackData.genre))
+            return false;
+        if (fields & TrackLength) {
+            if (!readSigned(pos, end, &value))
+                return false;
+            trackData.trackLength = value;
+        }
+        if (fields & AlbumIndex) {
+            if (!readSigned(pos, end, &value))
+                return false;
+            trackData.albumIndex = value;
+        }
+        if (fields & Year) {
+            if (!readSigned(pos, end, &value))
+                return false;
+            trackData.year = value;
+        }
+        if (fields & PlaylistIndex) {
+            if (!readSigned(pos, end, &value))
+                return false;
+            playlistIndex += value;
+            trackData.playlistIndex = playlistIndex;
+        }
+        list->append(trackData);
     }
-    arg << data;
+    return pos == end;
+}
+
+QDBusArgument &operator<<(QDBusArgument &arg, const TrackDataList &list)
+{
+    arg.beginStructure();
+    arg << encodeTrackDataList(list);
     arg.endStructure();
     return arg;
 }
 
-
-const QDBusArgument &operator>>(const QDBusArgument &arg, TrackData &trackData)
+const QDBusArgument &operator>>(const QDBusArgument &arg, TrackDataList &list)
 {
     arg.beginStructure();
     QByteArray data;
     arg >> data;
-    QDataStream ds(&data, QIODevice::ReadOnly);
-    // enum { Version = 1 }; ### Version stuff?
-    qint32 tmp;
-    ds >> tmp;
-    trackData.fields = tmp;
-    if (trackData.fields & URL)
-        ds >> trackData.url;
-    if (trackData.fields & Title)
-        ds >> trackData.title;
-    if (trackData.fields & Artist)
-        ds >> trackData.artist;
-    if (trackData.fields & Album)
-        ds >> trackData.album;
-    if (trackData.fields & Genre)
-        ds >> trackData.genre;
-    if (trackData.fields & TrackLength)
-        ds >> trackData.trackLength;
-    if (trackData.fields & AlbumIndex)
-        ds >> trackData.albumIndex;
-    if (trackData.fields & Year)
-        ds >> trackData.year;
-    if (trackData.fields & PlaylistIndex)
-        ds >> trackData.playlistIndex;
+    if (!decodeTrackDataList(data, &list))
+        qWarning("Invalid TrackData batch, %d bytes", data.size());
     arg.endStructure();
     return arg;
 }
 
-
 QDBusArgument &operator<<(QDBusArgument &arg, const QHash<int, int> &hash)
 {
     arg.beginStructure();
@@ -84,6 +84,16 @@ static inline QStringList trackInfosToStringList(uint info)
 }
 
 void initApp(const QString &appname, int argc, char **argv);
+/* creates <cachedir>/subdir if needed */
+QString cacheDirectory(const QString &subdir = QString());
+/* splits a command line into words, double quotes keep spaces in a word
+   and \ escapes inside them. ok is false on an unterminated quote */
+QStringList splitCommand(const QString &line, bool *ok);
+/* The percent encoded form of a url as a string. QUrl::toString() decodes
+   escapes, so urls with e.g. '#', '?' or '%' in a file name don't survive
+   a round trip through it */
+QString urlToString(const QUrl &url);
+QUrl urlFromString(const QString &string);
 struct TrackData
 {
     TrackData() : trackLength(-1), albumIndex(-1), year(-1), playlistIndex(-1), fields(None) {}
@@ -105,8 +115,35 @@ struct TrackData
 Q_DECLARE_METATYPE(TrackData);
 QDBusArgument &operator<<(QDBusArgument &arg, const TrackData &trackData);
 const QDBusArgument &operator>>(const QDBusArgument &arg, TrackData &trackData);
+QByteArray encodeTrackData(const TrackData &trackData); // the per track QDataStream format
+bool decodeTrackData(const QByteArray &data, TrackData *trackData);
+
+/* Batches share one string dictionary and use varints, artist, album and
+   genre are only sent once per batch */
+typedef QList<TrackData> TrackDataList;
+Q_DECLARE_METATYPE(TrackDataList);
+QDBusArgument &operator<<(QDBusArgument &arg, const TrackDataList &list);
+const QDBusArgument &operator>>(const QDBusArgument &arg, TrackDataList &list);
+QByteArray encodeTrackDataList(const TrackDataList &list);
+bool decodeTrackDataList(const QByteArray &data, TrackDataList *list);
 typedef QHash<int, int> IntHash;
 Q_DECLARE_METATYPE(IntHash);
+typedef QList<int> IntList;
+Q_DECLARE_METATYPE(IntList);
+
+/* Tail::playlistChanged() and Tail::changesSince() send changes as flat
+   lists of sequence, type, and two arguments per change. The arguments
+   are from/count for TracksInserted, TracksRemoved, TracksChanged and
+   PlaylistReset (0, new count) and from/to for TrackMoved and
+   TracksSwapped. */
+enum PlaylistChange {
+    TracksInserted = 1,
+    TracksRemoved,
+    TrackMoved,
+    TracksSwapped,
+    TracksChanged,
+    PlaylistReset
+};
 QDBusArgument &operator<<(QDBusArgument &arg, const QHash<int, int> &ih);
 const QDBusArgument &operator>>(const QDBusArgument &arg, QHash<int, int> &ih);
 
@@ -148,6 +185,7 @@ static inline bool operator!=(const Function &left, const Function &right)
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <time.h>
 #endif
 static inline void sleep(int msec)
 {
@@ -158,4 +196,17 @@ static inline void sleep(int msec)
 #endif
 }
 
+/* milliseconds on a clock that all processes on this machine share and
+   that doesn't jump when the wall clock is set */
+static inline qint64 monotonicMs()
+{
+#ifdef Q_WS_WIN
+    return qint64(GetTickCount());
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 #endif
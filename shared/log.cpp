@@ -27,57 +27,283 @@
 
 #include "log.h"
 #include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
 
 class DevNull : public QIODevice
 {
 public:
     static DevNull *instance()
     {
-#ifndef NO_MUTEX
-        static QMutex mutex;
-        QMutexLocker locker(&mutex);
-#endif
-        static QHash<QThread*, DevNull*> instances;
-        DevNull *& inst = instances[QThread::currentThread()];
-        if (!inst)
-            inst = new DevNull;
-        return inst;
+        static QThreadStorage<DevNull*> instances;
+        if (!instances.hasLocalData())
+            instances.setLocalData(new DevNull);
+        return instances.localData();
     }
     virtual qint64 readData(char*, qint64) { return -1; }
     virtual qint64 writeData(const char*, qint64) { return -1; }
 private:
-    DevNull()
-        : QIODevice(QCoreApplication::instance())
-    {}
-    static QMutex mutex;
+    DevNull() {}
+};
+
+// Single producer, single consumer. Records are an int length and the
+// message, the writer only moves head and the reader only moves tail
+class LogRing
+{
+public:
+    enum { Size = 64 * 1024, Header = sizeof(int) };
+    LogRing() : head(0), tail(0), closed(0), dropped(0) {}
+
+    void push(const char *message, int length)
+    {
+        const int t = tail.fetchAndAddAcquire(0);
+        const int h = head;
+        const int available = (t - h - 1 + Size) % Size;
+        if (available < length + Header) {
+            dropped.ref();
+            return;
+        }
+        copyIn(h, reinterpret_cast<const char*>(&length), Header);
+        copyIn((h + Header) % Size, message, length);
+        head.fetchAndStoreRelease((h + Header + length) % Size);
+    }
+
+    // one message per line
+    bool drain(QByteArray *out)
+    {
+        const int h = head.fetchAndAddAcquire(0);
+        int t = tail;
+        if (t == h)
+            return false;
+        while (t != h) {
+            int length;
+            copyOut(t, reinterpret_cast<char*>(&length), Header);
+            t = (t + Header) % Size;
+            const int size = out->size();
+            out->resize(size + length + 1);
+            copyOut(t, out->data() + size, length);
+            (*out)[size + length] = '\n';
+            t = (t + length) % Size;
+        }
+        tail.fetchAndStoreRelease(t);
+        return true;
+    }
+
+    QAtomicInt head, tail;
+    QAtomicInt closed; // the thread is gone, delete once drained
+    QAtomicInt dropped;
+private:
+    void copyIn(int pos, const char *from, int length)
+    {
+        const int first = qMin(length, int(Size) - pos);
+        memcpy(data + pos, from, first);
+        memcpy(data, from + first, length - first);
+    }
+    void copyOut(int pos, char *to, int length) const
+    {
+        const int first = qMin(length, int(Size) - pos);
+        memcpy(to, data + pos, first);
+        memcpy(to + first, data, length - first);
+    }
+    char data[Size];
+};
+
+// What QDebug writes to in a thread, a QDebug flushes once when it goes
+// out of scope so every write is one message
+class RingDevice : public QIODevice
+{
+public:
+    RingDevice(LogRing *r) : ring(r) { open(QIODevice::WriteOnly|QIODevice::Unbuffered); }
+    ~RingDevice() { ring->closed.fetchAndStoreRelease(1); }
+    virtual qint64 readData(char*, qint64) { return -1; }
+    virtual qint64 writeData(const char *data, qint64 length)
+    {
+        ring->push(data, int(length));
+        return length;
+    }
+private:
+    LogRing *ring;
+};
+
+class LogSink : public QThread
+{
+public:
+    LogSink() : stopping(0), interval(qMax(1, Config::value<int>("loginterval", 20))) {}
+
+    void addRing(LogRing *ring)
+    {
+        QMutexLocker locker(&mutex);
+        rings.append(ring);
+    }
+
+    // The rings are only locked while they're emptied so a thread that
+    // logs for the first time never waits for the write. drainMutex
+    // keeps concurrent drains, e.g. from Log::flush(), in order.
+    void drain()
+    {
+        QMutexLocker drainLocker(&drainMutex);
+        QMutexLocker locker(&mutex);
+        QByteArray out;
+        int dropped = 0;
+        for (int i=0; i<rings.size(); ++i) {
+            LogRing *ring = rings.at(i);
+            const bool closed = (ring->closed.fetchAndAddAcquire(0) != 0);
+            ring->drain(&out);
+            dropped += ring->dropped.fetchAndStoreRelaxed(0);
+            if (closed) {
+                delete ring;
+                rings.removeAt(i--);
+            }
+        }
+        locker.unlock();
+        if (dropped)
+            out += QString("%1 log messages didn't fit in the buffer\n").arg(dropped).toLocal8Bit();
+        if (!out.isEmpty())
+            Log::write(out);
+    }
+
+    void stop()
+    {
+        stopping.fetchAndStoreRelease(1);
+        wait();
+        drain();
+    }
+
+    static LogSink *instance;
+    static RingDevice *device();
+protected:
+    virtual void run()
+    {
+        while (!stopping.fetchAndAddAcquire(0)) {
+            drain();
+            msleep(interval);
+        }
+    }
+private:
+    QAtomicInt stopping;
+    const int interval;
+    QMutex mutex; // readers only, writers never take it
+    QMutex drainMutex;
+    QList<LogRing*> rings;
+};
+
+LogSink *LogSink::instance = 0;
+
+// For messages that mustn't wait for the logger thread. Everything
+// queued before them is written first.
+class SyncDevice : public QIODevice
+{
+public:
+    static SyncDevice *instance()
+    {
+        static QThreadStorage<SyncDevice*> instances;
+        if (!instances.hasLocalData())
+            instances.setLocalData(new SyncDevice);
+        return instances.localData();
+    }
+    virtual qint64 readData(char*, qint64) { return -1; }
+    virtual qint64 writeData(const char *data, qint64 length)
+    {
+        Log::flush();
+        Log::write(QByteArray(data, int(length)) + '\n');
+        return length;
+    }
+private:
+    SyncDevice() { open(QIODevice::WriteOnly|QIODevice::Unbuffered); }
 };
 
+RingDevice *LogSink::device()
+{
+    static QThreadStorage<RingDevice*> devices;
+    if (!devices.hasLocalData()) {
+        LogRing *ring = new LogRing;
+        instance->addRing(ring);
+        devices.setLocalData(new RingDevice(ring));
+    }
+    return devices.localData();
+}
+
+static QAtomicInt sinkState; // 0 undecided, 1 running, 2 synchronous
+
+static void stopSink()
+{
+    sinkState.fetchAndStoreRelease(2);
+    if (LogSink::instance)
+        LogSink::instance->stop();
+}
+
+static bool startSink()
+{
+    const int state = sinkState.fetchAndAddAcquire(0);
+    if (state)
+        return state == 1;
+    static QMutex mutex;
+    QMutexLocker locker(&mutex);
+    if (!sinkState) {
+        if (QCoreApplication::instance() && Config::isEnabled("asynclog", true)) {
+            LogSink::instance = new LogSink;
+            LogSink::instance->start();
+            ::atexit(stopSink); // heads return from main() without deleting qApp
+            sinkState.fetchAndStoreRelease(1);
+        } else {
+            sinkState.fetchAndStoreRelease(2);
+        }
+    }
+    return sinkState == 1;
+}
+
+QBasicAtomicInt Log::cachedVerbosity = Q_BASIC_ATOMIC_INITIALIZER(INT_MIN);
 QIODevice *Log::logDevice = 0;
-#ifndef NO_MUTEX
 QMutex Log::logDeviceMutex;
-#endif
 
 QDebug Log::log(int verb)
 {
-    if (verb <= verbosity()) {
-        if (!logDevice) {
-            return qDebug();
-        } else if (QThread::currentThread() == logDevice->thread()) {
-            return QDebug(logDevice);
-        } else {
-            // ### what do I do here?
-            return qDebug();
-        }
+    return isEnabled(verb) ? stream(verb) : QDebug(DevNull::instance());
+}
+
+QDebug Log::stream(int level)
+{
+    if (::startSink())
+        return QDebug(level <= 0 ? static_cast<QIODevice*>(SyncDevice::instance()) : LogSink::device());
+    QMutexLocker locker(&logDeviceMutex);
+    if (!logDevice) {
+        return qDebug();
+    } else if (QThread::currentThread() == logDevice->thread()) {
+        return QDebug(logDevice);
+    } else {
+        // ### what do I do here?
+        return qDebug();
+    }
+}
+
+// From the logger thread, or SyncDevice
+void Log::write(const QByteArray &messages)
+{
+    QMutexLocker locker(&logDeviceMutex);
+    if (logDevice) {
+        logDevice->write(messages);
     } else {
-        return QDebug(DevNull::instance());
+        fwrite(messages.constData(), 1, messages.size(), stderr);
+        fflush(stderr);
     }
 }
 
+void Log::flush()
+{
+    if (LogSink::instance)
+        LogSink::instance->drain();
+}
+
+int Log::Category::resolve() const
+{
+    const int resolved = Config::value<int>(QLatin1String("verbosity/") + QLatin1String(name), Log::verbosity());
+    verbosity.fetchAndStoreRelease(resolved);
+    return resolved;
+}
+
 QString Log::logFile()
 {
-#ifndef NO_MUTEX
     QMutexLocker locker(&logDeviceMutex);
-#endif
     if (!logDevice) {
         return "stderr";
     } else if (QFile *file = qobject_cast<QFile*>(logDevice)) {
@@ -99,26 +325,24 @@ bool Log::setLogFile(const QString &file)
 
 void Log::setLogDevice(QIODevice *device)
 {
-#ifndef NO_MUTEX
+    flush();
     QMutexLocker locker(&logDeviceMutex);
-#endif
     delete logDevice;
     logDevice = device;
 }
 
+// Resolved once, the rest of the time isEnabled() only reads cachedVerbosity
 int Log::verbosity()
 {
-#ifndef NO_MUTEX
-    QMutexLocker locker(&logDeviceMutex);
-#endif
     enum { DefaultVerbosity = 0 };
-    static int verbosity = -1;
-    if (verbosity == -1) {
+    int ret = cachedVerbosity;
+    if (ret == INT_MIN) {
         if (Config::isEnabled("verbose")) {
-            verbosity = INT_MAX;
+            ret = INT_MAX;
         } else {
-            verbosity = Config::value<int>("verbosity", DefaultVerbosity);
+            ret = Config::value<int>("verbosity", DefaultVerbosity);
         }
+        cachedVerbosity.fetchAndStoreRelease(ret); // racing threads store the same value
     }
-    return verbosity;
+    return ret;
 }
@@ -29,23 +29,73 @@
 #define LOG_H
 
 #include <QtCore>
+#include <limits.h>
+
+/* LOG(level) << ... only evaluates its arguments when level is at most
+   the verbosity, LOG_CATEGORY(category, level) when it's at most the
+   category's. Levels above LOG_MAX_VERBOSITY are compiled out.
+
+   With "asynclog" (the default) messages are written to a per thread
+   ring buffer and a logger thread writes them out, so logging never
+   waits for the terminal or the log file. Messages that don't fit are
+   dropped and counted. Level 0 and below is written right away, after
+   what's still queued, and the queue is flushed at exit. */
+
+#ifndef LOG_MAX_VERBOSITY
+#define LOG_MAX_VERBOSITY INT_MAX
+#endif
+
+// a loop rather than an if so a following else can't bind to it
+#define LOG(level)                                                      \
+    for (bool log_enabled = ((level) <= LOG_MAX_VERBOSITY && Log::isEnabled(level)); \
+         log_enabled; log_enabled = false)                              \
+        Log::stream(level)
+
+#define LOG_CATEGORY(category, level)                                   \
+    for (bool log_enabled = ((level) <= LOG_MAX_VERBOSITY && (category).isEnabled(level)); \
+         log_enabled; log_enabled = false)                              \
+        Log::stream(level)
 
-/* thread safe */
-#define NO_MUTEX /* not thread safe */
 class Log
 {
 public:
+    /* Defined at file scope. The verbosity is "verbosity/<name>",
+       falling back to the global one */
+    class Category
+    {
+    public:
+        Category(const char *n) : name(n), verbosity(INT_MIN) {}
+        bool isEnabled(int level) const
+        {
+            const int v = verbosity;
+            return level <= (v != INT_MIN ? v : resolve());
+        }
+    private:
+        int resolve() const;
+        const char *name;
+        mutable QAtomicInt verbosity; // resolved by whichever thread logs first
+    };
+
     static int verbosity();
-    static QDebug log(int verbosity = -1);
+    static inline bool isEnabled(int level)
+    {
+        const int v = cachedVerbosity;
+        return level <= (v != INT_MIN ? v : verbosity());
+    }
+    static QDebug log(int verbosity = -1); // prefer LOG()
+    static QDebug stream(int level = INT_MAX); // unconditionally
     static QString logFile();
     static bool setLogFile(const QString &file);
     static void setLogDevice(QIODevice *device);
+    static void flush(); // writes out what the logger thread hasn't yet
 private:
+    friend class LogSink;
+    friend class SyncDevice;
+    static void write(const QByteArray &messages);
     Log() {}
+    static QBasicAtomicInt cachedVerbosity; // statically initialized, LOG() may run before main()
     static QIODevice *logDevice;
-#ifndef NO_MUTEX
     static QMutex logDeviceMutex;
-#endif
 };
 
 
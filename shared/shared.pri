@@ -10,15 +10,10 @@ unix {
 }
 
 mac:CONFIG -= app_bundle
+unix:!mac:LIBS += -lrt # clock_gettime
 unix {
     #LIBS += -L/usr/lib -lxine -lz -lnsl -lpthread -lrt
-    #generateadaptor.target = $$PWD/tokolosh_adaptor.h 
-    #generateadaptor.commands = sh $$PWD/generatedbusinterfaces.sh $$PWD
-    #generateinterface.target = $$PWD/tokolosh_interface.h 
-    #generateinterface.commands = sh $$PWD/generatedbusinterfaces.sh $$PWD
-    #QMAKE_EXTRA_TARGETS += generateadaptor generateinterface
-    #PRE_TARGETDEPS += $$PWD/tokolosh.xml $$PWD/tokolosh_adaptor.h $$PWD/tokolosh_interface.h
 }
-HEADERS += $$PWD/log.h $$PWD/global.h $$PWD/config.h 
-SOURCES += $$PWD/log.cpp $$PWD/config.cpp $$PWD/global.cpp
-QT += dbus
+HEADERS += $$PWD/log.h $$PWD/global.h $$PWD/config.h $$PWD/snapshot.h $$PWD/control.h
+SOURCES += $$PWD/log.cpp $$PWD/config.cpp $$PWD/global.cpp $$PWD/snapshot.cpp $$PWD/control.cpp
+QT += dbus network
@@ -0,0 +1,152 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "snapshot.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Acquire, nothing read after it can be read before it
+static inline quint32 load(const quint32 &value)
+{
+    const quint32 ret = *static_cast<const volatile quint32*>(&value);
+    __sync_synchronize();
+    return ret;
+}
+
+// For the second read of a seqlock generation. The fence comes first so
+// the copy of the row is complete before the generation is checked again
+static inline quint32 reload(const quint32 &value)
+{
+    __sync_synchronize();
+    return *static_cast<const volatile quint32*>(&value);
+}
+
+SnapshotReader::SnapshotReader()
+{
+    d.memory = 0;
+    d.size = 0;
+}
+
+SnapshotReader::~SnapshotReader()
+{
+    detach();
+}
+
+bool SnapshotReader::attach(int fd)
+{
+    detach();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < qint64(sizeof(Snapshot::Header)))
+        return false;
+    void *memory = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+        return false;
+    const Snapshot::Header *header = static_cast<const Snapshot::Header*>(memory);
+    if (header->magic != Snapshot::Magic || header->version != Snapshot::Version) {
+        munmap(memory, st.st_size);
+        return false;
+    }
+    d.memory = static_cast<const uchar*>(memory);
+    d.size = st.st_size;
+    return true;
+}
+
+void SnapshotReader::detach()
+{
+    if (d.memory) {
+        munmap(const_cast<uchar*>(d.memory), d.size);
+        d.memory = 0;
+        d.size = 0;
+    }
+}
+
+bool SnapshotReader::isReplaced() const
+{
+    return d.memory && load(reinterpret_cast<const Snapshot::Header*>(d.memory)->replaced);
+}
+
+quint32 SnapshotReader::generation() const
+{
+    return d.memory ? load(reinterpret_cast<const Snapshot::Header*>(d.memory)->generation) : 0;
+}
+
+int SnapshotReader::rowCount() const
+{
+    if (!d.memory)
+        return 0;
+    return reinterpret_cast<const Snapshot::Header*>(d.memory)->rowCount;
+}
+
+int SnapshotReader::current() const
+{
+    if (!d.memory)
+        return -1;
+    return reinterpret_cast<const Snapshot::Header*>(d.memory)->current;
+}
+
+QString SnapshotReader::string(const Snapshot::String &string) const
+{
+    const Snapshot::Header *header = reinterpret_cast<const Snapshot::Header*>(d.memory);
+    const quint64 end = quint64(header->heap) + string.offset + quint64(string.length) * sizeof(QChar);
+    if (end > d.size)
+        return QString();
+    return QString(reinterpret_cast<const QChar*>(d.memory + header->heap + string.offset), string.length);
+}
+
+bool SnapshotReader::row(int index, TrackData *data) const
+{
+    Q_ASSERT(data);
+    if (!d.memory)
+        return false;
+    const Snapshot::Header *header = reinterpret_cast<const Snapshot::Header*>(d.memory);
+    for (int attempt=0; attempt<3; ++attempt) {
+        const quint32 generation = load(header->generation);
+        if (generation & 1)
+            continue;
+        if (index < 0 || index >= header->rowCount
+            || header->rows + quint64(index + 1) * sizeof(Snapshot::Row) > d.size) {
+            return false;
+        }
+        const Snapshot::Row *row = reinterpret_cast<const Snapshot::Row*>(d.memory + header->rows) + index;
+        TrackData ret;
+        ret.fields = row->fields | PlaylistIndex;
+        ret.playlistIndex = index;
+        ret.url = ::urlFromString(string(row->url));
+        ret.title = string(row->title);
+        ret.artist = string(row->artist);
+        ret.album = string(row->album);
+        ret.genre = string(row->genre);
+        ret.trackLength = row->trackLength;
+        ret.albumIndex = row->albumIndex;
+        ret.year = row->year;
+        if (reload(header->generation) == generation) {
+            *data = ret;
+            return true;
+        }
+    }
+    return false;
+}
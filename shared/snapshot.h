@@ -0,0 +1,84 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <QtCore>
+#include "global.h"
+
+/* Layout of the read only playlist snapshot tail shares with heads, see
+   Tail::playlistSnapshot(). Offsets are in bytes from the start of the
+   segment, strings are UTF-16 in host byte order. The generation is odd
+   while tail is writing, readers retry when it changed under them. */
+
+namespace Snapshot {
+enum { Magic = 0x70c0105d, Version = 2 }; // 2: urls percent encoded, see urlToString()
+
+struct String {
+    quint32 offset, length; // length in QChars
+};
+
+struct Header {
+    quint32 magic, version;
+    quint32 generation;
+    quint32 replaced; // tail moved on to a bigger segment, fetch a new one
+    quint32 size;
+    qint32 rowCount, current;
+    quint32 rows, heap;
+};
+
+struct Row {
+    quint32 fields;
+    String url, title, artist, album, genre;
+    qint32 trackLength, albumIndex, year;
+};
+}
+
+class SnapshotReader
+{
+public:
+    SnapshotReader();
+    ~SnapshotReader();
+    bool attach(int fd); // doesn't take ownership of fd
+    void detach();
+    bool isAttached() const { return d.memory != 0; }
+    bool isReplaced() const;
+    quint32 generation() const;
+    int rowCount() const;
+    int current() const;
+    bool row(int index, TrackData *data) const; // false if out of range or tail kept writing
+private:
+    Q_DISABLE_COPY(SnapshotReader);
+    QString string(const Snapshot::String &string) const;
+    struct Data {
+        const uchar *memory;
+        quint32 size;
+    } d;
+};
+
+#endif
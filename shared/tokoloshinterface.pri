@@ -0,0 +1,26 @@
+# Generates TokoloshInterface, a typed proxy for tail's D-Bus interface, so
+# clients don't need to introspect tail at runtime. The interface is
+# described by qdbuscpp2xml from the Q_SCRIPTABLE members in tail.h, plus
+# tokoloshtypes.xml for the ones using types it doesn't know about.
+TOKOLOSH_INTERFACE_HEADER = $$PWD/../tail/tail.h
+TOKOLOSH_TYPES_XML = $$PWD/tokoloshtypes.xml
+QDBUSCPP2XML = $$[QT_INSTALL_BINS]/qdbuscpp2xml
+QDBUSXML2CPP = $$[QT_INSTALL_BINS]/qdbusxml2cpp
+
+tokoloshinterface_header.input = TOKOLOSH_INTERFACE_HEADER
+tokoloshinterface_header.output = tokoloshinterface.h
+tokoloshinterface_header.commands = $$QDBUSCPP2XML -a ${QMAKE_FILE_IN} | grep -v -e '</interface>' -e '</node>' > tokolosh.xml && \
+                                    cat $$TOKOLOSH_TYPES_XML >> tokolosh.xml && \
+                                    $$QDBUSXML2CPP -N -c TokoloshInterface -i global.h -p tokoloshinterface.h: tokolosh.xml
+tokoloshinterface_header.depends = $$TOKOLOSH_TYPES_XML
+tokoloshinterface_header.variable_out = HEADERS
+tokoloshinterface_header.CONFIG += no_link target_predeps
+
+tokoloshinterface_source.input = TOKOLOSH_INTERFACE_HEADER
+tokoloshinterface_source.output = tokoloshinterface.cpp
+tokoloshinterface_source.commands = $$QDBUSXML2CPP -N -c TokoloshInterface -i tokoloshinterface.h -p :tokoloshinterface.cpp tokolosh.xml
+tokoloshinterface_source.variable_out = SOURCES
+tokoloshinterface_source.depends = tokoloshinterface.h
+
+QMAKE_EXTRA_COMPILERS += tokoloshinterface_header tokoloshinterface_source
+QMAKE_CLEAN += tokolosh.xml
@@ -5,10 +5,26 @@ DEFINES += PLUGINDIR="\"$$PWD/plugins\""
 warning("FixMe: I can't seem to figure out how to pass in a quoted define")
 DEPENDPATH += .
 INCLUDEPATH += .
-SOURCES += main.cpp tail.cpp
-HEADERS += tail.h backend.h taginterface.h id3taginterface.h
+SOURCES += main.cpp tail.cpp backendthread.cpp loudness.cpp routerbackend.cpp pluginmanifest.cpp pluginloader.cpp playlistsnapshot.cpp controlserver.cpp requestscheduler.cpp
+HEADERS += tail.h backend.h backendthread.h loudness.h routerbackend.h pluginmanifest.h pluginloader.h playlistsnapshot.h controlserver.h requestscheduler.h taginterface.h id3taginterface.h
 
 include(../shared/shared.pri)
 CONFIG += qdbus
 LIBS += -lid3
 OBJECTS_DIR = .objapp
+
+# D-Bus activation so heads get tail started by the bus and are answered
+# as soon as it has registered. "make install" puts tail in $$PREFIX/bin
+# and the service file where the session bus looks for it, e.g.
+# qmake PREFIX=/usr
+unix {
+    isEmpty(PREFIX):PREFIX = /usr/local
+    target.path = $$PREFIX/bin
+    INSTALLS += target
+    TAIL_BINARY = $$target.path/$$TARGET
+    QMAKE_SUBSTITUTES += com.TokoloshMediaPlayer.service.in
+    dbusservice.files = $$OUT_PWD/com.TokoloshMediaPlayer.service
+    dbusservice.path = $$PREFIX/share/dbus-1/services
+    dbusservice.CONFIG += no_check_exist
+    INSTALLS += dbusservice
+}
@@ -32,6 +32,16 @@
 #include <global.h>
 
 class Tail;
+/* Receives decoded PCM from Backend::decode() */
+class AudioSink
+{
+public:
+    virtual ~AudioSink() {}
+    virtual bool format(int sampleRate, int channels) = 0;
+    // interleaved, returning false stops decoding
+    virtual bool write(const qint16 *samples, int frames) = 0;
+};
+
 class Backend
 {
 public:
@@ -48,7 +58,8 @@ public:
 
     enum ProgressType {
         Seconds,
-        Portion // ### 100th of a percent. Xine uses 0-65535 should we too?. Not a good name btw
+        Portion, // ### 100th of a percent. Xine uses 0-65535 should we too?. Not a good name btw
+        Milliseconds
     };
 
     enum Capability {
@@ -90,12 +101,27 @@ public:
     virtual bool isMute() const = 0;
     virtual QHash<int, int> equalizerSettings() const { return QHash<int, int>(); }
     virtual void setEqualizerSettings(const QHash<int, int> &) {}
+    virtual QVariantMap statistics() const { return QVariantMap(); } // backend specific counters
+    // Called from analysis threads while playback goes on, needs to be reentrant
+    virtual bool decode(const QUrl &, AudioSink *) const { return false; }
+    virtual void setGain(double) {} // dB, applied on top of the volume
     QString name() const { return d.name; }
+    // Called by Tail when switching to another backend. Status changes and
+    // events from a retired backend are dropped. May be called from any thread.
+    virtual void retire() { d.retired = 1; }
 protected:
     void statusChanged(int status)
     {
         Q_ASSERT(d.tail);
-        QMetaObject::invokeMethod(d.tail, "statusChanged", Q_ARG(int, status));
+        if (!d.retired)
+            QMetaObject::invokeMethod(d.tail, "statusChanged", Q_ARG(int, status));
+    }
+    // may be called from any thread
+    void sendEvent(Event event)
+    {
+        Q_ASSERT(d.tail);
+        if (!d.retired)
+            QMetaObject::invokeMethod(d.tail, "onBackendEvent", Qt::QueuedConnection, Q_ARG(int, event));
     }
     Backend(const QString &name, QObject *tail)
     {
@@ -108,6 +134,7 @@ protected:
     struct Data {
         QString name;
         QObject *tail;
+        QAtomicInt retired;
     } d;
 };
 
@@ -6,3 +6,9 @@ HEADERS += backend.h backendplugin.h
 include(../shared/shared.pri)
 DESTDIR = ../plugins
 DEFINES += THREADED_RECURSIVE_LOAD
+# next to bin like in the build tree, tail looks for them in ../plugins
+unix {
+    isEmpty(PREFIX):PREFIX = /usr/local
+    target.path = $$PREFIX/plugins
+    INSTALLS += target
+}
@@ -0,0 +1,296 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "backendthread.h"
+#include "config.h"
+#include "log.h"
+
+class BackendWorker : public QObject
+{
+    Q_OBJECT
+public:
+    BackendWorker(BackendThread *t) : thread(t) {}
+
+    void startRefreshTimer() { refreshTimer.start(500, this); }
+public slots:
+    void processCommands() { thread->processCommands(); }
+protected:
+    virtual void timerEvent(QTimerEvent *e)
+    {
+        if (e->timerId() == refreshTimer.timerId()) {
+            thread->refresh();
+        } else {
+            QObject::timerEvent(e);
+        }
+    }
+private:
+    BackendThread *thread;
+    QBasicTimer refreshTimer;
+};
+
+#include "backendthread.moc"
+
+BackendThread::BackendThread(Backend *backend, QObject *parent)
+    : QThread(parent)
+{
+    Q_ASSERT(backend);
+    d.backend = backend;
+    d.status = Backend::Uninitalized;
+    d.volume = 0;
+    d.mute = 0;
+    d.seconds = -1;
+    d.portion = -1;
+    d.capabilities = Backend::NoCapabilities;
+    d.errorCode = 0;
+    d.clockStatus = Backend::Uninitalized;
+    d.clockPosition = -1;
+    d.clockTimestamp = 0;
+    d.clockTolerance = Config::value<int>("clocktolerance", 100);
+    d.clockHeartbeat = Config::value<int>("clockheartbeat", 5000);
+    d.worker = new BackendWorker(this);
+    d.worker->moveToThread(this);
+}
+
+BackendThread::~BackendThread()
+{
+    quit();
+    wait();
+    // drop anything that was posted after the thread stopped
+    Command *command = d.queue.fetchAndStoreAcquire(0);
+    while (command) {
+        Command *next = command->next;
+        if (command->done)
+            command->done->release();
+        delete command;
+        command = next;
+    }
+    delete d.worker;
+}
+
+void BackendThread::run()
+{
+    d.worker->startRefreshTimer();
+    exec();
+}
+
+void BackendThread::post(Type type, const QVariant &arg0, const QVariant &arg1, const QDBusMessage &reply)
+{
+    Command *command = new Command;
+    command->type = type;
+    command->args[0] = arg0;
+    command->args[1] = arg1;
+    command->reply = reply;
+    enqueue(command);
+}
+
+void BackendThread::post(Type type, const QVariant &arg0, QObject *receiver, const char *member)
+{
+    Command *command = new Command;
+    command->type = type;
+    command->args[0] = arg0;
+    command->receiver = receiver;
+    command->member = member;
+    enqueue(command);
+}
+
+QVariant BackendThread::call(Type type, const QVariant &arg0, const QVariant &arg1)
+{
+    Q_ASSERT(QThread::currentThread() != this);
+    QSemaphore done;
+    QVariant result;
+    Command *command = new Command;
+    command->type = type;
+    command->args[0] = arg0;
+    command->args[1] = arg1;
+    command->done = &done;
+    command->result = &result;
+    enqueue(command);
+    done.acquire();
+    return result;
+}
+
+void BackendThread::enqueue(Command *command)
+{
+    Command *head;
+    do {
+        head = d.queue;
+        command->next = head;
+    } while (!d.queue.testAndSetRelease(head, command));
+
+    // only the push that made the queue non-empty needs to wake up the
+    // thread, it drains everything that's there
+    if (!head)
+        QMetaObject::invokeMethod(d.worker, "processCommands", Qt::QueuedConnection);
+}
+
+void BackendThread::processCommands()
+{
+    Command *list = d.queue.fetchAndStoreAcquire(0);
+    // the queue is a stack, reverse it to get the commands in order
+    Command *command = 0;
+    while (list) {
+        Command *next = list->next;
+        list->next = command;
+        command = list;
+        list = next;
+    }
+
+    while (command) {
+        const QVariant result = execute(command);
+        if (command->result)
+            *command->result = result;
+        if (command->reply.type() == QDBusMessage::ReplyMessage) {
+            QDBusMessage reply = command->reply;
+            reply << result;
+            QDBusConnection::sessionBus().send(reply);
+        }
+        if (command->receiver)
+            QMetaObject::invokeMethod(command->receiver, command->member, Qt::QueuedConnection, Q_ARG(QVariant, result));
+        Command *next = command->next;
+        refresh();
+        if (command->done)
+            command->done->release();
+        delete command;
+        command = next;
+    }
+}
+
+QVariant BackendThread::execute(const Command *command)
+{
+    Backend *backend = d.backend;
+    switch (command->type) {
+    case Init: {
+        const bool ok = backend->initBackend();
+        refreshEqualizer();
+        return ok;
+    }
+    case Shutdown:
+        backend->shutdown();
+        break;
+    case Play:
+        backend->play();
+        break;
+    case Pause:
+        backend->pause();
+        break;
+    case Stop:
+        backend->stop();
+        break;
+    case SetProgress:
+        backend->setProgress(command->args[0].toInt(), command->args[1].toInt());
+        break;
+    case LoadUrl:
+        return backend->loadUrl(command->args[0].toUrl());
+    case SetVolume:
+        backend->setVolume(command->args[0].toInt());
+        break;
+    case SetMute:
+        backend->setMute(command->args[0].toBool());
+        break;
+    case SetEqualizerSettings:
+        backend->setEqualizerSettings(qVariantValue<IntHash>(command->args[0]));
+        refreshEqualizer();
+        break;
+    case EqualizerSettings:
+        return qVariantFromValue<IntHash>(backend->equalizerSettings());
+    case IsValid:
+        return backend->isValid(command->args[0].toUrl());
+    case Statistics:
+        return backend->statistics();
+    case SetGain:
+        backend->setGain(command->args[0].toDouble());
+        break;
+    case Progress:
+        return backend->progress(command->args[0].toInt());
+    case ValidTracks: {
+        QStringList valid;
+        foreach(const QString &file, command->args[0].toStringList()) {
+            if (backend->isValid(QUrl(file)))
+                valid.append(file);
+        }
+        return valid;
+    }
+    }
+    return QVariant();
+}
+
+void BackendThread::refresh()
+{
+    Backend *backend = d.backend;
+    const int status = backend->status();
+    d.status = status;
+    d.capabilities = backend->capabilities();
+    if (status != Backend::Uninitalized) {
+        d.volume = backend->volume();
+        d.mute = backend->isMute() ? 1 : 0;
+        d.seconds = backend->progress(Backend::Seconds);
+        d.portion = backend->progress(Backend::Portion);
+    }
+    refreshClock(status);
+    const int errorCode = backend->errorCode();
+    if (errorCode != d.errorCode) {
+        QMutexLocker lock(&d.errorMutex);
+        d.errorMessage = backend->errorMessage();
+        d.errorCode = errorCode;
+    }
+}
+
+void BackendThread::refreshEqualizer()
+{
+    const IntHash equalizer = d.backend->equalizerSettings();
+    QMutexLocker lock(&d.equalizerMutex);
+    d.equalizer = equalizer;
+}
+
+void BackendThread::clock(int *status, int *position, qint64 *timestamp) const
+{
+    QMutexLocker lock(&d.clockMutex);
+    *status = d.clockStatus;
+    *position = d.clockPosition;
+    *timestamp = d.clockTimestamp;
+}
+
+void BackendThread::refreshClock(int status)
+{
+    const int position = (status == Backend::Uninitalized ? -1 : d.backend->progress(Backend::Milliseconds));
+    const qint64 now = monotonicMs();
+    {
+        QMutexLocker lock(&d.clockMutex);
+        const qint64 elapsed = now - d.clockTimestamp;
+        if (status == d.clockStatus) {
+            const int expected = d.clockPosition + (status == Backend::Playing ? int(elapsed) : 0);
+            if (qAbs(position - expected) <= d.clockTolerance
+                && (status != Backend::Playing || elapsed < d.clockHeartbeat)) {
+                return;
+            }
+        }
+        d.clockStatus = status;
+        d.clockPosition = position;
+        d.clockTimestamp = now;
+    }
+    emit clockChanged(status, position, now);
+}
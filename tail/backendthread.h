@@ -0,0 +1,134 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef BACKENDTHREAD_H
+#define BACKENDTHREAD_H
+
+#include <QtCore>
+#include <QtDBus>
+#include "backend.h"
+
+/* Runs all calls into the Backend on a dedicated thread so a slow
+   xine_open can't block D-Bus dispatch in tail. Commands are pushed onto
+   a lock free queue from any thread and executed in order. The state
+   clients poll the most (status, volume, mute, position) is kept in a
+   snapshot that can be read without waiting for the backend.
+
+   The position is also published as a clock sample: (status,
+   position in ms, monotonicMs() when it was read). Clients
+   extrapolate from the last sample so a new one is only sent when the
+   status changes, when the position drifts from what the last sample
+   predicts (seeks, track changes, stalls) or as a heartbeat. */
+
+class BackendWorker;
+class BackendThread : public QThread
+{
+    Q_OBJECT
+public:
+    enum Type {
+        Init,
+        Shutdown,
+        Play,
+        Pause,
+        Stop,
+        SetProgress,
+        LoadUrl,
+        SetVolume,
+        SetMute,
+        SetEqualizerSettings,
+        EqualizerSettings,
+        IsValid,
+        Statistics,
+        SetGain,
+        Progress,
+        ValidTracks // the files in the QStringList the backend can play
+    };
+
+    BackendThread(Backend *backend, QObject *parent = 0);
+    ~BackendThread();
+    Backend *backend() const { return d.backend; }
+
+    // If reply is a valid method call reply the result is appended to it
+    // and it's sent from the backend thread.
+    void post(Type type, const QVariant &arg0 = QVariant(), const QVariant &arg1 = QVariant(),
+              const QDBusMessage &reply = QDBusMessage());
+    // member is invoked on receiver, queued, with the result as a QVariant
+    void post(Type type, const QVariant &arg0, QObject *receiver, const char *member);
+    // blocks until the backend thread has executed the command
+    QVariant call(Type type, const QVariant &arg0 = QVariant(), const QVariant &arg1 = QVariant());
+
+    int status() const { return d.status; }
+    int volume() const { return d.volume; }
+    bool isMute() const { return d.mute; }
+    int progress(int type) const { return type == Backend::Seconds ? d.seconds : d.portion; }
+    int capabilities() const { return d.capabilities; }
+    IntHash equalizerSettings() const { QMutexLocker lock(&d.equalizerMutex); return d.equalizer; }
+    void clock(int *status, int *position, qint64 *timestamp) const;
+    int errorCode() const { return d.errorCode; }
+    QString errorMessage() const { QMutexLocker lock(&d.errorMutex); return d.errorMessage; }
+signals:
+    // emitted from the backend thread
+    void clockChanged(int status, int position, qint64 timestamp);
+protected:
+    virtual void run();
+private:
+    struct Command {
+        Command() : type(Init), receiver(0), member(0), done(0), result(0), next(0) {}
+        Type type;
+        QVariant args[2];
+        QDBusMessage reply;
+        QObject *receiver;
+        const char *member;
+        QSemaphore *done;
+        QVariant *result;
+        Command *next;
+    };
+    void enqueue(Command *command);
+    void processCommands();
+    QVariant execute(const Command *command);
+    void refresh();
+    void refreshClock(int status);
+    void refreshEqualizer();
+
+    struct Data {
+        Backend *backend;
+        BackendWorker *worker;
+        QAtomicPointer<Command> queue;
+        QAtomicInt status, volume, mute, seconds, portion, capabilities, errorCode;
+        mutable QMutex errorMutex;
+        QString errorMessage;
+        mutable QMutex equalizerMutex;
+        IntHash equalizer; // only changes with Init and SetEqualizerSettings
+        mutable QMutex clockMutex;
+        int clockStatus, clockPosition;
+        qint64 clockTimestamp;
+        int clockTolerance, clockHeartbeat; // ms
+    } d;
+    friend class BackendWorker;
+};
+
+#endif
@@ -0,0 +1,339 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "controlserver.h"
+#include "tail.h"
+#include "log.h"
+#include <sys/stat.h>
+
+ControlServer::ControlServer(Tail *tail, QObject *parent)
+    : QObject(parent)
+{
+    d.tail = tail;
+    d.server = new QLocalServer(this);
+    d.connections = d.requests = d.errors = d.maxPipelined = 0;
+    d.bytesIn = d.bytesOut = d.executeNs = 0;
+    connect(d.server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+
+    const QMetaObject *meta = tail->metaObject();
+    for (int i=0; i<meta->methodCount(); ++i) {
+        const QMetaMethod method = meta->method(i);
+        if (method.attributes() & QMetaMethod::Scriptable && method.methodType() != QMetaMethod::Signal)
+            d.methods.append(i);
+    }
+}
+
+ControlServer::~ControlServer()
+{
+    d.server->close();
+}
+
+bool ControlServer::listen(const QString &path)
+{
+    QLocalServer::removeServer(path); // left behind if we crashed
+    const mode_t old = ::umask(077);
+    const bool ok = d.server->listen(path);
+    ::umask(old);
+    if (!ok) {
+        LOG(0) << "Can't listen on" << path << d.server->errorString();
+        return false;
+    }
+    d.path = path;
+    return true;
+}
+
+QVariantMap ControlServer::statistics() const
+{
+    QVariantMap map;
+    map["path"] = d.path;
+    map["connections"] = d.connections;
+    map["requests"] = d.requests;
+    map["errors"] = d.errors;
+    map["maxPipelined"] = d.maxPipelined;
+    map["bytesIn"] = d.bytesIn;
+    map["bytesOut"] = d.bytesOut;
+    map["executeUs"] = d.executeNs / 1000;
+    map["averageExecuteUs"] = (d.requests ? double(d.executeNs) / d.requests / 1000.0 : 0.0);
+    return map;
+}
+
+void ControlServer::onNewConnection()
+{
+    while (QLocalSocket *socket = d.server->nextPendingConnection()) {
+        ++d.connections;
+        connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    }
+}
+
+void ControlServer::onDisconnected()
+{
+    sender()->deleteLater();
+}
+
+// Everything that arrived is answered with a single write so pipelined
+// requests cost one wake-up on each side.
+void ControlServer::onReadyRead()
+{
+    QLocalSocket *socket = qobject_cast<QLocalSocket*>(sender());
+    Q_ASSERT(socket);
+    QBuffer replies;
+    replies.open(QIODevice::WriteOnly);
+    int count = 0;
+    QByteArray frame;
+    bool corrupt;
+    while (Control::readFrame(socket, &frame, &corrupt)) {
+        d.bytesIn += frame.size() + sizeof(quint32);
+        Control::writeFrame(&replies, execute(frame, &corrupt));
+        ++count;
+        if (corrupt) // the client is out of step, whatever follows is noise
+            break;
+    }
+    d.maxPipelined = qMax(count, d.maxPipelined);
+    if (!replies.data().isEmpty()) {
+        d.bytesOut += replies.data().size();
+        socket->write(replies.data());
+    }
+    if (corrupt) {
+        LOG(1) << "Dropping control connection, bad frame";
+        socket->disconnectFromServer();
+    }
+}
+
+// Sets *malformed if the frame doesn't even have a header, the reply then
+// carries whatever id could be read (0 if none) and the caller should drop
+// the connection
+QByteArray ControlServer::execute(const QByteArray &frame, bool *malformed)
+{
+    QElapsedTimer timer;
+    timer.start();
+    ++d.requests;
+
+    QDataStream in(frame);
+    in.setVersion(QDataStream::Qt_4_6);
+    quint32 id = 0;
+    quint8 op = 0;
+    in >> id >> op;
+    *malformed = (in.status() != QDataStream::Ok);
+
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_4_6);
+    Control::Status status = Control::Failed;
+    QString error;
+    if (*malformed) {
+        status = Control::BadArguments;
+        error = QString("Malformed request of %1 bytes").arg(frame.size());
+    } else {
+        switch (op) {
+        case Control::Describe:
+            payload = describe();
+            status = Control::Ok;
+            break;
+        case Control::Call: {
+            quint16 method;
+            in >> method;
+            status = (in.status() == QDataStream::Ok
+                      ? call(method, in, out, &error)
+                      : Control::BadArguments);
+            break; }
+        case Control::Invoke: {
+            QString name;
+            QVariantList args;
+            in >> name >> args;
+            status = (in.status() == QDataStream::Ok
+                      ? invoke(name, args, out, &error)
+                      : Control::BadArguments);
+            break; }
+        default:
+            error = QString("Unknown request %1").arg(op);
+            break;
+        }
+    }
+    const QString callError = d.tail->takeCallError();
+    if (status == Control::Ok && !callError.isEmpty()) {
+        status = Control::Failed;
+        error = callError;
+    }
+
+    QByteArray reply;
+    QDataStream ds(&reply, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_4_6);
+    ds << id << quint8(status);
+    if (status == Control::Ok) {
+        reply += payload;
+    } else {
+        ++d.errors;
+        ds << error;
+    }
+    d.executeNs += timer.nsecsElapsed();
+    return reply;
+}
+
+QByteArray ControlServer::describe() const
+{
+    const QMetaObject *meta = d.tail->metaObject();
+    QStringList signatures;
+    foreach(int index, d.methods) {
+        const QMetaMethod method = meta->method(index);
+        const char *type = method.typeName();
+        signatures.append(QString("%1 %2").arg(type && *type ? type : "void").arg(method.signature()));
+    }
+    QByteArray payload;
+    QDataStream ds(&payload, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_4_6);
+    ds << signatures;
+    return payload;
+}
+
+static inline int returnType(const QMetaMethod &method)
+{
+    const char *type = method.typeName();
+    return (type && *type ? QMetaType::type(type) : int(QMetaType::Void));
+}
+
+// Invokes a slot with argv laid out like qt_metacall wants it and
+// writes the return value to argv[0] if there is one.
+bool ControlServer::metacall(int index, int type, void **argv)
+{
+    if (type == 0) // a return type we can't construct
+        return false;
+    argv[0] = (type == QMetaType::Void ? 0 : QMetaType::construct(type));
+    QMetaObject::metacall(d.tail, QMetaObject::InvokeMetaMethod, index, argv);
+    return true;
+}
+
+Control::Status ControlServer::call(int method, QDataStream &in, QDataStream &out, QString *error)
+{
+    if (method < 0 || method >= d.methods.size()) {
+        *error = QString("No method %1").arg(method);
+        return Control::NoSuchMethod;
+    }
+    const int index = d.methods.at(method);
+    const QMetaMethod metaMethod = d.tail->metaObject()->method(index);
+    const QList<QByteArray> parameters = metaMethod.parameterTypes();
+    void *argv[11] = { 0 };
+    QList<int> types;
+    Control::Status status = Control::Ok;
+    for (int i=0; i<parameters.size() && status == Control::Ok; ++i) {
+        const int type = QMetaType::type(parameters.at(i).constData());
+        if (!type || i >= 10) {
+            *error = QString("Can't pass %1 over the control socket").arg(parameters.at(i).constData());
+            status = Control::Failed;
+            break;
+        }
+        types.append(type);
+        argv[i + 1] = QMetaType::construct(type);
+        if (!QMetaType::load(in, type, argv[i + 1]) || in.status() != QDataStream::Ok) {
+            *error = QString("Can't read argument %1 of %2").arg(i).arg(metaMethod.signature());
+            status = Control::BadArguments;
+        }
+    }
+
+    const int ret = ::returnType(metaMethod);
+    if (status == Control::Ok) {
+        if (!metacall(index, ret, argv)) {
+            *error = QString("Can't return %1 over the control socket").arg(metaMethod.typeName());
+            status = Control::Failed;
+        } else if (argv[0] && !QMetaType::save(out, ret, argv[0])) {
+            *error = QString("Can't write %1").arg(metaMethod.typeName());
+            status = Control::Failed;
+        }
+    }
+
+    if (argv[0])
+        QMetaType::destroy(ret, argv[0]);
+    for (int i=0; i<types.size(); ++i)
+        QMetaType::destroy(types.at(i), argv[i + 1]);
+    return status;
+}
+
+Control::Status ControlServer::invoke(const QString &name, const QVariantList &args, QDataStream &out, QString *error)
+{
+    const Function function = d.tail->findFunction(name);
+    if (function.name.isEmpty()) {
+        *error = QString("Unknown function %1").arg(name);
+        return Control::NoSuchMethod;
+    }
+
+    const QMetaObject *meta = d.tail->metaObject();
+    foreach(const QList<int> &types, function.args) {
+        if (types.size() > args.size() || types.size() > 10) {
+            *error = QString("Not enough arguments specified for %1 needed %2, got %3").
+                     arg(function.name).arg(types.size()).arg(args.size());
+            continue;
+        }
+        QVariantList converted;
+        QStringList typeNames;
+        for (int i=0; i<types.size(); ++i) {
+            QVariant arg = args.at(i);
+            if (!arg.convert(static_cast<QVariant::Type>(types.at(i)))) {
+                *error = QString("Can't convert %1 to %2").arg(args.at(i).toString()).arg(QMetaType::typeName(types.at(i)));
+                break;
+            }
+            converted.append(arg);
+            typeNames.append(QMetaType::typeName(types.at(i)));
+        }
+        if (converted.size() != types.size())
+            continue;
+
+        const QByteArray signature = QMetaObject::normalizedSignature(
+            qPrintable(function.name + '(' + typeNames.join(",") + ')'));
+        const int index = meta->indexOfMethod(signature.constData());
+        if (index == -1 || meta->method(index).methodType() == QMetaMethod::Signal) {
+            *error = QString("Can't call %1").arg(signature.constData());
+            continue;
+        }
+        const int ret = ::returnType(meta->method(index));
+        void *argv[11] = { 0 };
+        for (int i=0; i<converted.size(); ++i)
+            argv[i + 1] = converted[i].data();
+        if (!metacall(index, ret, argv)) {
+            *error = QString("Can't return %1 over the control socket").arg(QMetaType::typeName(ret));
+            return Control::Failed;
+        }
+        QVariant result;
+        bool streamable = true;
+        if (argv[0]) {
+            if (ret >= QMetaType::User) {
+                // QVariant's operator<< doesn't tell us when it can't
+                QByteArray scratch;
+                QDataStream ds(&scratch, QIODevice::WriteOnly);
+                streamable = QMetaType::save(ds, ret, argv[0]);
+            }
+            result = QVariant(ret, argv[0]);
+            QMetaType::destroy(ret, argv[0]);
+        }
+        if (!streamable) {
+            *error = QString("Can't write %1").arg(QMetaType::typeName(ret));
+            return Control::Failed;
+        }
+        out << quint8(types.size()) << result;
+        return Control::Ok;
+    }
+    return Control::BadArguments;
+}
@@ -0,0 +1,67 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef CONTROLSERVER_H
+#define CONTROLSERVER_H
+
+#include <QtCore>
+#include <QtNetwork>
+#include "control.h"
+
+/* Serves the control socket protocol described in control.h. Requests
+   are executed on the main thread, the same way D-Bus calls are. */
+
+class Tail;
+class ControlServer : public QObject
+{
+    Q_OBJECT
+public:
+    ControlServer(Tail *tail, QObject *parent = 0);
+    ~ControlServer();
+    bool listen(const QString &path);
+    QVariantMap statistics() const;
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onDisconnected();
+private:
+    QByteArray execute(const QByteArray &frame, bool *malformed);
+    QByteArray describe() const;
+    Control::Status call(int method, QDataStream &in, QDataStream &out, QString *error);
+    Control::Status invoke(const QString &name, const QVariantList &args, QDataStream &out, QString *error);
+    bool metacall(int index, int returnType, void **argv);
+    struct Data {
+        Tail *tail;
+        QLocalServer *server;
+        QString path;
+        QList<int> methods; // Q_SCRIPTABLE slots, indexes into Tail's QMetaObject
+        int connections, requests, errors, maxPipelined;
+        qint64 bytesIn, bytesOut, executeNs;
+    } d;
+};
+
+#endif
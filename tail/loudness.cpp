@@ -0,0 +1,449 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "loudness.h"
+#include <global.h>
+#include <log.h>
+#include <math.h>
+#ifdef Q_OS_UNIX
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+enum { CacheMagic = 0x10ad0e55, CacheVersion = 2 };
+
+QDataStream &operator<<(QDataStream &ds, const Loudness &loudness)
+{
+    ds << loudness.integrated << loudness.peak << qint32(loudness.duration);
+    return ds;
+}
+
+QDataStream &operator>>(QDataStream &ds, Loudness &loudness)
+{
+    qint32 duration;
+    ds >> loudness.integrated >> loudness.peak >> duration;
+    loudness.duration = duration;
+    return ds;
+}
+
+static QDataStream &operator<<(QDataStream &ds, const LoudnessCache::Entry &entry)
+{
+    ds << entry.loudness << entry.modified << entry.size;
+    return ds;
+}
+
+static QDataStream &operator>>(QDataStream &ds, LoudnessCache::Entry &entry)
+{
+    ds >> entry.loudness >> entry.modified >> entry.size;
+    return ds;
+}
+
+LoudnessMeter::LoudnessMeter()
+    : sampleRate(0), channels(0), subBlockFrames(0), frames(0), totalFrames(0), peak(0)
+{
+}
+
+bool LoudnessMeter::format(int rate, int chans)
+{
+    if (rate <= 0 || chans <= 0)
+        return false;
+    sampleRate = rate;
+    channels = chans;
+    subBlockFrames = rate / 10;
+
+    // K-weighting, pre-filter and RLB high pass from ITU-R BS.1770
+    // designed for the actual sample rate
+    {
+        const double f0 = 1681.974450955533;
+        const double G = 3.999843853973347;
+        const double Q = 0.7071752369554196;
+        const double K = tan(M_PI * f0 / rate);
+        const double Vh = pow(10.0, G / 20.0);
+        const double Vb = pow(Vh, 0.4996667741545416);
+        const double a0 = 1.0 + K / Q + K * K;
+        shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+        shelf.b1 = 2.0 * (K * K - Vh) / a0;
+        shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+        shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+        shelf.a2 = (1.0 - K / Q + K * K) / a0;
+    }
+    {
+        const double f0 = 38.13547087602444;
+        const double Q = 0.5003270373238773;
+        const double K = tan(M_PI * f0 / rate);
+        const double a0 = 1.0 + K / Q + K * K;
+        highPass.b0 = 1.0;
+        highPass.b1 = -2.0;
+        highPass.b2 = 1.0;
+        highPass.a1 = 2.0 * (K * K - 1.0) / a0;
+        highPass.a2 = (1.0 - K / Q + K * K) / a0;
+    }
+
+    state.fill(0.0, channels * 4);
+    sums.fill(0.0, channels);
+    weights.fill(1.0, channels);
+    if (channels >= 6) { // L R C LFE Ls Rs
+        weights[3] = 0.0;
+        weights[4] = 1.41;
+        weights[5] = 1.41;
+    }
+    buffer.resize(subBlockFrames);
+    return true;
+}
+
+bool LoudnessMeter::write(const qint16 *samples, int count)
+{
+    Q_ASSERT(sampleRate);
+    int done = 0;
+    while (done < count) {
+        const int n = qMin(count - done, subBlockFrames - frames);
+        const qint16 *in = samples + done * channels;
+        float *buf = buffer.data();
+        for (int c=0; c<channels; ++c) {
+            // deinterleave first so the peak scan is a plain loop the
+            // compiler can vectorize, the filters are recursive anyway
+            float max = 0.0f;
+            for (int i=0; i<n; ++i) {
+                buf[i] = in[i * channels + c] * (1.0f / 32768.0f);
+            }
+            for (int i=0; i<n; ++i) {
+                max = qMax(max, qAbs(buf[i]));
+            }
+            peak = qMax<double>(peak, max);
+
+            double *s = state.data() + c * 4;
+            double s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+            double sum = 0.0;
+            for (int i=0; i<n; ++i) {
+                const double x = buf[i];
+                const double y = shelf.b0 * x + s0;
+                s0 = shelf.b1 * x - shelf.a1 * y + s1;
+                s1 = shelf.b2 * x - shelf.a2 * y;
+                const double z = highPass.b0 * y + s2;
+                s2 = highPass.b1 * y - highPass.a1 * z + s3;
+                s3 = highPass.b2 * y - highPass.a2 * z;
+                sum += z * z;
+            }
+            s[0] = s0; s[1] = s1; s[2] = s2; s[3] = s3;
+            sums[c] += sum;
+        }
+        frames += n;
+        done += n;
+        if (frames == subBlockFrames)
+            endSubBlock();
+    }
+    return true;
+}
+
+void LoudnessMeter::endSubBlock()
+{
+    double energy = 0.0;
+    for (int c=0; c<channels; ++c) {
+        energy += weights.at(c) * sums.at(c) / subBlockFrames;
+        sums[c] = 0.0;
+    }
+    subBlocks.append(energy);
+    totalFrames += frames;
+    frames = 0;
+}
+
+Loudness LoudnessMeter::result() const
+{
+    Loudness ret;
+    if (!sampleRate)
+        return ret;
+    ret.duration = int((totalFrames + frames) * 1000 / sampleRate);
+    ret.peak = peak;
+    ret.integrated = -70.0;
+
+    // 400ms gating blocks overlapping by 75%
+    QVector<double> blocks;
+    for (int i=3; i<subBlocks.size(); ++i) {
+        blocks.append((subBlocks.at(i - 3) + subBlocks.at(i - 2) + subBlocks.at(i - 1) + subBlocks.at(i)) / 4.0);
+    }
+    const double absoluteGate = pow(10.0, (-70.0 + 0.691) / 10.0);
+    double sum = 0.0;
+    int count = 0;
+    foreach(double block, blocks) {
+        if (block > absoluteGate) {
+            sum += block;
+            ++count;
+        }
+    }
+    if (!count)
+        return ret;
+    const double relativeGate = sum / count * 0.1; // -10 LU
+    sum = 0.0;
+    count = 0;
+    foreach(double block, blocks) {
+        if (block > absoluteGate && block > relativeGate) {
+            sum += block;
+            ++count;
+        }
+    }
+    if (count)
+        ret.integrated = -0.691 + 10.0 * log10(sum / count);
+    return ret;
+}
+
+static inline QString cacheFileName()
+{
+    return ::cacheDirectory() + QLatin1String("/loudness");
+}
+
+LoudnessCache::LoudnessCache()
+    : dirty(false)
+{
+    QFile file(::cacheFileName());
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream ds(&file);
+        quint32 magic, version;
+        ds >> magic >> version;
+        if (magic == CacheMagic && version == CacheVersion) {
+            ds >> entries;
+            if (ds.status() != QDataStream::Ok)
+                entries.clear();
+        }
+    }
+    for (QHash<QString, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        directories[directoryOf(it.key())].append(it.key());
+}
+
+LoudnessCache::~LoudnessCache()
+{
+    save();
+}
+
+// with mutex held
+bool LoudnessCache::isCurrent(const QString &path) const
+{
+    const QHash<QString, Entry>::const_iterator it = entries.find(path);
+    if (it == entries.end())
+        return false;
+    const QFileInfo fi(path);
+    return it.value().size == fi.size() && it.value().modified == fi.lastModified();
+}
+
+Loudness LoudnessCache::track(const QString &path) const
+{
+    QMutexLocker lock(&mutex);
+    return isCurrent(path) ? entries.value(path).loudness : Loudness();
+}
+
+// There's no album information we can trust so treat a directory as an
+// album. Loudness is combined as the duration weighted mean energy.
+Loudness LoudnessCache::album(const QString &directory) const
+{
+    QMutexLocker lock(&mutex);
+    QHash<QString, Loudness>::const_iterator cached = albums.find(directory);
+    if (cached != albums.end())
+        return cached.value();
+    Loudness ret;
+    double energy = 0.0;
+    foreach(const QString &path, directories.value(directory)) {
+        const Loudness &loudness = entries[path].loudness;
+        if (!loudness.isValid())
+            continue;
+        energy += pow(10.0, loudness.integrated / 10.0) * loudness.duration;
+        ret.duration += loudness.duration;
+        ret.peak = qMax(ret.peak, loudness.peak);
+    }
+    if (ret.duration)
+        ret.integrated = 10.0 * log10(energy / ret.duration);
+    albums.insert(directory, ret);
+    return ret;
+}
+
+void LoudnessCache::insert(const QString &path, const Loudness &loudness, const QDateTime &modified, qint64 size)
+{
+    QMutexLocker lock(&mutex);
+    const QString directory = directoryOf(path);
+    if (!entries.contains(path))
+        directories[directory].append(path);
+    Entry &entry = entries[path];
+    entry.loudness = loudness;
+    entry.modified = modified;
+    entry.size = size;
+    albums.remove(directory);
+    dirty = true;
+}
+
+bool LoudnessCache::contains(const QString &path) const
+{
+    QMutexLocker lock(&mutex);
+    return isCurrent(path);
+}
+
+// Written next to the cache file and renamed over it, like the seek
+// index, so a crash can't leave a truncated cache behind
+bool LoudnessCache::save()
+{
+    QMutexLocker lock(&mutex);
+    if (!dirty)
+        return true;
+    const QString fileName = ::cacheFileName();
+    const QString temp = fileName + QLatin1String(".new");
+    QFile file(temp);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG(0) << "Can't open" << temp << "for writing";
+        return false;
+    }
+    QDataStream ds(&file);
+    ds << quint32(CacheMagic) << quint32(CacheVersion) << entries;
+    bool ok = (ds.status() == QDataStream::Ok) && file.flush();
+#ifdef Q_OS_UNIX
+    ok = ok && !::fsync(file.handle());
+    file.close();
+    ok = ok && !::rename(QFile::encodeName(temp).constData(), QFile::encodeName(fileName).constData());
+#else
+    file.close();
+    if (ok) {
+        QFile::remove(fileName);
+        ok = QFile::rename(temp, fileName);
+    }
+#endif
+    if (!ok) {
+        LOG(0) << "Can't write" << fileName;
+        QFile::remove(temp);
+        return false;
+    }
+    dirty = false;
+    return true;
+}
+
+// Feeds the meter until the analyzer is cancelled
+class LoudnessJob : public QRunnable, public AudioSink
+{
+public:
+    LoudnessJob(const QUrl &u, LoudnessCache *c, LoudnessAnalyzer *a)
+        : url(u), cache(c), analyzer(a)
+    {}
+
+    virtual void run()
+    {
+        if (isCancelled()) // still queued when the analyzer went away
+            return;
+        const QString path = url.toLocalFile();
+        const QFileInfo fi(path);
+        const QDateTime modified = fi.lastModified();
+        const qint64 size = fi.size();
+        const bool ok = analyzer->decode(url, this);
+        if (isCancelled())
+            return;
+        if (ok)
+            cache->insert(path, meter.result(), modified, size);
+        QMetaObject::invokeMethod(analyzer, "onTrackFinished", Qt::QueuedConnection, Q_ARG(bool, ok));
+    }
+
+    virtual bool format(int sampleRate, int channels) { return meter.format(sampleRate, channels); }
+    virtual bool write(const qint16 *samples, int frames)
+    {
+        return !isCancelled() && meter.write(samples, frames);
+    }
+private:
+    bool isCancelled() const { return analyzer->d.cancelled.fetchAndAddAcquire(0) != 0; }
+
+    const QUrl url;
+    LoudnessCache *cache;
+    LoudnessAnalyzer *analyzer;
+    LoudnessMeter meter;
+};
+
+LoudnessAnalyzer::LoudnessAnalyzer(Backend *backend, LoudnessCache *cache, QObject *parent)
+    : QObject(parent)
+{
+    d.backend = backend;
+    d.cache = cache;
+    d.pending = d.analyzed = d.failed = 0;
+    d.tracksPerSecondPerCore = 0;
+    d.pool.setMaxThreadCount(Config::value<int>("loudnessthreads", QThread::idealThreadCount()));
+}
+
+// Queued jobs return right away and running ones stop decoding at the
+// next chunk, so this only waits for one chunk per thread
+LoudnessAnalyzer::~LoudnessAnalyzer()
+{
+    d.cancelled.fetchAndStoreRelease(1);
+    d.pool.waitForDone();
+}
+
+void LoudnessAnalyzer::analyze(const QList<QUrl> &tracks)
+{
+    foreach(const QUrl &url, tracks) {
+        const QString path = url.toLocalFile();
+        if (path.isEmpty() || d.cache->contains(path))
+            continue;
+        if (!d.pending++) {
+            d.analyzed = d.failed = 0;
+            d.timer.start();
+        }
+        d.pool.start(new LoudnessJob(url, d.cache, this));
+    }
+}
+
+// Jobs that are already queued will use the new backend
+void LoudnessAnalyzer::setBackend(Backend *backend)
+{
+    QWriteLocker lock(&d.lock);
+    d.backend = backend;
+}
+
+bool LoudnessAnalyzer::decode(const QUrl &url, AudioSink *sink)
+{
+    QReadLocker lock(&d.lock);
+    return d.backend->decode(url, sink);
+}
+
+QVariantMap LoudnessAnalyzer::statistics() const
+{
+    QVariantMap ret;
+    ret.insert("pending", d.pending);
+    ret.insert("analyzed", d.analyzed);
+    ret.insert("failed", d.failed);
+    ret.insert("threads", d.pool.maxThreadCount());
+    ret.insert("tracksPerSecondPerCore", d.tracksPerSecondPerCore);
+    return ret;
+}
+
+void LoudnessAnalyzer::onTrackFinished(bool ok)
+{
+    Q_ASSERT(d.pending > 0);
+    if (ok) {
+        ++d.analyzed;
+    } else {
+        ++d.failed;
+    }
+    if (--d.pending)
+        return;
+
+    const int elapsed = qMax(1, d.timer.elapsed());
+    d.tracksPerSecondPerCore = (d.analyzed + d.failed) * 1000.0 / elapsed / d.pool.maxThreadCount();
+    LOG(1) << "Analyzed loudness of" << d.analyzed << "tracks," << d.failed << "failed, in"
+           << elapsed << "ms," << d.tracksPerSecondPerCore << "tracks/s per core";
+    d.cache->save();
+    emit finished();
+}
@@ -0,0 +1,130 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <QtCore>
+#include "backend.h"
+
+struct Loudness
+{
+    Loudness() : integrated(0), peak(0), duration(0) {}
+    bool isValid() const { return duration > 0; }
+
+    double integrated; // LUFS
+    double peak; // sample peak, 1.0 is full scale
+    int duration; // milliseconds
+};
+
+QDataStream &operator<<(QDataStream &ds, const Loudness &loudness);
+QDataStream &operator>>(QDataStream &ds, Loudness &loudness);
+
+/* EBU R128 integrated loudness and sample peak of decoded 16 bit PCM */
+class LoudnessMeter : public AudioSink
+{
+public:
+    LoudnessMeter();
+    virtual bool format(int sampleRate, int channels);
+    virtual bool write(const qint16 *samples, int frames);
+    Loudness result() const;
+private:
+    struct Biquad {
+        double b0, b1, b2, a1, a2;
+    };
+    void endSubBlock();
+
+    int sampleRate, channels, subBlockFrames, frames;
+    qint64 totalFrames;
+    double peak;
+    Biquad shelf, highPass;
+    QVector<double> state; // 4 per stage per channel
+    QVector<double> weights, sums;
+    QVector<float> buffer; // one channel, deinterleaved
+    QVector<double> subBlocks; // 100ms energies
+};
+
+/* Results persisted in <cachedir>/loudness, keyed by file path. Entries
+   for files whose modification time or size changed are ignored. Thread
+   safe */
+class LoudnessCache
+{
+public:
+    LoudnessCache();
+    ~LoudnessCache();
+    Loudness track(const QString &path) const;
+    Loudness album(const QString &directory) const;
+    // modified and size are the file's before it was decoded
+    void insert(const QString &path, const Loudness &loudness, const QDateTime &modified, qint64 size);
+    bool contains(const QString &path) const;
+    bool save();
+
+    struct Entry {
+        Entry() : size(-1) {}
+        Loudness loudness;
+        QDateTime modified;
+        qint64 size;
+    };
+private:
+    static QString directoryOf(const QString &path) { return QFileInfo(path).absolutePath(); }
+    bool isCurrent(const QString &path) const;
+    mutable QMutex mutex;
+    QHash<QString, Entry> entries;
+    QHash<QString, QStringList> directories; // the entries in each directory
+    mutable QHash<QString, Loudness> albums; // computed on demand, dropped by insert()
+    bool dirty;
+};
+
+class LoudnessAnalyzer : public QObject
+{
+    Q_OBJECT
+public:
+    LoudnessAnalyzer(Backend *backend, LoudnessCache *cache, QObject *parent = 0);
+    ~LoudnessAnalyzer();
+    void analyze(const QList<QUrl> &tracks);
+    void setBackend(Backend *backend);
+    QVariantMap statistics() const;
+signals:
+    void finished();
+private slots:
+    void onTrackFinished(bool ok);
+private:
+    bool decode(const QUrl &url, AudioSink *sink);
+    struct Data {
+        QReadWriteLock lock; // held for reading while decoding, setBackend() waits for it
+        QAtomicInt cancelled; // set by the destructor, jobs stop at the next chunk
+        Backend *backend;
+        LoudnessCache *cache;
+        QThreadPool pool;
+        int pending, analyzed, failed;
+        QTime timer;
+        double tracksPerSecondPerCore;
+    } d;
+    friend class LoudnessJob;
+};
+
+#endif
@@ -30,31 +30,15 @@
 #include <QtDBus>
 #include "log.h"
 #include "tail.h"
-#include "backendplugin.h"
+#include "pluginloader.h"
+#include "controlserver.h"
 //#undef PLUGINDIR
 
-class LibraryCleanupHandler
-{
-public:
-    LibraryCleanupHandler()
-        : library(0)
-    {}
-
-    ~LibraryCleanupHandler()
-    {
-        return;
-        if (library) {
-            library->unload();
-            delete library;
-        }
-    }
-    QLibrary *library;
-};
-
 int main(int argc, char *argv[])
 {
+    QTime startup;
+    startup.start();
     int ret = -1;
-    LibraryCleanupHandler cleanup;
     {
         ::initApp("tokoloshtail", argc, argv);
         QCoreApplication app(argc, argv);
@@ -64,100 +48,70 @@ int main(int argc, char *argv[])
                     "\teval `dbus-launch --auto-syntax`\n");
             return 1;
         }
-        {
-            QDBusInterface iface(SERVICE_NAME, "/");
-            if (iface.isValid()) {
-                iface.call("quit");
-            }
+        QDBusConnection bus = QDBusConnection::sessionBus();
+        if (bus.interface()->isServiceRegistered(SERVICE_NAME)) {
+            // we're queued for the name below and get it when this one is gone
+            bus.send(QDBusMessage::createMethodCall(SERVICE_NAME, "/", QString(), "quit"));
         }
 
 
 //    const QString pluginDirectory = Config::value<QString>("plugindir", PLUGINDIR); // ### Can't make this work
         const QString pluginDirectory = Config::value<QString>("plugindir", QDir::cleanPath(QCoreApplication::applicationDirPath() + "/../plugins"));
-        Log::log(10) << "Using plugin directory" << pluginDirectory;
+        LOG(10) << "Using plugin directory" << pluginDirectory;
         const QString backendName = Config::value<QString>("backend", "xine");
-        Log::log(10) << "Searching for backend" << backendName;
-        QDir dir(pluginDirectory);
-        if (!dir.exists()) {
-            Log::log(0) << pluginDirectory << " doesn't seem to exist";
+        // e.g. backends=native,xine to play what the native backend can
+        // decode with it and everything else with xine
+        const QStringList backendNames = Config::value<QString>("backends", backendName).
+                                         split(QRegExp("[ ,]"), QString::SkipEmptyParts);
+        LOG(10) << "Searching for backends" << backendNames;
+        PluginLoader loader(pluginDirectory);
+        if (!loader.exists()) {
+            LOG(0) << pluginDirectory << " doesn't seem to exist";
             return 1;
         }
         {
             Tail tail;
-            Backend *backend = 0;
-            QLibrary *library = 0;
-            QHash<QLibrary*, BackendPlugin*> candidates;
-
-            foreach(const QFileInfo &fi, dir.entryInfoList(QDir::Files, QDir::Size)) {
-                QLibrary *lib = new QLibrary(fi.absoluteFilePath());
-                CreateBackend createBackend = 0;
-                if (lib->load() && (createBackend = (CreateBackend)lib->resolve("createTokoloshBackendInterface"))) {
-                    BackendPlugin *interface = createBackend();
-                    if (interface && interface->keys().contains(backendName, Qt::CaseInsensitive)) {
-                        backend = interface->createBackend(&tail);
-                        if (backend) {
-                            library = lib;
-                            break;
-                        } else {
-                            Log::log(0) << fi.absoluteFilePath() << "doesn't seem to be able to create a backend";
-                        }
-                        delete interface;
-                    } else if (!interface) {
-                        delete lib;
-                    } else {
-                        candidates[lib] = interface;
-                    }
-                } else {
-                    if (lib->isLoaded()) {
-                        Log::log(1) << "Can't load" << fi.absoluteFilePath() << lib->errorString();
-                    }
-                    delete lib;
-                }
-            }
-
-            Q_ASSERT(!backend == !library);
+            Backend *backend = loader.load(backendNames, &tail);
             if (!backend) {
-                for (QHash<QLibrary*, BackendPlugin*>::const_iterator it = candidates.begin(); it != candidates.end(); ++it) {
-                    const bool hadBackend = backend != 0;
-                    if (!backend)
-                        backend = it.value()->createBackend(&app);
-                    if (hadBackend || !backend) {
-                        it.key()->unload();
-                        delete it.key();
-                    } else {
-                        library = it.key();
-                    }
-                    delete it.value();
-                }
-            }
-            if (!backend) {
-                Log::log(0) << "Can't find a suitable backend";
+                LOG(0) << "Can't find a suitable backend";
                 return 1;
             }
-            cleanup.library = library;
 
-            bool registered = false;
-            for (int i=0; i<5; ++i) {
-                if (QDBusConnection::sessionBus().registerService(SERVICE_NAME)) {
-                    registered = true;
-                    break;
-                }
-                ::sleep(500);
-            }
-            if (!registered) {
-                Log::log(0) << "Can't seem to register service" << QDBusConnection::sessionBus().lastError().message();
+            if (!tail.setBackend(backend)) {
+                LOG(0) << backend->errorMessage() << backend->errorCode();
                 return 1;
             }
+            bus.registerObject("/", &tail,
+                               QDBusConnection::ExportScriptableSlots
+                               |QDBusConnection::ExportScriptableSignals);
 
-            if (!tail.setBackend(backend)) {
-                Log::log(0) << backend->errorMessage() << backend->errorCode();
+            // only take the name once everything is in place, activated
+            // heads call us the moment we have it
+            QEventLoop registration;
+            QObject::connect(bus.interface(), SIGNAL(serviceRegistered(QString)), &registration, SLOT(quit()));
+            const QDBusReply<QDBusConnectionInterface::RegisterServiceReply> reply =
+                bus.interface()->registerService(SERVICE_NAME, QDBusConnectionInterface::QueueService,
+                                                 QDBusConnectionInterface::DontAllowReplacement);
+            if (reply.isValid() && reply.value() == QDBusConnectionInterface::ServiceQueued
+                && bus.interface()->serviceOwner(SERVICE_NAME).value() != bus.baseService()) {
+                LOG(10) << "Waiting for the running tokoloshtail to quit";
+                QTimer::singleShot(5000, &registration, SLOT(quit()));
+                registration.exec();
+            }
+            if (bus.interface()->serviceOwner(SERVICE_NAME).value() != bus.baseService()) {
+                LOG(0) << "Can't seem to register service" << reply.error().message();
+                bus.interface()->unregisterService(SERVICE_NAME); // leave the queue
                 return 1;
             }
-            QDBusConnection::sessionBus().registerObject("/", &tail,
-                                                         QDBusConnection::ExportScriptableSlots
-                                                         |QDBusConnection::ExportScriptableSignals);
 
-            Log::log(10) << "Using" << backend->name();
+            ControlServer control(&tail);
+            if (Config::isEnabled("fastpath", true) && control.listen(Control::socketPath()))
+                tail.setControlServer(&control);
+
+            LOG(10) << "Using" << backend->name();
+            tail.setPluginLoader(&loader);
+            LOG(1) << "Started in" << startup.elapsed() << "ms, loaded" << loader.loaded() << "of" << loader.files()
+                   << "plugins, manifest hits" << loader.manifestHits() << "misses" << loader.manifestMisses();
             ret = app.exec();
         }
     }
@@ -0,0 +1,924 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "nativebackend.h"
+#include "ringbuffer.h"
+#include <config.h>
+#include <log.h>
+#include <mpg123.h>
+#include <vorbis/vorbisfile.h>
+#include <alsa/asoundlib.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+enum {
+    NoError = 0,
+    DecoderError = 1,
+    OutputError = 2,
+    UnsupportedFormat = 3
+};
+
+class Decoder
+{
+public:
+    enum Mode {
+        Probe, // no frame index, for metadata and sequential decoding
+        Playback // sample accurate seeking
+    };
+    Decoder() : rate(0), chans(0), frames(-1) {}
+    virtual ~Decoder() {}
+    virtual bool open(const QString &path, Mode mode) = 0;
+    virtual int read(qint16 *samples, int frames) = 0; // 0 at the end, -1 on error
+    virtual bool seek(qint64 frame) = 0;
+
+    int sampleRate() const { return rate; }
+    int channels() const { return chans; }
+    qint64 length() const { return frames; } // frames, -1 if unknown
+
+    static Decoder *create(const QString &path, Mode mode);
+protected:
+    int rate, chans;
+    qint64 frames;
+};
+
+class Mpg123Decoder : public Decoder
+{
+public:
+    Mpg123Decoder() : handle(0) {}
+    ~Mpg123Decoder()
+    {
+        if (handle) {
+            mpg123_close(handle);
+            mpg123_delete(handle);
+        }
+    }
+
+    virtual bool open(const QString &path, Mode mode)
+    {
+        int err;
+        if (!(handle = mpg123_new(0, &err)))
+            return false;
+        // always 16 bit, let ALSA deal with the rate
+        const long *rates;
+        size_t count;
+        mpg123_rates(&rates, &count);
+        mpg123_format_none(handle);
+        for (size_t i=0; i<count; ++i)
+            mpg123_format(handle, rates[i], MPG123_MONO|MPG123_STEREO, MPG123_ENC_SIGNED_16);
+        if (mpg123_open(handle, QFile::encodeName(path).constData()) != MPG123_OK)
+            return false;
+        // builds the frame index so seeking is sample accurate, even for
+        // VBR. This reads the whole file so probes make do with the length
+        // from the Xing/Info header or the bitrate.
+        if (mode == Playback)
+            mpg123_scan(handle);
+        long r;
+        int c, encoding;
+        if (mpg123_getformat(handle, &r, &c, &encoding) != MPG123_OK)
+            return false;
+        rate = r;
+        chans = c;
+        const off_t length = mpg123_length(handle);
+        frames = (length == MPG123_ERR ? -1 : qint64(length));
+        return true;
+    }
+
+    virtual int read(qint16 *samples, int count)
+    {
+        size_t done = 0;
+        const int ret = mpg123_read(handle, reinterpret_cast<unsigned char*>(samples),
+                                    count * chans * sizeof(qint16), &done);
+        switch (ret) {
+        case MPG123_OK:
+        case MPG123_DONE:
+        case MPG123_NEW_FORMAT: // only 16 bit is enabled, rate changes mid file are rare enough
+            return int(done / (chans * sizeof(qint16)));
+        default:
+            return -1;
+        }
+    }
+
+    virtual bool seek(qint64 frame)
+    {
+        return mpg123_seek(handle, off_t(frame), SEEK_SET) >= 0;
+    }
+private:
+    mpg123_handle *handle;
+};
+
+class VorbisDecoder : public Decoder
+{
+public:
+    VorbisDecoder() : opened(false) {}
+    ~VorbisDecoder()
+    {
+        if (opened)
+            ov_clear(&file);
+    }
+
+    virtual bool open(const QString &path, Mode)
+    {
+        if (ov_fopen(QFile::encodeName(path).constData(), &file) != 0)
+            return false;
+        opened = true;
+        const vorbis_info *info = ov_info(&file, -1);
+        if (!info)
+            return false;
+        rate = info->rate;
+        chans = info->channels;
+        const ogg_int64_t total = ov_pcm_total(&file, -1);
+        frames = (total < 0 ? -1 : qint64(total));
+        return true;
+    }
+
+    virtual int read(qint16 *samples, int count)
+    {
+        const int bigEndian = (Q_BYTE_ORDER == Q_BIG_ENDIAN ? 1 : 0);
+        char *buffer = reinterpret_cast<char*>(samples);
+        const int bytes = count * chans * sizeof(qint16);
+        int done = 0;
+        while (done < bytes) {
+            int section;
+            const long ret = ov_read(&file, buffer + done, bytes - done, bigEndian, 2, 1, &section);
+            if (ret == 0)
+                break;
+            if (ret < 0) {
+                if (ret == OV_HOLE) // recoverable
+                    continue;
+                return done ? int(done / (chans * sizeof(qint16))) : -1;
+            }
+            done += ret;
+        }
+        return int(done / (chans * sizeof(qint16)));
+    }
+
+    virtual bool seek(qint64 frame)
+    {
+        return ov_pcm_seek(&file, ogg_int64_t(frame)) == 0;
+    }
+private:
+    OggVorbis_File file;
+    bool opened;
+};
+
+Decoder *Decoder::create(const QString &path, Mode mode)
+{
+    const QString suffix = QFileInfo(path).suffix().toLower();
+    Decoder *decoder = 0;
+    if (suffix == "mp3" || suffix == "mp2" || suffix == "mpga") {
+        decoder = new Mpg123Decoder;
+    } else if (suffix == "ogg" || suffix == "oga") {
+        decoder = new VorbisDecoder;
+    } else {
+        return 0;
+    }
+    if (!decoder->open(path, mode) || decoder->sampleRate() <= 0 || decoder->channels() <= 0) {
+        delete decoder;
+        return 0;
+    }
+    return decoder;
+}
+
+/* 10 band peaking equalizer at the same frequencies xine uses. Values
+   are -100..100 like XINE_PARAM_EQ_*, mapped to +-12dB */
+class Equalizer
+{
+public:
+    Equalizer() : channels(0), rate(0), active(false) {}
+
+    static const int *bands()
+    {
+        static const int hz[] = { 30, 60, 126, 250, 500, 1000, 2000, 4000, 8000, 16000, -1 };
+        return hz;
+    }
+
+    void setFormat(int r, int c)
+    {
+        rate = r;
+        channels = c;
+        update();
+    }
+
+    void setSettings(const QHash<int, int> &eq)
+    {
+        settings = eq;
+        update();
+    }
+
+    void process(qint16 *samples, int frames)
+    {
+        if (!active)
+            return;
+        for (int b=0; b<filters.size(); ++b) {
+            Filter &f = filters[b];
+            if (f.passThrough)
+                continue;
+            for (int c=0; c<channels; ++c) {
+                double s0 = f.state[c * 2], s1 = f.state[c * 2 + 1];
+                for (int i=0; i<frames; ++i) {
+                    qint16 &sample = samples[i * channels + c];
+                    const double x = sample;
+                    const double y = f.b0 * x + s0;
+                    s0 = f.b1 * x - f.a1 * y + s1;
+                    s1 = f.b2 * x - f.a2 * y;
+                    sample = qint16(qBound(-32768.0, y, 32767.0));
+                }
+                f.state[c * 2] = s0;
+                f.state[c * 2 + 1] = s1;
+            }
+        }
+    }
+private:
+    struct Filter {
+        bool passThrough;
+        double b0, b1, b2, a1, a2;
+        QVector<double> state;
+    };
+
+    void update()
+    {
+        active = false;
+        filters.clear();
+        if (!rate || !channels)
+            return;
+        const int *hz = bands();
+        for (int i=0; hz[i] != -1; ++i) {
+            Filter f;
+            const double gain = qBound(-100, settings.value(hz[i]), 100) * 12.0 / 100.0;
+            f.passThrough = (gain == 0.0 || hz[i] >= rate / 2);
+            f.b0 = 1.0;
+            f.b1 = f.b2 = f.a1 = f.a2 = 0.0;
+            if (!f.passThrough) {
+                // RBJ cookbook peaking filter, roughly an octave wide
+                const double A = pow(10.0, gain / 40.0);
+                const double w0 = 2.0 * M_PI * hz[i] / rate;
+                const double alpha = sin(w0) / (2.0 * 1.41);
+                const double a0 = 1.0 + alpha / A;
+                f.b0 = (1.0 + alpha * A) / a0;
+                f.b1 = -2.0 * cos(w0) / a0;
+                f.b2 = (1.0 - alpha * A) / a0;
+                f.a1 = f.b1;
+                f.a2 = (1.0 - alpha / A) / a0;
+                active = true;
+            }
+            f.state.fill(0.0, channels * 2);
+            filters.append(f);
+        }
+    }
+
+    QHash<int, int> settings;
+    QVector<Filter> filters;
+    int channels, rate;
+    bool active;
+};
+
+static inline qint64 threadCpuTime() // microseconds
+{
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline qint64 monotonicUs() // microseconds
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct Private;
+class Worker : public QThread
+{
+public:
+    typedef void (Private::*Function)();
+    Worker(Private *p, Function f) : d(p), function(f) {}
+    virtual void run();
+private:
+    Private *d;
+    Function function;
+};
+
+struct Private
+{
+    enum { Period = 1024 }; // frames per ALSA write
+
+    Private(NativeBackend *b)
+        : backend(b), error(NoError), decoder(0), pcm(0),
+          decoderThread(this, &Private::decodeLoop), outputThread(this, &Private::outputLoop),
+          basePosition(0), pendingSeek(-1), startupMs(-1), underruns(0),
+          maxDeviceWait(0), maxProcessing(0), minBuffered(INT_MAX), realtimeActive(false),
+          decoderCpu(0), outputCpu(0)
+    {
+        status = Backend::Uninitalized;
+        volume = 100;
+        mute = 0;
+        gain = 1000;
+        paused = 0;
+        stopRequested = 0;
+        decoderDone = 0;
+        framesWritten = 0;
+        equalizerDirty = 0;
+    }
+
+    bool openOutput()
+    {
+        static const QByteArray device = Config::value<QString>("alsadevice", "default").toLocal8Bit();
+        static const int latency = Config::value<int>("alsalatency", 100); // ms
+        if (snd_pcm_open(&pcm, device.constData(), SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+            pcm = 0;
+            return false;
+        }
+        if (snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+                               decoder->channels(), decoder->sampleRate(), 1, latency * 1000) < 0) {
+            closeOutput();
+            return false;
+        }
+        return true;
+    }
+
+    void closeOutput()
+    {
+        if (pcm) {
+            snd_pcm_close(pcm);
+            pcm = 0;
+        }
+    }
+
+    void startThreads()
+    {
+        stopRequested = 0;
+        decoderDone = 0;
+        decoderThread.start();
+        outputThread.start();
+    }
+
+    void stopThreads()
+    {
+        stopRequested = 1;
+        condition.wakeAll();
+        decoderThread.wait();
+        outputThread.wait();
+        ring.reset();
+    }
+
+    void rewind()
+    {
+        if (decoder)
+            decoder->seek(0);
+        basePosition = 0;
+        framesWritten = 0;
+    }
+
+    void decodeLoop()
+    {
+        QVector<qint16> buffer(Period * decoder->channels());
+        const int channels = decoder->channels();
+        while (!stopRequested) {
+            if (ring.space() < buffer.size()) {
+                QMutexLocker lock(&mutex);
+                condition.wait(&mutex, 10);
+                continue;
+            }
+            if (equalizerDirty.fetchAndStoreAcquire(0)) {
+                QMutexLocker lock(&mutex);
+                equalizer.setSettings(equalizerSettings);
+            }
+            const int frames = decoder->read(buffer.data(), Period);
+            if (frames <= 0) {
+                if (frames < 0)
+                    LOG(1) << "Decoding error in" << url.toString();
+                break;
+            }
+            equalizer.process(buffer.data(), frames);
+            ring.write(buffer.constData(), frames * channels);
+            condition.wakeAll();
+        }
+        decoderDone = 1;
+        condition.wakeAll();
+        decoderCpu += threadCpuTime();
+    }
+
+    // Raise the calling thread to SCHED_FIFO, or SCHED_RR if FIFO is not
+    // permitted. Needs CAP_SYS_NICE or an RLIMIT_RTPRIO that allows it.
+    static bool makeRealtime()
+    {
+        static const int priority = Config::value<int>("realtimepriority", 50);
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0)
+            ret = pthread_setschedparam(pthread_self(), SCHED_RR, &param);
+        if (ret != 0) {
+            LOG(1) << "Can't get realtime priority" << priority << strerror(ret);
+            return false;
+        }
+        return true;
+    }
+
+    // In realtime mode the output thread never touches the mutex, it
+    // polls with short sleeps instead.
+    void idle(int msec, bool realtime)
+    {
+        if (realtime) {
+            timespec ts = { 0, msec * 1000000 };
+            nanosleep(&ts, 0);
+        } else {
+            QMutexLocker lock(&mutex);
+            condition.wait(&mutex, msec);
+        }
+    }
+
+    void outputLoop()
+    {
+        static const bool realtime = Config::isEnabled("realtime");
+        const int channels = decoder->channels();
+        QVector<qint16> buffer(Period * channels);
+        bool locked = false;
+        if (realtime) {
+            realtimeActive = makeRealtime();
+            // everything the hot path touches is allocated up front
+            locked = (mlock(buffer.constData(), buffer.size() * sizeof(qint16)) == 0);
+            if (locked && mlock(ring.constData(), ring.capacity() * sizeof(qint16)) != 0) {
+                const int error = errno;
+                munlock(buffer.constData(), buffer.size() * sizeof(qint16));
+                errno = error;
+                locked = false;
+            }
+            if (!locked)
+                LOG(1) << "Can't lock audio buffers" << strerror(errno);
+        }
+        bool finished = false, primed = false;
+        bool pcmPaused = false, pcmDropped = false;
+        while (!stopRequested) {
+            if (paused) {
+                if (!pcmPaused && !pcmDropped) {
+                    // not all devices can pause, drop what's queued instead
+                    if (snd_pcm_pause(pcm, 1) == 0) {
+                        pcmPaused = true;
+                    } else {
+                        snd_pcm_drop(pcm);
+                        pcmDropped = true;
+                    }
+                }
+                idle(100, realtime);
+                continue;
+            }
+            if (pcmPaused) {
+                snd_pcm_pause(pcm, 0);
+                pcmPaused = false;
+            } else if (pcmDropped) {
+                snd_pcm_prepare(pcm);
+                pcmDropped = false;
+            }
+
+            const qint64 start = monotonicUs();
+            const int fill = ring.available();
+            if (primed && fill < minBuffered)
+                minBuffered = fill;
+            const int count = ring.read(buffer.data(), buffer.size());
+            if (!count) {
+                if (decoderDone && !ring.available()) {
+                    finished = true;
+                    break;
+                }
+                idle(realtime ? 1 : 5, realtime);
+                continue;
+            }
+            if (!realtime)
+                condition.wakeAll(); // the decoder polls on its own in realtime mode
+
+            // volume and gain in 16.16 fixed point
+            const qint64 scale = (mute ? 0 : (qint64(int(volume)) * int(gain) << 16) / (100 * 1000));
+            if (scale != (1 << 16)) {
+                qint16 *samples = buffer.data();
+                for (int i=0; i<count; ++i)
+                    samples[i] = qint16(qBound<qint64>(-32768, (samples[i] * scale) >> 16, 32767));
+            }
+            const qint64 processing = monotonicUs() - start;
+            if (processing > maxProcessing)
+                maxProcessing = processing;
+
+            const int frames = count / channels;
+            int written = 0;
+            while (written < frames && !stopRequested) {
+                const qint64 before = monotonicUs();
+                snd_pcm_sframes_t ret = snd_pcm_writei(pcm, buffer.constData() + written * channels, frames - written);
+                const qint64 wait = monotonicUs() - before;
+                if (wait > maxDeviceWait)
+                    maxDeviceWait = wait;
+                if (ret < 0) {
+                    if (ret == -EPIPE)
+                        ++underruns;
+                    if (snd_pcm_recover(pcm, int(ret), 1) < 0) {
+                        LOG(0) << "ALSA write failed" << snd_strerror(int(ret));
+                        stopRequested = 1;
+                        break;
+                    }
+                    continue;
+                }
+                written += int(ret);
+            }
+            if (startupMs == -1)
+                startupMs = startupTimer.elapsed();
+            primed = true;
+            framesWritten.fetchAndAddRelease(written);
+        }
+        if (locked) {
+            munlock(buffer.constData(), buffer.size() * sizeof(qint16));
+            munlock(ring.constData(), ring.capacity() * sizeof(qint16));
+        }
+        if (finished) {
+            snd_pcm_drain(pcm);
+            // the threads are joined and the device closed by the next
+            // play(), stop() or loadUrl()
+            status.fetchAndStoreOrdered(Backend::Stopped);
+            backend->statusChanged(Backend::Stopped);
+            backend->sendEvent(Backend::SongFinished);
+        }
+        outputCpu += threadCpuTime();
+    }
+
+    // frames actually heard, i.e. minus what's still queued in ALSA
+    qint64 position() const
+    {
+        qint64 ret = basePosition + int(framesWritten);
+        snd_pcm_sframes_t delay = 0;
+        if (pcm && status == Backend::Playing && snd_pcm_delay(pcm, &delay) == 0)
+            ret -= delay;
+        return qMax<qint64>(0, ret);
+    }
+
+    NativeBackend *backend;
+    QAtomicInt status; // Backend::Status, the output thread sets Stopped at the end
+    int error;
+    QUrl url;
+    Decoder *decoder;
+    snd_pcm_t *pcm;
+    RingBuffer<qint16> ring;
+    Worker decoderThread, outputThread;
+    QMutex mutex; // only for sleeping and the equalizer settings
+    QWaitCondition condition;
+    Equalizer equalizer;
+    QHash<int, int> equalizerSettings;
+    QAtomicInt equalizerDirty;
+    QAtomicInt volume, mute, gain; // gain in 1/1000
+    QAtomicInt paused, stopRequested, decoderDone, framesWritten;
+    qint64 basePosition, pendingSeek;
+    QTime startupTimer;
+    int startupMs, underruns;
+    // microseconds, the longest a snd_pcm_writei() blocked waiting for
+    // the device and the longest it took to get a period ready for it
+    qint64 maxDeviceWait, maxProcessing;
+    int minBuffered; // lowest ring buffer fill seen since playback started, in samples
+    bool realtimeActive;
+    qint64 decoderCpu, outputCpu;
+};
+
+void Worker::run()
+{
+    (d->*function)();
+}
+
+NativeBackend::NativeBackend(QObject *tail)
+    : Backend("NativeBackend", tail), d(new Private(this))
+{
+}
+
+NativeBackend::~NativeBackend()
+{
+    shutdown();
+    delete d;
+}
+
+bool NativeBackend::initBackend()
+{
+    if (d->status != Uninitalized)
+        return true;
+    if (mpg123_init() != MPG123_OK) {
+        d->error = DecoderError;
+        return false;
+    }
+    d->status = Stopped;
+    return true;
+}
+
+void NativeBackend::shutdown()
+{
+    if (d->status == Uninitalized)
+        return;
+    stop();
+    d->closeOutput();
+    delete d->decoder;
+    d->decoder = 0;
+    mpg123_exit();
+    d->status = Uninitalized;
+    statusChanged(d->status);
+}
+
+bool NativeBackend::trackData(TrackData *data, const QUrl &url, int mask) const
+{
+    if (status() == Uninitalized)
+        return false;
+    if (mask & TrackLength) {
+        Decoder *decoder = (url == d->url ? d->decoder : Decoder::create(url.toLocalFile(), Decoder::Probe));
+        if (!decoder)
+            return false;
+        if (decoder->length() >= 0)
+            data->setData(TrackLength, int(decoder->length() * 1000 / decoder->sampleRate()));
+        if (decoder != d->decoder)
+            delete decoder;
+    }
+    return true;
+}
+
+bool NativeBackend::isValid(const QUrl &url) const
+{
+    if (status() == Uninitalized)
+        return false;
+    Decoder *decoder = Decoder::create(url.toLocalFile(), Decoder::Probe);
+    delete decoder;
+    return decoder != 0;
+}
+
+void NativeBackend::play()
+{
+    if (d->status.testAndSetOrdered(Paused, Playing)) {
+        d->paused = 0;
+        d->condition.wakeAll();
+        statusChanged(Playing);
+        return;
+    }
+    if (d->status == Stopped && d->decoder) {
+        if (d->pcm) {
+            // the last play() ran to the end, join the threads and start over
+            d->stopThreads();
+            d->closeOutput();
+            d->rewind();
+        }
+        d->startupTimer.start();
+        d->startupMs = -1;
+        d->minBuffered = INT_MAX;
+        if (!d->openOutput()) {
+            d->error = OutputError;
+            return;
+        }
+        if (d->pendingSeek != -1) {
+            d->decoder->seek(d->pendingSeek);
+            d->basePosition = d->pendingSeek;
+            d->pendingSeek = -1;
+        }
+        d->paused = 0;
+        d->status = Playing;
+        d->startThreads();
+        statusChanged(Playing);
+    }
+}
+
+void NativeBackend::pause()
+{
+    // loses against the output thread finishing the track
+    if (d->status.testAndSetOrdered(Playing, Paused)) {
+        d->paused = 1;
+        statusChanged(Paused);
+    }
+}
+
+void NativeBackend::stop()
+{
+    if (d->status != Playing && d->status != Paused) {
+        // the output thread may have finished the track on its own
+        if (d->pcm) {
+            d->stopThreads();
+            d->closeOutput();
+            d->rewind();
+        }
+        return;
+    }
+    d->stopThreads();
+    if (d->pcm)
+        snd_pcm_drop(d->pcm);
+    d->closeOutput();
+    d->rewind();
+    d->pendingSeek = -1;
+    d->paused = 0;
+    d->status = Stopped;
+    statusChanged(d->status);
+}
+
+bool NativeBackend::loadUrl(const QUrl &url)
+{
+    stop();
+    delete d->decoder;
+    d->decoder = Decoder::create(url.toLocalFile(), Decoder::Playback);
+    d->url = d->decoder ? url : QUrl();
+    d->basePosition = 0;
+    d->framesWritten = 0;
+    d->pendingSeek = -1;
+    if (!d->decoder) {
+        d->error = UnsupportedFormat;
+        return false;
+    }
+    static const int bufferMs = Config::value<int>("nativebuffer", 500);
+    d->ring.setCapacity(d->decoder->sampleRate() * d->decoder->channels() * bufferMs / 1000);
+    d->equalizer.setFormat(d->decoder->sampleRate(), d->decoder->channels());
+    d->error = NoError;
+    return true;
+}
+
+int NativeBackend::status() const
+{
+    return d->status;
+}
+
+int NativeBackend::volume() const
+{
+    return d->volume;
+}
+
+void NativeBackend::setVolume(int vol)
+{
+    d->volume = qBound(0, vol, 100);
+}
+
+void NativeBackend::setMute(bool on)
+{
+    d->mute = on ? 1 : 0;
+}
+
+bool NativeBackend::isMute() const
+{
+    return d->mute;
+}
+
+void NativeBackend::setGain(double gain)
+{
+    d->gain = qRound(1000.0 * pow(10.0, gain / 20.0));
+}
+
+void NativeBackend::setProgress(int type, int progress)
+{
+    if (!d->decoder)
+        return;
+    const qint64 length = d->decoder->length();
+    qint64 frame;
+    if (type == Seconds) {
+        frame = qint64(progress) * d->decoder->sampleRate();
+    } else if (type == Milliseconds) {
+        frame = qint64(progress) * d->decoder->sampleRate() / 1000;
+    } else if (length > 0) {
+        frame = qint64(progress) * length / 10000;
+    } else {
+        return;
+    }
+    if (length > 0)
+        frame = qBound<qint64>(0, frame, length);
+
+    if (d->status == Stopped) {
+        d->pendingSeek = frame; // applied on the next play()
+        return;
+    }
+    d->stopThreads();
+    snd_pcm_drop(d->pcm);
+    snd_pcm_prepare(d->pcm);
+    d->decoder->seek(frame);
+    d->basePosition = frame;
+    d->framesWritten = 0;
+    d->startThreads();
+}
+
+int NativeBackend::progress(int type)
+{
+    if (!d->decoder)
+        return -1;
+    const qint64 frames = (d->status == Stopped && d->pendingSeek != -1 ? d->pendingSeek : d->position());
+    if (type == Seconds)
+        return int(frames / d->decoder->sampleRate());
+    if (type == Milliseconds)
+        return int(frames * 1000 / d->decoder->sampleRate());
+    const qint64 length = d->decoder->length();
+    return length > 0 ? int(frames * 10000 / length) : -1;
+}
+
+QString NativeBackend::errorMessage() const
+{
+    switch (d->error) {
+    case NoError: return QString();
+    case DecoderError: return "Decoder error";
+    case OutputError: return "Can't open audio output";
+    case UnsupportedFormat: return "Unsupported format";
+    default:
+        break;
+    }
+    Q_ASSERT(0);
+    return QString();
+}
+
+int NativeBackend::errorCode() const
+{
+    return d->error;
+}
+
+int NativeBackend::capabilities() const
+{
+    return SupportsEqualizer;
+}
+
+QHash<int, int> NativeBackend::equalizerSettings() const
+{
+    QMutexLocker lock(&d->mutex);
+    QHash<int, int> ret;
+    const int *hz = Equalizer::bands();
+    for (int i=0; hz[i] != -1; ++i)
+        ret[hz[i]] = d->equalizerSettings.value(hz[i]);
+    return ret;
+}
+
+void NativeBackend::setEqualizerSettings(const QHash<int, int> &eq)
+{
+    QMutexLocker lock(&d->mutex);
+    for (QHash<int, int>::const_iterator it = eq.begin(); it != eq.end(); ++it)
+        d->equalizerSettings[it.key()] = it.value();
+    if (d->decoderThread.isRunning()) {
+        d->equalizerDirty = 1; // picked up by the decoder thread
+    } else {
+        d->equalizer.setSettings(d->equalizerSettings);
+    }
+}
+
+QVariantMap NativeBackend::statistics() const
+{
+    QVariantMap ret;
+    ret.insert("startupMs", d->startupMs);
+    ret.insert("underruns", d->underruns);
+    ret.insert("decoderCpuMs", d->decoderCpu / 1000);
+    ret.insert("outputCpuMs", d->outputCpu / 1000);
+    ret.insert("realtime", d->realtimeActive);
+    ret.insert("maxDeviceWaitUs", d->maxDeviceWait);
+    ret.insert("maxProcessingUs", d->maxProcessing);
+    if (d->decoder) {
+        const int rate = d->decoder->sampleRate() * d->decoder->channels();
+        ret.insert("bufferedMs", qint64(d->ring.available()) * 1000 / rate);
+        ret.insert("bufferCapacityMs", qint64(d->ring.capacity()) * 1000 / rate);
+        if (d->minBuffered != INT_MAX)
+            ret.insert("minBufferedMs", qint64(d->minBuffered) * 1000 / rate);
+    }
+    return ret;
+}
+
+bool NativeBackend::decode(const QUrl &url, AudioSink *sink) const
+{
+    Decoder *decoder = Decoder::create(url.toLocalFile(), Decoder::Probe);
+    if (!decoder)
+        return false;
+    bool ok = sink->format(decoder->sampleRate(), decoder->channels());
+    QVector<qint16> buffer(Private::Period * decoder->channels());
+    while (ok) {
+        const int frames = decoder->read(buffer.data(), Private::Period);
+        if (frames <= 0) {
+            ok = (frames == 0);
+            break;
+        }
+        ok = sink->write(buffer.constData(), frames);
+    }
+    delete decoder;
+    return ok;
+}
+
+extern "C" {
+    BackendPlugin *createTokoloshBackendInterface()
+    {
+        return new NativeBackendPlugin;
+    }
+};
@@ -0,0 +1,5 @@
+HEADERS += nativebackend.h ringbuffer.h
+SOURCES += nativebackend.cpp
+DEFINES += BACKEND=NativeBackend
+LIBS += -lmpg123 -lvorbisfile -lasound
+include(backend.pri)
@@ -0,0 +1,367 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "nullbackend.h"
+#include "seekindex.h"
+#include <config.h>
+#include <log.h>
+
+struct Private : public QThread
+{
+    enum { Step = 100 }; // milliseconds of virtual time per chunk
+
+    Private(NullBackend *b)
+        : backend(b), status(Backend::Uninitalized), speed(1.0), length(0), size(0),
+          position(0), seekTo(-1), paused(false), abort(false), volume(100), mute(false),
+          bytes(0), playedMs(0), wallMs(0), tracksFinished(0), checksum(0)
+    {}
+
+    // called with the mutex held
+    qint64 offsetAt(int msec) const
+    {
+        if (msec >= length)
+            return size;
+        if (!index.isNull())
+            return index.offset(msec);
+        return length ? size * msec / length : 0;
+    }
+
+    virtual void run()
+    {
+        QFile file(url.toLocalFile());
+        const bool readable = file.open(QIODevice::ReadOnly); // remote urls only advance the clock
+        QMutexLocker lock(&mutex);
+        QTime clock;
+        clock.start();
+        qint64 clockBase = position;
+        while (!abort) {
+            if (paused) {
+                wallMs += clock.elapsed();
+                condition.wait(&mutex);
+                clock.restart();
+                clockBase = position;
+                continue;
+            }
+            if (seekTo != -1) {
+                position = seekTo;
+                seekTo = -1;
+                wallMs += clock.restart();
+                clockBase = position;
+            }
+            if (position >= length)
+                break;
+
+            const int to = qMin(length, position + Step);
+            const qint64 from = offsetAt(position);
+            const qint64 end = offsetAt(to);
+            lock.unlock();
+            qint64 read = 0;
+            if (readable && end > from && file.seek(from)) {
+                // touch every byte so the I/O can't be optimized away
+                const QByteArray chunk = file.read(end - from);
+                const char *data = chunk.constData();
+                uint sum = 0;
+                for (int i=0; i<chunk.size(); ++i)
+                    sum += uchar(data[i]);
+                checksum += sum;
+                read = chunk.size();
+            }
+            lock.relock();
+            bytes += read;
+            playedMs += to - position;
+            if (seekTo == -1)
+                position = to;
+
+            if (speed > 0) {
+                const int ahead = int((position - clockBase) / speed) - clock.elapsed();
+                if (ahead > 0)
+                    condition.wait(&mutex, ahead);
+            }
+        }
+        wallMs += clock.elapsed();
+        const bool finished = !abort && position >= length;
+        if (finished) {
+            status = Backend::Stopped;
+            position = 0;
+            ++tracksFinished;
+        }
+        lock.unlock();
+        if (finished) {
+            backend->statusChanged(Backend::Stopped);
+            backend->sendEvent(Backend::SongFinished);
+        }
+    }
+
+    void halt()
+    {
+        {
+            QMutexLocker lock(&mutex);
+            abort = true;
+            condition.wakeAll();
+        }
+        wait();
+        QMutexLocker lock(&mutex);
+        abort = false;
+        paused = false;
+    }
+
+    NullBackend *backend;
+    mutable QMutex mutex;
+    QWaitCondition condition;
+    Backend::Status status;
+    double speed; // 0 means as fast as possible
+    QUrl url;
+    SeekIndex index;
+    int length; // milliseconds
+    qint64 size;
+    int position, seekTo;
+    bool paused, abort;
+    int volume;
+    bool mute;
+    QHash<int, int> equalizer;
+    qint64 bytes, playedMs, wallMs; // nothing is decoded, the file is only read
+    int tracksFinished;
+    uint checksum;
+};
+
+NullBackend::NullBackend(QObject *tail)
+    : Backend("NullBackend", tail), d(new Private(this))
+{
+}
+
+NullBackend::~NullBackend()
+{
+    d->halt();
+    delete d;
+}
+
+bool NullBackend::initBackend()
+{
+    if (d->status != Uninitalized)
+        return true;
+    d->speed = qMax(0.0, Config::value<double>("nullspeed", 1.0));
+    d->status = Stopped;
+    return true;
+}
+
+void NullBackend::shutdown()
+{
+    if (d->status == Uninitalized)
+        return;
+    d->halt();
+    {
+        QMutexLocker lock(&d->mutex);
+        d->status = Uninitalized;
+    }
+    statusChanged(Uninitalized);
+}
+
+bool NullBackend::trackData(TrackData *data, const QUrl &url, int mask) const
+{
+    if (status() == Uninitalized)
+        return false;
+    const QString path = url.toLocalFile();
+    if (mask & TrackLength && SeekIndex::canIndex(path)) {
+        const SeekIndex index = SeekIndex::index(path);
+        if (!index.isNull())
+            data->setData(TrackLength, index.length());
+    }
+    return true;
+}
+
+bool NullBackend::isValid(const QUrl &url) const
+{
+    const QString path = url.toLocalFile();
+    return status() != Uninitalized && (path.isEmpty() || QFileInfo(path).isFile());
+}
+
+void NullBackend::play()
+{
+    QMutexLocker lock(&d->mutex);
+    switch (d->status) {
+    case Stopped:
+        if (d->url.isEmpty())
+            return;
+        lock.unlock();
+        d->wait(); // might still be finishing the previous track
+        lock.relock();
+        d->status = Playing;
+        d->start();
+        break;
+    case Paused:
+        d->paused = false;
+        d->status = Playing;
+        d->condition.wakeAll();
+        break;
+    default:
+        return;
+    }
+    lock.unlock();
+    statusChanged(Playing);
+}
+
+void NullBackend::pause()
+{
+    QMutexLocker lock(&d->mutex);
+    if (d->status == Playing) {
+        d->paused = true;
+        d->status = Paused;
+        d->condition.wakeAll();
+        lock.unlock();
+        statusChanged(Paused);
+    }
+}
+
+void NullBackend::stop()
+{
+    {
+        QMutexLocker lock(&d->mutex);
+        if (d->status != Playing && d->status != Paused)
+            return;
+    }
+    d->halt();
+    {
+        QMutexLocker lock(&d->mutex);
+        d->status = Stopped;
+        d->position = 0;
+        d->seekTo = -1;
+    }
+    statusChanged(Stopped);
+}
+
+bool NullBackend::loadUrl(const QUrl &url)
+{
+    stop();
+    d->wait();
+    const QString path = url.toLocalFile();
+    QMutexLocker lock(&d->mutex);
+    d->url = url;
+    d->position = 0;
+    d->seekTo = -1;
+    d->index = SeekIndex();
+    d->size = 0;
+    d->length = 0;
+    if (!path.isEmpty()) {
+        const QFileInfo fi(path);
+        if (!fi.isFile())
+            return false;
+        d->size = fi.size();
+        if (SeekIndex::canIndex(path))
+            d->index = SeekIndex::index(path);
+        // pretend anything we can't index is 128kbit/s
+        d->length = (d->index.isNull() ? int(d->size * 8 / 128) : d->index.length());
+    }
+    return true;
+}
+
+int NullBackend::status() const
+{
+    QMutexLocker lock(&d->mutex);
+    return d->status;
+}
+
+int NullBackend::volume() const
+{
+    return d->volume;
+}
+
+void NullBackend::setVolume(int vol)
+{
+    d->volume = vol;
+}
+
+void NullBackend::setMute(bool on)
+{
+    d->mute = on;
+}
+
+bool NullBackend::isMute() const
+{
+    return d->mute;
+}
+
+void NullBackend::setProgress(int type, int progress)
+{
+    QMutexLocker lock(&d->mutex);
+    const int msec = (type == Seconds ? progress * 1000
+                      : type == Milliseconds ? progress
+                      : int(qint64(progress) * d->length / 10000));
+    if (d->status == Stopped) {
+        d->position = qBound(0, msec, d->length); // applied on the next play()
+    } else {
+        d->seekTo = qBound(0, msec, d->length);
+        d->condition.wakeAll();
+    }
+}
+
+int NullBackend::progress(int type)
+{
+    QMutexLocker lock(&d->mutex);
+    if (type == Seconds)
+        return d->position / 1000;
+    if (type == Milliseconds)
+        return d->position;
+    return d->length ? int(qint64(d->position) * 10000 / d->length) : 0;
+}
+
+int NullBackend::capabilities() const
+{
+    return SupportsEqualizer;
+}
+
+QHash<int, int> NullBackend::equalizerSettings() const
+{
+    return d->equalizer;
+}
+
+void NullBackend::setEqualizerSettings(const QHash<int, int> &eq)
+{
+    for (QHash<int, int>::const_iterator it = eq.begin(); it != eq.end(); ++it) {
+        d->equalizer[it.key()] = it.value();
+    }
+}
+
+QVariantMap NullBackend::statistics() const
+{
+    QMutexLocker lock(&d->mutex);
+    QVariantMap ret;
+    ret.insert("speed", d->speed);
+    ret.insert("bytesRead", d->bytes);
+    ret.insert("playedMs", d->playedMs);
+    ret.insert("wallMs", d->wallMs);
+    // media time per wall time for reading the file, not decoding it
+    ret.insert("readTimeFactor", d->wallMs ? double(d->playedMs) / d->wallMs : 0.0);
+    ret.insert("tracksFinished", d->tracksFinished);
+    return ret;
+}
+
+extern "C" {
+    BackendPlugin *createTokoloshBackendInterface()
+    {
+        return new NullBackendPlugin;
+    }
+};
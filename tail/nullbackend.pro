@@ -0,0 +1,4 @@
+HEADERS += nullbackend.h seekindex.h
+SOURCES += nullbackend.cpp seekindex.cpp
+DEFINES += BACKEND=NullBackend
+include(backend.pri)
@@ -270,7 +270,7 @@ int PhononBackend::errorCode() const
     return 0;
 }
 
-int PhononBackend::flags() const
+int PhononBackend::capabilities() const
 {
     return NoCapabilities;
 }
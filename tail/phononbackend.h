@@ -56,7 +56,7 @@ public:
     virtual int errorCode() const;
     virtual void setMute(bool on);
     virtual bool isMute() const;
-    virtual int flags() const;
+    virtual int capabilities() const;
 private:
     Private *d;
 };
@@ -0,0 +1,270 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "playlistsnapshot.h"
+#include <log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static inline quint32 stringSize(const QString &string)
+{
+    return string.size() * sizeof(QChar);
+}
+
+static inline quint32 heapSize(const QList<TrackData> &rows)
+{
+    quint32 ret = 0;
+    foreach(const TrackData &row, rows) {
+        ret += ::stringSize(::urlToString(row.url)) + ::stringSize(row.title) + ::stringSize(row.artist)
+               + ::stringSize(row.album) + ::stringSize(row.genre);
+    }
+    return ret;
+}
+
+static inline int createSegment()
+{
+#ifdef SYS_memfd_create
+    const int fd = syscall(SYS_memfd_create, "tokolosh-playlist", 1); // MFD_CLOEXEC
+    if (fd != -1)
+        return fd;
+#endif
+    // older kernels, a POSIX shm object that's unlinked right away
+    const QByteArray name = QString("/tokolosh-playlist-%1").arg(getpid()).toLocal8Bit();
+    const int fd = shm_open(name.constData(), O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd != -1)
+        shm_unlink(name.constData());
+    return fd;
+}
+
+PlaylistSnapshot::PlaylistSnapshot()
+{
+    d.fd = d.readOnlyFd = -1;
+    d.memory = 0;
+    d.size = d.generation = 0;
+    d.rowCapacity = 0;
+    d.heapUsed = 0;
+}
+
+PlaylistSnapshot::~PlaylistSnapshot()
+{
+    release();
+}
+
+void PlaylistSnapshot::release()
+{
+    if (d.memory) {
+        Snapshot::Header *header = reinterpret_cast<Snapshot::Header*>(d.memory);
+        header->replaced = 1;
+        __sync_synchronize();
+        munmap(d.memory, d.size);
+        d.memory = 0;
+    }
+    if (d.readOnlyFd != -1)
+        ::close(d.readOnlyFd);
+    if (d.fd != -1)
+        ::close(d.fd);
+    d.fd = d.readOnlyFd = -1;
+    d.size = 0;
+    d.rowCapacity = 0;
+    d.heapUsed = 0;
+}
+
+bool PlaylistSnapshot::allocate(quint32 size)
+{
+    release();
+    d.fd = ::createSegment();
+    if (d.fd == -1 || ftruncate(d.fd, size) != 0) {
+        LOG(0) << "Can't create playlist snapshot" << strerror(errno);
+        release();
+        return false;
+    }
+    void *memory = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, d.fd, 0);
+    if (memory == MAP_FAILED) {
+        LOG(0) << "Can't map playlist snapshot" << strerror(errno);
+        release();
+        return false;
+    }
+    d.memory = static_cast<uchar*>(memory);
+    d.size = size;
+    // heads get a descriptor they can't write through
+    d.readOnlyFd = ::open(QString("/proc/self/fd/%1").arg(d.fd).toLocal8Bit().constData(), O_RDONLY|O_CLOEXEC);
+    if (d.readOnlyFd == -1)
+        d.readOnlyFd = dup(d.fd);
+
+    Snapshot::Header *header = reinterpret_cast<Snapshot::Header*>(d.memory);
+    header->magic = Snapshot::Magic;
+    header->version = Snapshot::Version;
+    header->generation = d.generation;
+    header->replaced = 0;
+    header->size = size;
+    header->rowCount = 0;
+    header->current = -1;
+    header->rows = sizeof(Snapshot::Header);
+    header->heap = sizeof(Snapshot::Header);
+    return true;
+}
+
+void PlaylistSnapshot::begin()
+{
+    Snapshot::Header *header = reinterpret_cast<Snapshot::Header*>(d.memory);
+    header->generation = ++d.generation; // odd
+    __sync_synchronize();
+}
+
+void PlaylistSnapshot::end()
+{
+    Snapshot::Header *header = reinterpret_cast<Snapshot::Header*>(d.memory);
+    __sync_synchronize();
+    header->generation = ++d.generation; // even
+}
+
+bool PlaylistSnapshot::publish(int from, const QList<TrackData> &rows, int rowCount, int current)
+{
+    Q_ASSERT(from >= 0 && from <= rowCount);
+    Q_ASSERT(from + rows.size() >= rowCount || rowCount <= this->rowCount());
+    if (d.memory && rowCount <= d.rowCapacity) {
+        Snapshot::Header *header = reinterpret_cast<Snapshot::Header*>(d.memory);
+        if (header->heap + d.heapUsed + ::heapSize(rows) <= d.size) {
+            begin();
+            writeRows(from, rows);
+            header->rowCount = rowCount;
+            header->current = current;
+            end();
+            return true;
+        }
+    }
+    // also drops the strings of rows that were replaced earlier
+    QList<TrackData> all;
+    for (int i=0; i<from; ++i) {
+        TrackData data;
+        row(i, &data);
+        all.append(data);
+    }
+    all += rows;
+    for (int i=from + rows.size(); i<rowCount; ++i) {
+        TrackData data;
+        row(i, &data);
+        all.append(data);
+    }
+    return rewrite(all, current);
+}
+
+// Lays out all rows from scratch with room to spare for both rows and
+// strings. Returns false if a new segment had to be created.
+bool PlaylistSnapshot::rewrite(const QList<TrackData> &rows, int current)
+{
+    const int rowCapacity = rows.size() + rows.size() / 2 + 64;
+    const quint32 rowsSize = rowCapacity * sizeof(Snapshot::Row);
+    const quint32 heapSize = ::heapSize(rows);
+    const quint32 size = sizeof(Snapshot::Header) + rowsSize + heapSize + heapSize / 2;
+    bool sameSegment = true;
+    if (size > d.size) {
+        quint32 capacity = qMax<quint32>(d.size, 64 * 1024);
+        while (capacity < size)
+            capacity *= 2;
+        if (!allocate(capacity))
+            return false;
+        sameSegment = false;
+    }
+
+    begin();
+    Snapshot::Header *header = reinterpret_cast<Snapshot::Header*>(d.memory);
+    header->rowCount = rows.size();
+    header->current = current;
+    header->rows = sizeof(Snapshot::Header);
+    header->heap = header->rows + rowsSize;
+    d.rowCapacity = rowCapacity;
+    d.heapUsed = 0;
+    writeRows(0, rows);
+    end();
+    return sameSegment;
+}
+
+// Between begin() and end(), the caller made sure there's room
+void PlaylistSnapshot::writeRows(int from, const QList<TrackData> &rows)
+{
+    const Snapshot::Header *header = reinterpret_cast<const Snapshot::Header*>(d.memory);
+    Snapshot::Row *out = reinterpret_cast<Snapshot::Row*>(d.memory + header->rows) + from;
+    uchar *heap = d.memory + header->heap;
+    foreach(const TrackData &row, rows) {
+        const QString strings[] = { ::urlToString(row.url), row.title, row.artist, row.album, row.genre };
+        Snapshot::String *targets[] = { &out->url, &out->title, &out->artist, &out->album, &out->genre };
+        for (int i=0; i<5; ++i) {
+            targets[i]->offset = d.heapUsed;
+            targets[i]->length = strings[i].size();
+            memcpy(heap + d.heapUsed, strings[i].constData(), ::stringSize(strings[i]));
+            d.heapUsed += ::stringSize(strings[i]);
+        }
+        out->fields = row.fields & ~PlaylistIndex;
+        out->trackLength = row.trackLength;
+        out->albumIndex = row.albumIndex;
+        out->year = row.year;
+        ++out;
+    }
+}
+
+int PlaylistSnapshot::rowCount() const
+{
+    return d.memory ? reinterpret_cast<const Snapshot::Header*>(d.memory)->rowCount : 0;
+}
+
+QString PlaylistSnapshot::string(const Snapshot::String &string) const
+{
+    const Snapshot::Header *header = reinterpret_cast<const Snapshot::Header*>(d.memory);
+    return QString(reinterpret_cast<const QChar*>(d.memory + header->heap + string.offset), string.length);
+}
+
+bool PlaylistSnapshot::row(int index, TrackData *data) const
+{
+    if (index < 0 || index >= rowCount())
+        return false;
+    const Snapshot::Header *header = reinterpret_cast<const Snapshot::Header*>(d.memory);
+    const Snapshot::Row *row = reinterpret_cast<const Snapshot::Row*>(d.memory + header->rows) + index;
+    data->fields = row->fields;
+    data->url = ::urlFromString(string(row->url));
+    data->title = string(row->title);
+    data->artist = string(row->artist);
+    data->album = string(row->album);
+    data->genre = string(row->genre);
+    data->trackLength = row->trackLength;
+    data->albumIndex = row->albumIndex;
+    data->year = row->year;
+    return true;
+}
+
+void PlaylistSnapshot::setCurrent(int current)
+{
+    if (!d.memory)
+        return;
+    begin();
+    reinterpret_cast<Snapshot::Header*>(d.memory)->current = current;
+    end();
+}
@@ -0,0 +1,72 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef PLAYLISTSNAPSHOT_H
+#define PLAYLISTSNAPSHOT_H
+
+#include <QtCore>
+#include <snapshot.h>
+
+/* Writes the playlist into a memfd heads map read only, see
+   shared/snapshot.h for the layout. Rows are rewritten in place with their
+   strings appended to the heap, there's spare room for both. When that
+   runs out everything is laid out again, in a new segment if the playlist
+   has outgrown this one. The old one is then flagged as replaced. */
+
+class PlaylistSnapshot
+{
+public:
+    PlaylistSnapshot();
+    ~PlaylistSnapshot();
+    // Replaces the rows from on and sets the row count, rows after the
+    // replaced ones are kept. Returns false if a new segment had to be
+    // created, heads need to fetch it.
+    bool publish(int from, const QList<TrackData> &rows, int rowCount, int current);
+    void setCurrent(int current);
+    int rowCount() const;
+    bool row(int index, TrackData *data) const; // what was published
+    int fileDescriptor() const { return d.readOnlyFd; } // -1 if there's no segment
+    quint32 generation() const { return d.generation; }
+private:
+    Q_DISABLE_COPY(PlaylistSnapshot);
+    bool allocate(quint32 size);
+    void release();
+    void begin();
+    void end();
+    bool rewrite(const QList<TrackData> &rows, int current);
+    void writeRows(int from, const QList<TrackData> &rows);
+    QString string(const Snapshot::String &string) const;
+    struct Data {
+        int fd, readOnlyFd;
+        uchar *memory;
+        quint32 size, generation;
+        int rowCapacity;
+        quint32 heapUsed;
+    } d;
+};
+
+#endif
@@ -0,0 +1,165 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "pluginloader.h"
+#include "backendplugin.h"
+#include "routerbackend.h"
+#include <log.h>
+
+// index of the first name in names that keys provides and we still need
+static inline int matchBackend(const QStringList &keys, const QStringList &names, const QVector<Backend*> &found)
+{
+    for (int i=0; i<names.size(); ++i) {
+        if (!found.at(i) && keys.contains(names.at(i), Qt::CaseInsensitive))
+            return i;
+    }
+    return -1;
+}
+
+PluginLoader::PluginLoader(const QString &directory)
+{
+    d.directory = directory;
+    d.loaded = d.files = 0;
+}
+
+bool PluginLoader::exists() const
+{
+    return QDir(d.directory).exists();
+}
+
+Backend *PluginLoader::load(const QStringList &names, QObject *tail)
+{
+    QMutexLocker lock(&d.mutex);
+    QVector<Backend*> found(names.size());
+    int foundCount = 0;
+    QHash<QLibrary*, BackendPlugin*> candidates;
+    QFileInfoList others; // known plugins we didn't ask for
+    const QFileInfoList files = QDir(d.directory).entryInfoList(QDir::Files, QDir::Size);
+    d.files = files.size();
+    d.manifest.prune(files);
+
+    foreach(const QFileInfo &fi, files) {
+        if (foundCount == names.size())
+            break;
+        QStringList keys;
+        if (d.manifest.keys(fi, &keys) && ::matchBackend(keys, names, found) == -1) {
+            if (!keys.isEmpty())
+                others.append(fi);
+            continue;
+        }
+        QLibrary *lib = new QLibrary(fi.absoluteFilePath());
+        CreateBackend createBackend = 0;
+        if (lib->load() && (createBackend = (CreateBackend)lib->resolve("createTokoloshBackendInterface"))) {
+            ++d.loaded;
+            BackendPlugin *interface = createBackend();
+            d.manifest.insert(fi, interface ? interface->keys() : QStringList());
+            const int match = interface ? ::matchBackend(interface->keys(), names, found) : -1;
+            if (match != -1) {
+                Backend *backend = interface->createBackend(tail);
+                if (backend) {
+                    found[match] = backend;
+                    ++foundCount;
+                } else {
+                    LOG(0) << fi.absoluteFilePath() << "doesn't seem to be able to create a backend";
+                }
+                delete interface;
+                if (!backend)
+                    delete lib; // deleting a QLibrary doesn't unload it
+            } else if (!interface) {
+                delete lib;
+            } else {
+                candidates[lib] = interface;
+            }
+        } else {
+            if (lib->isLoaded()) {
+                LOG(1) << "Can't load" << fi.absoluteFilePath() << lib->errorString();
+                d.manifest.insert(fi, QStringList()); // not a plugin, a failed load is retried next time
+            }
+            delete lib;
+        }
+    }
+
+    QList<Backend*> backends;
+    foreach(Backend *backend, found) {
+        if (backend)
+            backends.append(backend);
+    }
+    if (backends.isEmpty() && candidates.isEmpty()) {
+        // none of the ones we asked for, settle for anything
+        foreach(const QFileInfo &fi, others) {
+            QLibrary *lib = new QLibrary(fi.absoluteFilePath());
+            CreateBackend createBackend = 0;
+            if (lib->load() && (createBackend = (CreateBackend)lib->resolve("createTokoloshBackendInterface"))) {
+                ++d.loaded;
+                BackendPlugin *interface = createBackend();
+                if (interface) {
+                    candidates[lib] = interface;
+                    break;
+                }
+            }
+            delete lib;
+        }
+    }
+    for (QHash<QLibrary*, BackendPlugin*>::const_iterator it = candidates.begin(); it != candidates.end(); ++it) {
+        Backend *backend = 0;
+        if (backends.isEmpty())
+            backend = it.value()->createBackend(tail);
+        if (backend)
+            backends.append(backend);
+        delete it.value();
+        if (!backend)
+            delete it.key(); // deleting a QLibrary doesn't unload it
+    }
+    d.manifest.save();
+    if (backends.isEmpty())
+        return 0;
+    return (backends.size() == 1 ? backends.first() : new RouterBackend(backends, tail));
+}
+
+int PluginLoader::loaded() const
+{
+    QMutexLocker lock(&d.mutex);
+    return d.loaded;
+}
+
+int PluginLoader::files() const
+{
+    QMutexLocker lock(&d.mutex);
+    return d.files;
+}
+
+int PluginLoader::manifestHits() const
+{
+    QMutexLocker lock(&d.mutex);
+    return d.manifest.hits();
+}
+
+int PluginLoader::manifestMisses() const
+{
+    QMutexLocker lock(&d.mutex);
+    return d.manifest.misses();
+}
@@ -0,0 +1,151 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "pluginmanifest.h"
+#include <global.h>
+#include <log.h>
+#ifdef Q_OS_UNIX
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+enum { ManifestMagic = 0x91a6e5, ManifestVersion = 2 };
+
+QDataStream &operator<<(QDataStream &ds, const PluginManifest::Entry &entry)
+{
+    ds << entry.modified << entry.size << entry.keys;
+    return ds;
+}
+
+QDataStream &operator>>(QDataStream &ds, PluginManifest::Entry &entry)
+{
+    ds >> entry.modified >> entry.size >> entry.keys;
+    return ds;
+}
+
+static inline QString manifestFileName()
+{
+    return ::cacheDirectory() + QLatin1String("/plugins");
+}
+
+PluginManifest::PluginManifest()
+{
+    d.dirty = false;
+    d.hits = d.misses = 0;
+    QFile file(::manifestFileName());
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream ds(&file);
+        quint32 magic, version;
+        ds >> magic >> version;
+        if (magic == ManifestMagic && version == ManifestVersion) {
+            ds >> d.entries;
+            if (ds.status() != QDataStream::Ok)
+                d.entries.clear();
+        }
+    }
+}
+
+PluginManifest::~PluginManifest()
+{
+    save();
+}
+
+bool PluginManifest::keys(const QFileInfo &file, QStringList *keys) const
+{
+    Q_ASSERT(keys);
+    const QHash<QString, Entry>::const_iterator it = d.entries.find(file.absoluteFilePath());
+    if (it == d.entries.end() || it.value().modified != file.lastModified()
+        || it.value().size != file.size()) {
+        ++d.misses;
+        return false;
+    }
+    ++d.hits;
+    *keys = it.value().keys;
+    return true;
+}
+
+void PluginManifest::insert(const QFileInfo &file, const QStringList &keys)
+{
+    Entry &entry = d.entries[file.absoluteFilePath()];
+    entry.modified = file.lastModified();
+    entry.size = file.size();
+    entry.keys = keys;
+    d.dirty = true;
+}
+
+// drops entries for files that are gone
+void PluginManifest::prune(const QFileInfoList &files)
+{
+    QSet<QString> paths;
+    foreach(const QFileInfo &file, files)
+        paths.insert(file.absoluteFilePath());
+    QHash<QString, Entry>::iterator it = d.entries.begin();
+    while (it != d.entries.end()) {
+        if (paths.contains(it.key())) {
+            ++it;
+        } else {
+            it = d.entries.erase(it);
+            d.dirty = true;
+        }
+    }
+}
+
+bool PluginManifest::save()
+{
+    if (!d.dirty)
+        return true;
+    // written next to the old one and renamed over it so a crash can't
+    // leave a truncated manifest behind
+    const QString fileName = ::manifestFileName();
+    const QString temp = fileName + QLatin1String(".new");
+    QFile file(temp);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG(0) << "Can't open" << temp << "for writing";
+        return false;
+    }
+    QDataStream ds(&file);
+    ds << quint32(ManifestMagic) << quint32(ManifestVersion) << d.entries;
+    bool ok = (ds.status() == QDataStream::Ok) && file.flush();
+#ifdef Q_OS_UNIX
+    ok = ok && !::fsync(file.handle());
+    file.close();
+    ok = ok && !::rename(QFile::encodeName(temp).constData(), QFile::encodeName(fileName).constData());
+#else
+    file.close();
+    if (ok) {
+        QFile::remove(fileName);
+        ok = QFile::rename(temp, fileName);
+    }
+#endif
+    if (!ok) {
+        LOG(0) << "Can't write" << fileName;
+        QFile::remove(temp);
+        return false;
+    }
+    d.dirty = false;
+    return true;
+}
@@ -0,0 +1,64 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef PLUGINMANIFEST_H
+#define PLUGINMANIFEST_H
+
+#include <QtCore>
+
+/* Remembers the keys of every file in the plugin directory so tail only
+   has to load the plugins it is going to use. Entries are keyed by path
+   and invalidated when the file's mtime or size changes. Files that
+   aren't plugins are remembered with no keys. */
+
+class PluginManifest
+{
+public:
+    PluginManifest();
+    ~PluginManifest();
+    bool keys(const QFileInfo &file, QStringList *keys) const; // false if unknown or stale
+    void insert(const QFileInfo &file, const QStringList &keys);
+    void prune(const QFileInfoList &files);
+    bool save();
+    int hits() const { return d.hits; }
+    int misses() const { return d.misses; }
+
+    struct Entry {
+        Entry() : size(0) {}
+        QDateTime modified; // streamed with ms resolution
+        qint64 size;
+        QStringList keys;
+    };
+private:
+    struct Data {
+        QHash<QString, Entry> entries;
+        bool dirty;
+        mutable int hits, misses;
+    } d;
+};
+
+#endif
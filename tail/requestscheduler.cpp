@@ -0,0 +1,247 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+
+#include "requestscheduler.h"
+#include "config.h"
+#include "log.h"
+
+enum { ProbeInterval = 50 }; // ms
+
+static const char *const laneNames[] = { "interactive", "metadata", "background" };
+
+class BulkRunner : public QRunnable
+{
+public:
+    BulkRunner(RequestScheduler *s) : scheduler(s) {}
+    virtual void run()
+    {
+        RequestScheduler::Job job;
+        while (scheduler->takeNext(&job)) {
+            const qint64 waitNs = job.queued.nsecsElapsed();
+            QElapsedTimer timer;
+            timer.start();
+            if (job.receiver) {
+                QMetaObject::invokeMethod(job.receiver, job.member.constData(), Qt::QueuedConnection,
+                                          Q_ARG(QVariant, job.request->run()));
+            } else {
+                QDBusMessage reply = job.message.createReply();
+                reply << job.request->run();
+                QDBusConnection::sessionBus().send(reply);
+            }
+            delete job.request;
+            scheduler->finished(job.priority, waitNs, timer.nsecsElapsed());
+        }
+    }
+private:
+    RequestScheduler *scheduler;
+};
+
+RequestScheduler::RequestScheduler(QObject *parent)
+    : QObject(parent)
+{
+    d.queued = d.maxQueued = d.running = d.runningBackground = 0;
+    d.threads = qMax(1, Config::value<int>("bulkthreads", 2));
+    d.quota = qMax(1, Config::value<int>("bulkquota", 512));
+    d.served = d.rejected = d.waitNs = d.maxWaitNs = d.serviceNs = 0;
+    d.probes = d.lagNs = d.maxLagNs = 0;
+    d.pool.setMaxThreadCount(d.threads);
+    d.probeTimer.setInterval(ProbeInterval);
+    connect(&d.probeTimer, SIGNAL(timeout()), this, SLOT(probe()));
+}
+
+RequestScheduler::~RequestScheduler()
+{
+    {
+        QMutexLocker locker(&d.mutex);
+        for (int i=0; i<PriorityCount; ++i) {
+            Lane &lane = d.lanes[i];
+            for (QHash<QString, QQueue<Job> >::const_iterator it = lane.queues.begin(); it != lane.queues.end(); ++it) {
+                foreach(const Job &job, it.value())
+                    delete job.request;
+            }
+            lane.queues.clear();
+            lane.clients.clear();
+            lane.queued = 0;
+        }
+        d.queued = 0;
+    }
+    d.pool.waitForDone();
+}
+
+void RequestScheduler::schedule(const QDBusMessage &message, BulkRequest *request, Priority priority)
+{
+    Q_ASSERT(priority >= 0 && priority < PriorityCount);
+    const QString client = message.service();
+    QMutexLocker locker(&d.mutex);
+    const QHash<QString, QQueue<Job> >::const_iterator it = d.lanes[priority].queues.find(client);
+    if (it != d.lanes[priority].queues.end() && it.value().size() >= d.quota) {
+        ++d.rejected;
+        locker.unlock();
+        LOG(5) << "rejecting" << message.member() << "from" << client << "over quota";
+        QDBusConnection::sessionBus().send(message.createErrorReply(QDBusError::LimitsExceeded,
+                                                                    "Too many queued requests"));
+        delete request;
+        return;
+    }
+    Job job;
+    job.request = request;
+    job.message = message;
+    job.priority = priority;
+    job.queued.start();
+    enqueue(client, job);
+}
+
+void RequestScheduler::schedule(QObject *receiver, const char *member, BulkRequest *request,
+                                Priority priority)
+{
+    Q_ASSERT(receiver && member);
+    Q_ASSERT(priority >= 0 && priority < PriorityCount);
+    Job job;
+    job.request = request;
+    job.receiver = receiver;
+    job.member = member;
+    job.priority = priority;
+    job.queued.start();
+    QMutexLocker locker(&d.mutex);
+    enqueue(QString(), job); // no D-Bus client has an empty name
+}
+
+// called with the mutex held
+void RequestScheduler::enqueue(const QString &client, const Job &job)
+{
+    Lane &lane = d.lanes[job.priority];
+    QQueue<Job> &queue = lane.queues[client];
+    if (queue.isEmpty())
+        lane.clients.append(client);
+    queue.enqueue(job);
+    ++lane.queued;
+    d.maxQueued = qMax(d.maxQueued, ++d.queued);
+    if (d.running < d.threads) {
+        ++d.running;
+        d.pool.start(new BulkRunner(this));
+    }
+    if (!d.probeTimer.isActive()) {
+        d.lastProbe.start();
+        d.probeTimer.start();
+    }
+}
+
+// Runners keep going until the queues are empty, decrementing running
+// under the same lock schedule() checks it with so no job is stranded.
+// Background work is capped at threads - 1 runners (but always gets one);
+// a runner that only finds capped background work exits, the busy
+// background runners pick it up when they're done.
+bool RequestScheduler::takeNext(Job *job)
+{
+    QMutexLocker locker(&d.mutex);
+    const int maxBackground = qMax(1, d.threads - 1);
+    for (int i=0; i<PriorityCount; ++i) {
+        Lane &lane = d.lanes[i];
+        if (lane.clients.isEmpty())
+            continue;
+        if (i == Background && d.runningBackground >= maxBackground)
+            break;
+        const QString client = lane.clients.takeFirst();
+        QHash<QString, QQueue<Job> >::iterator it = lane.queues.find(client);
+        Q_ASSERT(it != lane.queues.end() && !it.value().isEmpty());
+        *job = it.value().dequeue();
+        if (it.value().isEmpty()) {
+            lane.queues.erase(it);
+        } else {
+            lane.clients.append(client);
+        }
+        --lane.queued;
+        --d.queued;
+        if (i == Background)
+            ++d.runningBackground;
+        return true;
+    }
+    --d.running;
+    return false;
+}
+
+void RequestScheduler::finished(Priority priority, qint64 waitNs, qint64 serviceNs)
+{
+    QMutexLocker locker(&d.mutex);
+    if (priority == Background)
+        --d.runningBackground;
+    Lane &lane = d.lanes[priority];
+    ++lane.served;
+    lane.waitNs += waitNs;
+    lane.maxWaitNs = qMax(lane.maxWaitNs, waitNs);
+    ++d.served;
+    d.waitNs += waitNs;
+    d.maxWaitNs = qMax(d.maxWaitNs, waitNs);
+    d.serviceNs += serviceNs;
+}
+
+// Measures how late the main thread gets to a timer while bulk work is
+// outstanding, which is what a control call would have waited
+void RequestScheduler::probe()
+{
+    const qint64 lag = qMax<qint64>(0, d.lastProbe.nsecsElapsed() - qint64(ProbeInterval) * 1000000);
+    d.lastProbe.restart();
+    QMutexLocker locker(&d.mutex);
+    ++d.probes;
+    d.lagNs += lag;
+    d.maxLagNs = qMax(d.maxLagNs, lag);
+    if (!d.queued && !d.running)
+        d.probeTimer.stop();
+}
+
+QVariantMap RequestScheduler::statistics() const
+{
+    QMutexLocker locker(&d.mutex);
+    QVariantMap ret;
+    ret["bulkThreads"] = d.threads;
+    ret["bulkQuota"] = d.quota;
+    ret["bulkQueued"] = d.queued;
+    ret["bulkMaxQueued"] = d.maxQueued;
+    ret["bulkRunning"] = d.running;
+    ret["bulkRunningBackground"] = d.runningBackground;
+    int clients = 0;
+    for (int i=0; i<PriorityCount; ++i) {
+        const Lane &lane = d.lanes[i];
+        const QString name = QLatin1String(laneNames[i]);
+        clients += lane.clients.size();
+        ret[name + "Queued"] = lane.queued;
+        ret[name + "Served"] = lane.served;
+        ret[name + "AverageWaitMs"] = lane.served ? double(lane.waitNs) / lane.served / 1000000.0 : 0.0;
+        ret[name + "MaxWaitMs"] = double(lane.maxWaitNs) / 1000000.0;
+    }
+    ret["bulkClients"] = clients;
+    ret["bulkServed"] = d.served;
+    ret["bulkRejected"] = d.rejected;
+    ret["bulkAverageWaitMs"] = d.served ? double(d.waitNs) / d.served / 1000000.0 : 0.0;
+    ret["bulkMaxWaitMs"] = double(d.maxWaitNs) / 1000000.0;
+    ret["bulkAverageServiceMs"] = d.served ? double(d.serviceNs) / d.served / 1000000.0 : 0.0;
+    ret["controlProbes"] = d.probes;
+    ret["controlAverageLagMs"] = d.probes ? double(d.lagNs) / d.probes / 1000000.0 : 0.0;
+    ret["controlMaxLagMs"] = double(d.maxLagNs) / 1000000.0;
+    return ret;
+}
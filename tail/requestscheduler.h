@@ -0,0 +1,107 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+
+#ifndef REQUESTSCHEDULER_H
+#define REQUESTSCHEDULER_H
+
+#include <QtCore>
+#include <QtDBus>
+
+/* A unit of bulk work, run on a worker thread. Must not touch Tail */
+class BulkRequest
+{
+public:
+    virtual ~BulkRequest() {}
+    virtual QVariant run() = 0;
+};
+
+/* D-Bus calls that parse tags are answered from a small thread pool so
+   control and state calls, which stay on the main thread, aren't queued
+   behind them. Work is split in lanes: Interactive (a single track a client
+   is showing right now), Metadata (batches for filling a view) and
+   Background (tail's own snapshot fills and diagnostics like tags()). A
+   runner always takes from the most urgent non-empty lane and Background
+   never occupies the last thread, so a lookup doesn't wait for a scan.
+   Within a lane callers are served round robin and each may have at most
+   "bulkquota" requests queued. */
+class RequestScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    enum Priority {
+        Interactive,
+        Metadata,
+        Background,
+        PriorityCount
+    };
+    RequestScheduler(QObject *parent = 0);
+    ~RequestScheduler();
+    // takes ownership of request, the reply is sent from the worker
+    void schedule(const QDBusMessage &message, BulkRequest *request, Priority priority);
+    // for tail's own bulk work, member is invoked with the result as a
+    // QVariant through a queued call. Not subject to the quota.
+    void schedule(QObject *receiver, const char *member, BulkRequest *request,
+                  Priority priority = Background);
+    QVariantMap statistics() const;
+private slots:
+    void probe();
+private:
+    struct Job {
+        Job() : request(0), receiver(0), priority(Background) {}
+        BulkRequest *request;
+        QDBusMessage message;
+        QObject *receiver;
+        QByteArray member;
+        Priority priority;
+        QElapsedTimer queued;
+    };
+    struct Lane {
+        Lane() : queued(0), served(0), waitNs(0), maxWaitNs(0) {}
+        QHash<QString, QQueue<Job> > queues; // by sender
+        QList<QString> clients; // the ones with queued jobs, in serving order
+        int queued;
+        qint64 served, waitNs, maxWaitNs;
+    };
+    void enqueue(const QString &client, const Job &job);
+    bool takeNext(Job *job);
+    void finished(Priority priority, qint64 waitNs, qint64 serviceNs);
+    friend class BulkRunner;
+
+    struct Data {
+        mutable QMutex mutex;
+        Lane lanes[PriorityCount];
+        int queued, maxQueued, running, runningBackground, threads, quota;
+        qint64 served, rejected, waitNs, maxWaitNs, serviceNs;
+        QThreadPool pool;
+        QTimer probeTimer;
+        QElapsedTimer lastProbe;
+        qint64 probes, lagNs, maxLagNs;
+    } d;
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <QtCore>
+
+/* Single producer, single consumer lock free ring buffer. One thread may
+   write() while another read()s, no locking is needed. reset() is only
+   safe while neither side is running. */
+
+template <typename T>
+class RingBuffer
+{
+public:
+    RingBuffer(int capacity = 0)
+    {
+        setCapacity(capacity);
+    }
+
+    void setCapacity(int capacity)
+    {
+        int size = 1;
+        while (size < capacity)
+            size <<= 1;
+        buffer.resize(size);
+        mask = size - 1;
+        reset();
+    }
+
+    int capacity() const { return buffer.size(); }
+    const T *constData() const { return buffer.constData(); } // e.g. for mlock()
+
+    void reset()
+    {
+        readPos.fetchAndStoreOrdered(0);
+        writePos.fetchAndStoreOrdered(0);
+    }
+
+    // number of items the consumer can read
+    int available() const
+    {
+        return int(quint32(load(writePos)) - quint32(load(readPos)));
+    }
+
+    // number of items the producer can write
+    int space() const
+    {
+        return buffer.size() - available();
+    }
+
+    int write(const T *data, int count)
+    {
+        const quint32 w = load(writePos);
+        const quint32 r = load(readPos);
+        count = qMin<int>(count, buffer.size() - int(w - r));
+        T *storage = buffer.data();
+        for (int i=0; i<count; ++i)
+            storage[(w + i) & mask] = data[i];
+        writePos.fetchAndStoreRelease(int(w + count)); // publish after the data
+        return count;
+    }
+
+    int read(T *data, int count)
+    {
+        const quint32 r = load(readPos);
+        const quint32 w = load(writePos);
+        count = qMin<int>(count, int(w - r));
+        const T *storage = buffer.constData();
+        for (int i=0; i<count; ++i)
+            data[i] = storage[(r + i) & mask];
+        readPos.fetchAndStoreRelease(int(r + count)); // hand the space back after reading
+        return count;
+    }
+private:
+    static inline quint32 load(const QAtomicInt &value)
+    {
+        return quint32(const_cast<QAtomicInt&>(value).fetchAndAddAcquire(0));
+    }
+
+    QVector<T> buffer;
+    quint32 mask;
+    QAtomicInt readPos, writePos;
+};
+
+#endif
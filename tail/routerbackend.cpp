@@ -0,0 +1,321 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "routerbackend.h"
+#include <config.h>
+#include <log.h>
+
+static inline QString extension(const QUrl &url)
+{
+    return QFileInfo(url.path()).suffix().toLower();
+}
+
+RouterBackend::RouterBackend(const QList<Backend*> &backends, QObject *tail)
+    : Backend("RouterBackend", tail)
+{
+    Q_ASSERT(!backends.isEmpty());
+    d.backends = backends;
+    d.active = 0;
+    d.switches = d.fallbacks = 0;
+    d.gain = 0.0;
+    d.costs.resize(backends.size());
+}
+
+RouterBackend::~RouterBackend()
+{
+    qDeleteAll(d.backends);
+}
+
+bool RouterBackend::initBackend()
+{
+    // backends that can't initialize are dropped, we only fail if none can
+    for (int i=d.backends.size() - 1; i>=0; --i) {
+        Backend *backend = d.backends.at(i);
+        if (!backend->initBackend()) {
+            LOG(0) << "Can't initialize" << backend->name() << backend->errorMessage();
+            if (d.backends.size() == 1)
+                return false;
+            delete d.backends.takeAt(i);
+            d.costs.remove(i);
+        }
+    }
+    d.active = 0;
+    return true;
+}
+
+void RouterBackend::shutdown()
+{
+    foreach(Backend *backend, d.backends)
+        backend->shutdown();
+}
+
+// Indexes of the backends to try for url, most likely first
+QList<int> RouterBackend::candidates(const QUrl &url) const
+{
+    QList<int> ret;
+    const QString ext = ::extension(url);
+    if (!ext.isEmpty()) {
+        QMutexLocker lock(&d.mutex);
+        QHash<QString, int>::iterator it = d.routes.find(ext);
+        if (it == d.routes.end()) {
+            const QString forced = Config::value<QString>("Routes/" + ext);
+            int index = -1;
+            if (!forced.isEmpty()) {
+                for (int i=0; i<d.backends.size() && index == -1; ++i) {
+                    if (d.backends.at(i)->name().startsWith(forced, Qt::CaseInsensitive))
+                        index = i;
+                }
+                if (index == -1)
+                    LOG(1) << "No backend named" << forced << "for" << ext;
+            }
+            it = d.routes.insert(ext, index);
+        }
+        if (it.value() != -1)
+            ret.append(it.value());
+    }
+    for (int i=0; i<d.backends.size(); ++i) {
+        if (!ret.contains(i))
+            ret.append(i);
+    }
+    return ret;
+}
+
+void RouterBackend::learn(const QUrl &url, int index) const
+{
+    const QString ext = ::extension(url);
+    if (ext.isEmpty())
+        return;
+    QMutexLocker lock(&d.mutex);
+    const QHash<QString, int>::const_iterator it = d.routes.find(ext);
+    if (it == d.routes.end() || it.value() == -1) {
+        d.routes[ext] = index;
+        LOG(10) << "Routing" << ext << "to" << d.backends.at(index)->name();
+    }
+}
+
+// The volume, mute and equalizer settings are sent to all backends as they
+// change so there's nothing to carry over here.
+void RouterBackend::activate(int index)
+{
+    if (index == d.active)
+        return;
+    Backend *old = active();
+    if (old->status() == Playing || old->status() == Paused)
+        old->stop();
+    d.active = index;
+    ++d.switches;
+    active()->setGain(d.gain);
+    LOG(10) << "Switched from" << old->name() << "to" << active()->name();
+}
+
+bool RouterBackend::trackData(TrackData *data, const QUrl &url, int types) const
+{
+    foreach(int i, candidates(url)) {
+        if (d.backends.at(i)->trackData(data, url, types))
+            return true;
+    }
+    return false;
+}
+
+bool RouterBackend::isValid(const QUrl &url) const
+{
+    foreach(int i, candidates(url)) {
+        if (d.backends.at(i)->isValid(url)) {
+            learn(url, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RouterBackend::loadUrl(const QUrl &url)
+{
+    const QList<int> list = candidates(url);
+    for (int i=0; i<list.size(); ++i) {
+        const int index = list.at(i);
+        Backend *backend = d.backends.at(index);
+        if (index != d.active && !backend->isValid(url))
+            continue;
+        if (index != d.active)
+            active()->stop(); // don't leave the old track playing while the new one loads
+        QTime timer;
+        timer.start();
+        const bool ok = backend->loadUrl(url);
+        {
+            QMutexLocker lock(&d.mutex);
+            Cost &cost = d.costs[index];
+            ++cost.loads;
+            cost.loadMs += timer.elapsed();
+        }
+        if (ok) {
+            if (i > 0)
+                ++d.fallbacks;
+            learn(url, index);
+            activate(index);
+            return true;
+        }
+    }
+    return false;
+}
+
+void RouterBackend::play()
+{
+    active()->play();
+}
+
+void RouterBackend::pause()
+{
+    active()->pause();
+}
+
+void RouterBackend::stop()
+{
+    active()->stop();
+}
+
+void RouterBackend::setProgress(int type, int progress)
+{
+    active()->setProgress(type, progress);
+}
+
+int RouterBackend::progress(int type)
+{
+    return active()->progress(type);
+}
+
+int RouterBackend::status() const
+{
+    return active()->status();
+}
+
+int RouterBackend::volume() const
+{
+    return active()->volume();
+}
+
+void RouterBackend::setVolume(int vol)
+{
+    foreach(Backend *backend, d.backends)
+        backend->setVolume(vol);
+}
+
+void RouterBackend::setMute(bool on)
+{
+    foreach(Backend *backend, d.backends)
+        backend->setMute(on);
+}
+
+bool RouterBackend::isMute() const
+{
+    return active()->isMute();
+}
+
+void RouterBackend::setGain(double gain)
+{
+    d.gain = gain;
+    active()->setGain(gain);
+}
+
+QString RouterBackend::errorMessage() const
+{
+    return active()->errorMessage();
+}
+
+int RouterBackend::errorCode() const
+{
+    return active()->errorCode();
+}
+
+int RouterBackend::capabilities() const
+{
+    return active()->capabilities();
+}
+
+QHash<int, int> RouterBackend::equalizerSettings() const
+{
+    return active()->equalizerSettings();
+}
+
+void RouterBackend::setEqualizerSettings(const QHash<int, int> &eq)
+{
+    foreach(Backend *backend, d.backends) {
+        if (backend->capabilities() & SupportsEqualizer)
+            backend->setEqualizerSettings(eq);
+    }
+}
+
+bool RouterBackend::decode(const QUrl &url, AudioSink *sink) const
+{
+    // no isValid() here, it isn't reentrant for every backend
+    foreach(int i, candidates(url)) {
+        QTime timer;
+        timer.start();
+        const bool ok = d.backends.at(i)->decode(url, sink);
+        if (ok) {
+            QMutexLocker lock(&d.mutex);
+            Cost &cost = d.costs[i];
+            ++cost.decodes;
+            cost.decodeMs += timer.elapsed();
+            return true;
+        }
+    }
+    return false;
+}
+
+QVariantMap RouterBackend::statistics() const
+{
+    QVariantMap ret;
+    ret.insert("active", active()->name());
+    ret.insert("switches", d.switches);
+    ret.insert("fallbacks", d.fallbacks);
+    QMutexLocker lock(&d.mutex);
+    for (QHash<QString, int>::const_iterator it = d.routes.begin(); it != d.routes.end(); ++it) {
+        if (it.value() != -1)
+            ret.insert("route/" + it.key(), d.backends.at(it.value())->name());
+    }
+    for (int i=0; i<d.backends.size(); ++i) {
+        const Backend *backend = d.backends.at(i);
+        const QString prefix = backend->name() + '/';
+        const Cost &cost = d.costs.at(i);
+        ret.insert(prefix + "loads", cost.loads);
+        ret.insert(prefix + "loadMs", cost.loadMs);
+        ret.insert(prefix + "decodes", cost.decodes);
+        ret.insert(prefix + "decodeMs", cost.decodeMs);
+        const QVariantMap stats = backend->statistics();
+        for (QVariantMap::const_iterator it = stats.begin(); it != stats.end(); ++it)
+            ret.insert(prefix + it.key(), it.value());
+    }
+    return ret;
+}
+
+// the routed backends talk to Tail directly
+void RouterBackend::retire()
+{
+    Backend::retire();
+    foreach(Backend *backend, d.backends)
+        backend->retire();
+}
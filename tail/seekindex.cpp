@@ -0,0 +1,247 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include "seekindex.h"
+#include <global.h>
+#include <config.h>
+#include <log.h>
+#ifdef Q_OS_UNIX
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+enum { CacheMagic = 0x70eb1dec, CacheVersion = 2 };
+
+struct FrameHeader {
+    int size; // bytes
+    int samples;
+    int sampleRate;
+    int sideInfo; // bytes of layer III side information after the header
+};
+
+static inline int id3v2Size(const uchar *data, qint64 size)
+{
+    if (size < 10 || data[0] != 'I' || data[1] != 'D' || data[2] != '3')
+        return 0;
+    // syncsafe integer, 7 bits per byte
+    int ret = ((data[6] & 0x7f) << 21) | ((data[7] & 0x7f) << 14) | ((data[8] & 0x7f) << 7) | (data[9] & 0x7f);
+    ret += 10;
+    if (data[5] & 0x10) // footer present
+        ret += 10;
+    return ret;
+}
+
+static inline bool parseHeader(const uchar *data, FrameHeader *header)
+{
+    if (data[0] != 0xff || (data[1] & 0xe0) != 0xe0)
+        return false;
+    const int version = (data[1] >> 3) & 0x3; // 0: 2.5, 2: 2, 3: 1
+    const int layer = (data[1] >> 1) & 0x3; // 1: III, 2: II, 3: I
+    const int bitrateIndex = (data[2] >> 4) & 0xf;
+    const int sampleRateIndex = (data[2] >> 2) & 0x3;
+    const int padding = (data[2] >> 1) & 0x1;
+    const bool mono = ((data[3] >> 6) & 0x3) == 3;
+    if (version == 1 || layer == 0 || bitrateIndex == 0 || bitrateIndex == 15 || sampleRateIndex == 3)
+        return false;
+
+    static const int bitrates[2][3][15] = {
+        { // MPEG 1
+            { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+            { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+            { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+        }, { // MPEG 2 and 2.5
+            { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+            { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+            { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+        }
+    };
+    static const int sampleRates[3] = { 44100, 48000, 32000 };
+
+    const bool mpeg1 = (version == 3);
+    const int layerIndex = 3 - layer; // 0: I, 1: II, 2: III
+    header->sideInfo = (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+    const int bitrate = bitrates[mpeg1 ? 0 : 1][layerIndex][bitrateIndex] * 1000;
+    header->sampleRate = sampleRates[sampleRateIndex] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+    switch (layerIndex) {
+    case 0:
+        header->samples = 384;
+        header->size = (12 * bitrate / header->sampleRate + padding) * 4;
+        break;
+    case 1:
+        header->samples = 1152;
+        header->size = 144 * bitrate / header->sampleRate + padding;
+        break;
+    default:
+        header->samples = mpeg1 ? 1152 : 576;
+        header->size = (mpeg1 ? 144 : 72) * bitrate / header->sampleRate + padding;
+        break;
+    }
+    return header->size > 4;
+}
+
+// The Xing/Info (LAME) or VBRI frame at the start of a VBR file carries
+// no audio, counting it would put every seek one frame late
+static inline bool isInfoFrame(const uchar *data, qint64 available, const FrameHeader &header)
+{
+    const int xing = 4 + header.sideInfo;
+    if (available >= xing + 4 && (!memcmp(data + xing, "Xing", 4) || !memcmp(data + xing, "Info", 4)))
+        return true;
+    return available >= 36 + 4 && !memcmp(data + 36, "VBRI", 4);
+}
+
+static inline QString cacheFileName(const QString &path)
+{
+    static const QString dir = ::cacheDirectory("seekindex");
+    return QString("%1/%2").arg(dir).
+        arg(QString::fromLatin1(QCryptographicHash::hash(path.toUtf8(), QCryptographicHash::Md5).toHex()));
+}
+
+bool SeekIndex::canIndex(const QString &path)
+{
+    const QString suffix = QFileInfo(path).suffix().toLower();
+    return suffix == "mp3" || suffix == "mp2" || suffix == "mpga";
+}
+
+SeekIndex SeekIndex::index(const QString &path)
+{
+    SeekIndex ret;
+    const QFileInfo fi(path);
+    if (!fi.isFile())
+        return ret;
+    const QString cacheFile = ::cacheFileName(fi.absoluteFilePath());
+    if (ret.load(cacheFile, fi))
+        return ret;
+
+    QTime timer;
+    timer.start();
+    if (ret.build(fi.absoluteFilePath())) {
+        LOG(10) << "built seek index for" << path << ret.offsets.size() << "entries in" << timer.elapsed() << "ms";
+        ret.save(cacheFile, fi);
+    }
+    return ret;
+}
+
+qint64 SeekIndex::offset(int msec) const
+{
+    if (isNull())
+        return -1;
+    const int idx = qBound(0, msec / interval, offsets.size() - 1);
+    return offsets.at(idx);
+}
+
+bool SeekIndex::build(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    const qint64 size = file.size();
+    const uchar *data = file.map(0, size);
+    if (!data)
+        return false;
+
+    interval = qMax(10, Config::value<int>("seekindexinterval", 500));
+    fileSize = size;
+    offsets.clear();
+
+    qint64 pos = ::id3v2Size(data, size);
+    qint64 samples = 0;
+    int sampleRate = 0;
+    FrameHeader header;
+    while (pos + 4 <= size) {
+        if (!::parseHeader(data + pos, &header)) {
+            ++pos; // resync
+            continue;
+        }
+        if (!sampleRate) {
+            sampleRate = header.sampleRate;
+            if (::isInfoFrame(data + pos, qMin<qint64>(header.size, size - pos), header)) {
+                pos += header.size;
+                continue;
+            }
+        }
+        const qint64 msec = samples * 1000 / sampleRate;
+        while (msec >= qint64(offsets.size()) * interval)
+            offsets.append(quint64(pos));
+        samples += header.samples;
+        pos += header.size;
+    }
+    file.unmap(const_cast<uchar*>(data));
+    duration = sampleRate ? int(samples * 1000 / sampleRate) : 0;
+    return !offsets.isEmpty();
+}
+
+bool SeekIndex::load(const QString &cacheFile, const QFileInfo &fi)
+{
+    QFile file(cacheFile);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream ds(&file);
+    quint32 magic, version;
+    QString path;
+    QDateTime modified;
+    ds >> magic >> version;
+    if (magic != CacheMagic || version != CacheVersion)
+        return false;
+    ds >> path >> modified >> fileSize;
+    if (path != fi.absoluteFilePath() || modified != fi.lastModified() || fileSize != fi.size())
+        return false;
+    ds >> interval >> duration >> offsets;
+    return ds.status() == QDataStream::Ok && interval > 0;
+}
+
+// Written next to the cache file and renamed over it so a crash can't
+// leave a truncated index behind
+bool SeekIndex::save(const QString &cacheFile, const QFileInfo &fi) const
+{
+    const QString temp = cacheFile + QLatin1String(".new");
+    QFile file(temp);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG(1) << "Can't open" << temp << "for writing";
+        return false;
+    }
+    QDataStream ds(&file);
+    ds << quint32(CacheMagic) << quint32(CacheVersion)
+       << fi.absoluteFilePath() << fi.lastModified() << fileSize
+       << interval << duration << offsets;
+    bool ok = (ds.status() == QDataStream::Ok) && file.flush();
+#ifdef Q_OS_UNIX
+    ok = ok && !::fsync(file.handle());
+    file.close();
+    ok = ok && !::rename(QFile::encodeName(temp).constData(), QFile::encodeName(cacheFile).constData());
+#else
+    file.close();
+    if (ok) {
+        QFile::remove(cacheFile);
+        ok = QFile::rename(temp, cacheFile);
+    }
+#endif
+    if (!ok) {
+        LOG(1) << "Can't write" << cacheFile;
+        QFile::remove(temp);
+    }
+    return ok;
+}
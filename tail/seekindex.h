@@ -0,0 +1,60 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#ifndef SEEKINDEX_H
+#define SEEKINDEX_H
+
+#include <QtCore>
+
+/* Maps playback time to byte offsets for MPEG audio files. VBR files
+   without a Xing/VBRI TOC can't be seeked accurately by time so we scan
+   the frame headers once and remember where every interval starts. */
+
+class SeekIndex
+{
+public:
+    SeekIndex() : interval(0), fileSize(0), duration(0) {}
+
+    bool isNull() const { return offsets.isEmpty(); }
+    int length() const { return duration; } // milliseconds
+    qint64 size() const { return fileSize; }
+    qint64 offset(int msec) const;
+
+    static bool canIndex(const QString &path);
+    static SeekIndex index(const QString &path);
+private:
+    bool build(const QString &path);
+    bool load(const QString &cacheFile, const QFileInfo &fi);
+    bool save(const QString &cacheFile, const QFileInfo &fi) const;
+
+    int interval; // milliseconds between entries
+    qint64 fileSize;
+    int duration;
+    QVector<quint64> offsets;
+};
+
+#endif
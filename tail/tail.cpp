@@ -30,15 +30,137 @@
 #include <config.h>
 #include "taginterface.h"
 #include "id3taginterface.h"
+#include "loudness.h"
+#include "pluginloader.h"
+#include "playlistsnapshot.h"
+#include "controlserver.h"
+#include "requestscheduler.h"
+#include <limits.h>
+#include <math.h>
 #ifdef Q_OS_UNIX
 #include <signal.h>
 #endif
 
-struct FunctionNode
+static Log::Category tagLog("tags");
+
+// Tag parsing shared by the main thread and the bulk workers, which is
+// why it only sees the tag interfaces and not Tail
+static TrackData readTrackData(const QList<TagInterface*> &tagInterfaces, const QUrl &url, int index, int fields)
 {
-    ~FunctionNode() { qDeleteAll(nodes); }
-    QHash<QChar, FunctionNode*> nodes;
-    Function function;
+    LOG_CATEGORY(tagLog, 50) << "requsting trackdata for song" << index << "fields"
+                             << ::trackInfosToStringList(fields).join("|") << url;
+    TrackData data;
+    if (fields & URL) {
+        data.url = url;
+    }
+    if (fields & PlaylistIndex) {
+        data.playlistIndex = index;
+    }
+
+    enum { BackendTypes = Title|TrackLength|Artist|Year|Genre|AlbumIndex };
+    uint backendTypes = fields & BackendTypes;
+    if (backendTypes) {
+        foreach(const TagInterface *tag, tagInterfaces) {
+            uint handled = tag->trackData(&data, url, backendTypes);
+            backendTypes &= ~handled;
+            if (!backendTypes)
+                break;
+        }
+    }
+    data.fields |= fields; // ### should this only be the types we actually found?
+    return data;
+}
+
+class TrackDataRequest : public BulkRequest
+{
+public:
+    TrackDataRequest(const QList<TagInterface*> &tags, int from, int fields, bool batch)
+        : tagInterfaces(tags), from(from), fields(fields), batch(batch)
+    {}
+    virtual QVariant run()
+    {
+        if (!batch)
+            return qVariantFromValue(::readTrackData(tagInterfaces, urls.value(0), from, fields));
+        TrackDataList ret;
+        for (int i=0; i<urls.size(); ++i)
+            ret.append(::readTrackData(tagInterfaces, urls.at(i), from + i, fields));
+        return qVariantFromValue(ret);
+    }
+
+    const QList<TagInterface*> tagInterfaces;
+    QList<QUrl> urls;
+    const int from, fields;
+    const bool batch;
+};
+
+// Fills in the snapshot rows publishSnapshot() didn't have cached
+class SnapshotRowsRequest : public BulkRequest
+{
+public:
+    SnapshotRowsRequest(const QList<TagInterface*> &tags)
+        : tagInterfaces(tags)
+    {}
+    virtual QVariant run()
+    {
+        TrackDataList ret;
+        for (int i=0; i<urls.size(); ++i)
+            ret.append(::readTrackData(tagInterfaces, urls.at(i), rows.at(i), All));
+        return qVariantFromValue(ret);
+    }
+
+    const QList<TagInterface*> tagInterfaces;
+    QList<QUrl> urls;
+    QList<int> rows; // where they were when the request was made
+};
+
+static QStringList formatTags(const QList<TagInterface*> &tagInterfaces, const QUrl &url, int index)
+{
+    const TrackData data = ::readTrackData(tagInterfaces, url, index, All);
+    QStringList list;
+    const TrackInfo *info = ::trackInfos;
+    while (*info != None) {
+        const QVariant var = data.data(*info);
+        if (!var.isNull()) {
+            list.append(QString("%1: \"%2\"").arg(::trackInfoToString(*info)).arg(
+                            (*info == URL ? data.url.toString() : var.toString())));
+        }
+        ++info;
+    }
+    return list;
+}
+
+// tags() is a debugging aid, it shouldn't hold up anyone's track lookups
+class TagsRequest : public BulkRequest
+{
+public:
+    TagsRequest(const QList<TagInterface*> &tags, const QUrl &url, int index)
+        : tagInterfaces(tags), url(url), index(index)
+    {}
+    virtual QVariant run()
+    {
+        return ::formatTags(tagInterfaces, url, index);
+    }
+
+    const QList<TagInterface*> tagInterfaces;
+    const QUrl url;
+    const int index;
+};
+
+// Every name findFunction() accepts, the methods' own names, their
+// translations and aliases, sorted so the names with a given prefix are
+// next to each other
+struct FunctionTable
+{
+    struct Entry {
+        QString key; // lowercase
+        QString name;
+        int function; // index into functions
+        bool operator<(const Entry &other) const { return key < other.key; }
+    };
+    void range(const QString &prefix, int *from, int *to) const;
+
+    QVector<Function> functions; // by name
+    QVector<Entry> entries;
 };
 
 static inline void fixCurrent(int *current, int size)
@@ -54,6 +176,8 @@ Tail::Tail(QObject *parent)
     : QObject(parent)
 {
     d.tagInterfaces.append(new ID3TagInterface);
+    d.scheduler = new RequestScheduler(this);
+    d.cache.setMaxCost(qMax(1, Config::value<int>("trackcache", 10000)));
     QString playlistPath = Config::value<QString>("playlist");
     if (!playlistPath.isEmpty() && QFile::exists(playlistPath)) {
         d.playlist.setFileName(playlistPath);
@@ -69,6 +193,8 @@ Tail::Tail(QObject *parent)
     }
     d.current = Config::value<int>("current");
     ::fixCurrent(&d.current, d.tracks.size());
+    d.changeTimer.setSingleShot(true);
+    connect(&d.changeTimer, SIGNAL(timeout()), this, SLOT(flushChanges()));
 #ifdef Q_OS_UNIX
 //    QCoreApplication::watchUnixSignal(SIGINT, true); // doesn't seem to work
     connect(QCoreApplication::instance(), SIGNAL(unixSignal(int)), this, SLOT(onUnixSignal(int)));
@@ -78,22 +204,684 @@ Tail::Tail(QObject *parent)
 bool Tail::setBackend(Backend *backend)
 {
     Q_ASSERT(backend);
-    if (!backend->initBackend())
+    BackendThread *thread = new BackendThread(backend, this);
+    thread->start();
+    if (!thread->call(BackendThread::Init).toBool()) {
+        delete thread;
         return false;
+    }
     d.backend = backend;
+    d.backendThread = thread;
+    connect(thread, SIGNAL(clockChanged(int, int, qint64)), this, SLOT(onClockChanged(int, int, qint64)));
+    d.loudnessCache = new LoudnessCache;
+    d.loudnessAnalyzer = new LoudnessAnalyzer(backend, d.loudnessCache, this);
+    return true;
+}
+
+
+// Loads, initializes and opens the current track on a new backend without
+// blocking tail, see Tail::setBackend(const QString &)
+class BackendLoadThread : public QThread
+{
+public:
+    BackendLoadThread(PluginLoader *l, const QStringList &n, const QUrl &u, QObject *t)
+        : QThread(t), loader(l), names(n), url(u), tail(t), backend(0), loaded(false)
+    {}
+
+    virtual void run()
+    {
+        backend = loader->load(names, tail);
+        if (!backend)
+            return;
+        if (!backend->initBackend()) {
+            LOG(0) << "Can't initialize" << backend->name() << backend->errorMessage();
+            delete backend;
+            backend = 0;
+            return;
+        }
+        loaded = !url.isEmpty() && backend->loadUrl(url);
+    }
+
+    PluginLoader *loader;
+    const QStringList names;
+    const QUrl url;
+    QObject *tail;
+    Backend *backend;
+    bool loaded;
+};
+
+// Shuts the old backend down once it's been replaced. Waits for loudness
+// analysis still decoding with it.
+class BackendRetireThread : public QThread
+{
+public:
+    BackendRetireThread(BackendThread *t, Backend *b, LoudnessAnalyzer *a, Backend *r, QObject *parent)
+        : QThread(parent), thread(t), backend(b), analyzer(a), replacement(r)
+    {}
+
+    virtual void run()
+    {
+        if (analyzer)
+            analyzer->setBackend(replacement);
+        thread->call(BackendThread::Shutdown);
+    }
+
+    BackendThread *thread;
+    Backend *backend;
+    LoudnessAnalyzer *analyzer;
+    Backend *replacement;
+};
+
+// Switches to another backend at runtime. The plugin is loaded and the
+// current track opened in the background, the actual swap only costs a
+// stop, a seek and a play. Playlist, caches and volume, mute and
+// equalizer settings are kept.
+bool Tail::setBackend(const QString &names)
+{
+    Q_ASSERT(d.backendThread);
+    if (!d.pluginLoader || d.backendLoader || d.backendRetirer) {
+        LOG(1) << "Can't switch backend now";
+        return false;
+    }
+    const QStringList list = names.split(QRegExp("[ ,]"), QString::SkipEmptyParts);
+    if (list.isEmpty())
+        return false;
+    d.backendLoader = new BackendLoadThread(d.pluginLoader, list, d.tracks.value(d.current), this);
+    connect(d.backendLoader, SIGNAL(finished()), this, SLOT(onBackendLoaded()));
+    d.backendLoader->start();
     return true;
 }
 
+void Tail::onBackendLoaded()
+{
+    BackendLoadThread *loader = d.backendLoader;
+    d.backendLoader = 0;
+    loader->wait();
+    Backend *backend = loader->backend;
+    const bool loaded = loader->loaded;
+    const QUrl loadedUrl = loader->url;
+    delete loader;
+    if (!backend) {
+        LOG(0) << "Can't switch backend";
+        return;
+    }
+
+    QTime timer;
+    timer.start();
+    BackendThread *old = d.backendThread;
+    BackendThread *thread = new BackendThread(backend, this);
+    connect(thread, SIGNAL(clockChanged(int, int, qint64)), this, SLOT(onClockChanged(int, int, qint64)));
+    thread->start();
+    thread->post(BackendThread::Init); // already done, refreshes the snapshot
+    thread->post(BackendThread::SetVolume, old->volume());
+    thread->post(BackendThread::SetMute, old->isMute());
+    if (backend->capabilities() & Backend::SupportsEqualizer)
+        thread->post(BackendThread::SetEqualizerSettings, qVariantFromValue<IntHash>(old->equalizerSettings()));
+    const QUrl url = d.tracks.value(d.current);
+    if (!url.isEmpty() && (!loaded || url != loadedUrl))
+        thread->post(BackendThread::LoadUrl, url);
+
+    // the gap starts here
+    const int status = old->status();
+    const int position = old->call(BackendThread::Progress, Backend::Milliseconds).toInt();
+    d.backend->retire(); // clients shouldn't see the old backend stop
+    old->call(BackendThread::Stop);
+
+    Backend *oldBackend = d.backend;
+    d.backend = backend;
+    d.backendThread = thread;
+    if (!url.isEmpty()) {
+        applyGain(url);
+        // a paused track is left stopped at the same position rather than
+        // played and paused again, which would be audible
+        if (position > 0)
+            thread->post(BackendThread::SetProgress, Backend::Milliseconds, position);
+        if (status == Backend::Playing)
+            thread->post(BackendThread::Play);
+        if (status == Backend::Paused)
+            emit statusChanged(Backend::Stopped);
+    }
+    LOG(1) << "Switched from" << oldBackend->name() << "to" << backend->name()
+           << "in" << timer.elapsed() << "ms";
+
+    old->setParent(0);
+    d.backendRetirer = new BackendRetireThread(old, oldBackend, d.loudnessAnalyzer, backend, this);
+    connect(d.backendRetirer, SIGNAL(finished()), this, SLOT(onBackendRetired()));
+    d.backendRetirer->start();
+    emit backendChanged(backend->name());
+}
+
+void Tail::onBackendRetired()
+{
+    BackendRetireThread *retirer = d.backendRetirer;
+    d.backendRetirer = 0;
+    retirer->wait();
+    delete retirer->thread;
+    delete retirer->backend;
+    delete retirer;
+}
 
 Tail::~Tail()
 {
+    if (d.backendLoader) {
+        d.backendLoader->wait();
+        delete d.backendLoader->backend;
+        delete d.backendLoader;
+    }
+    if (d.backendRetirer) {
+        d.backendRetirer->wait();
+        onBackendRetired();
+    }
+    delete d.scheduler; // workers use the tag interfaces
     qDeleteAll(d.tagInterfaces);
+    delete d.snapshot;
+    delete d.loudnessAnalyzer;
+    delete d.loudnessCache;
+    delete d.backendThread;
     if (d.backend) {
         delete d.backend;
     }
-    delete d.root;
+    delete d.functionTable;
+}
+
+// Lets the backend thread answer the D-Bus call so we can go back to
+// dispatching other calls while the backend is busy.
+bool Tail::postDelayedReply(BackendThread::Type type, const QVariant &arg) const
+{
+    Q_ASSERT(d.backendThread);
+    if (!calledFromDBus())
+        return false;
+    setDelayedReply(true);
+    d.backendThread->post(type, arg, QVariant(), message().createReply());
+    return true;
+}
+
+bool Tail::isValid(const QUrl &url) const
+{
+    if (postDelayedReply(BackendThread::IsValid, url))
+        return false; // ignored
+    return d.backendThread->call(BackendThread::IsValid, url).toBool();
+}
+
+bool Tail::loadUrl(const QUrl &url)
+{
+    if (postDelayedReply(BackendThread::LoadUrl, url))
+        return false; // ignored
+    return d.backendThread->call(BackendThread::LoadUrl, url).toBool();
+}
+
+bool Tail::initBackend()
+{
+    if (postDelayedReply(BackendThread::Init))
+        return false; // ignored
+    return d.backendThread->call(BackendThread::Init).toBool();
+}
+
+
+void Tail::analyzeLoudness()
+{
+    Q_ASSERT(d.loudnessAnalyzer);
+    d.loudnessAnalyzer->analyze(d.tracks);
+}
+
+QVariantMap Tail::loudnessStatistics() const
+{
+    Q_ASSERT(d.loudnessAnalyzer);
+    return d.loudnessAnalyzer->statistics();
+}
+
+QVariantMap Tail::settingsStatistics() const
+{
+    return Config::statistics();
+}
+
+QVariantMap Tail::controlStatistics() const
+{
+    return d.controlServer ? d.controlServer->statistics() : QVariantMap();
+}
+
+// ReplayGain 2.0 style, normalize to -18 LUFS without clipping the peak
+void Tail::applyGain(const QUrl &url)
+{
+    static const QString mode = Config::value<QString>("replaygain", "track").toLower();
+    static const double preamp = Config::value<double>("replaygainpreamp", 0.0);
+    double gain = 0.0;
+    const QString path = url.toLocalFile();
+    if (mode != "off" && !path.isEmpty()) {
+        const Loudness loudness = (mode == "album"
+                                   ? d.loudnessCache->album(QFileInfo(path).absolutePath())
+                                   : d.loudnessCache->track(path));
+        if (loudness.isValid()) {
+            gain = -18.0 - loudness.integrated + preamp;
+            if (loudness.peak > 0.0)
+                gain = qMin(gain, -20.0 * log10(loudness.peak));
+        }
+    }
+    d.backendThread->post(BackendThread::SetGain, gain);
+}
+
+QVariantMap Tail::backendStatistics() const
+{
+    if (postDelayedReply(BackendThread::Statistics))
+        return QVariantMap(); // ignored
+    return d.backendThread->call(BackendThread::Statistics).toMap();
+}
+
+QVariantMap Tail::playbackClock()
+{
+    Q_ASSERT(d.backendThread);
+    int status, position;
+    qint64 timestamp;
+    d.backendThread->clock(&status, &position, &timestamp);
+    QVariantMap map;
+    map["status"] = status;
+    map["position"] = position;
+    map["length"] = currentTrackLength();
+    map["timestamp"] = timestamp;
+    map["rate"] = (status == Backend::Playing ? 1.0 : 0.0);
+    return map;
+}
+
+void Tail::onClockChanged(int status, int position, qint64 timestamp)
+{
+    if (sender() != d.backendThread)
+        return; // a retired backend stopping
+    emit clockChanged(status, position, currentTrackLength(), timestamp,
+                      status == Backend::Playing ? 1.0 : 0.0);
+}
+
+// in ms, -1 if unknown
+int Tail::currentTrackLength()
+{
+    if (d.current < 0 || d.current >= d.tracks.size())
+        return -1;
+    const int seconds = cachedTrackData(d.current).trackLength;
+    return seconds > 0 ? seconds * 1000 : -1;
+}
+
+// Merges a change into the previous one if it hasn't been signalled yet
+// and the two describe one contiguous range.
+static inline bool mergeChange(int *lastA, int *lastB, PlaylistChange lastType,
+                               PlaylistChange type, int a, int b)
+{
+    if (type != lastType)
+        return false;
+    switch (type) {
+    case TracksInserted:
+        if (a == *lastA + *lastB || a == *lastA) {
+            *lastB += b;
+            return true;
+        }
+        break;
+    case TracksRemoved:
+        if (a == *lastA) {
+            *lastB += b;
+            return true;
+        } else if (a + b == *lastA) {
+            *lastA = a;
+            *lastB += b;
+            return true;
+        }
+        break;
+    case TracksChanged:
+        if (a <= *lastA + *lastB && a + b >= *lastA) {
+            const int end = qMax(a + b, *lastA + *lastB);
+            *lastA = qMin(a, *lastA);
+            *lastB = end - *lastA;
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
+void Tail::recordChange(PlaylistChange type, int a, int b)
+{
+    ++d.sequence;
+    if (d.changes.size() > d.flushedChanges) {
+        Data::Change &last = d.changes.last();
+        if (type == PlaylistReset) {
+            // nothing before it matters anymore
+            while (d.changes.size() > d.flushedChanges)
+                d.changes.removeLast();
+        } else if (::mergeChange(&last.a, &last.b, last.type, type, a, b)) {
+            last.sequence = d.sequence;
+            return;
+        }
+    }
+    const Data::Change change = { d.sequence, type, a, b };
+    d.changes.append(change);
+    if (!d.changeTimer.isActive())
+        d.changeTimer.start();
+}
+
+void Tail::flushChanges()
+{
+    d.changeTimer.stop();
+    if (d.flushedChanges == d.changes.size())
+        return;
+    IntList list;
+    for (int i=d.flushedChanges; i<d.changes.size(); ++i) {
+        const Data::Change &change = d.changes.at(i);
+        list << change.sequence << change.type << change.a << change.b;
+    }
+    static const int max = Config::value<int>("changelogsize", 1000);
+    while (d.changes.size() > max) {
+        d.trimmedSequence = d.changes.takeFirst().sequence;
+    }
+    d.flushedChanges = d.changes.size();
+    emit playlistChanged(d.sequence, list);
+}
+
+void Tail::beginBatch()
+{
+    if (d.batchDepth++)
+        return;
+    flushChanges(); // so nothing from before the batch is merged into it
+    d.batchStart = d.changes.size();
+    d.batchCurrent = d.current;
+    d.batchUrl = d.tracks.value(d.current);
+    d.batchDirty = false;
+    d.batchPlay = false;
+}
+
+// The change log entries are already merged, replaying them gives the
+// old style signals the same end result in fewer steps.
+void Tail::commitBatch()
+{
+    Q_ASSERT(d.batchDepth > 0);
+    if (--d.batchDepth)
+        return;
+    for (int i=d.batchStart; i<d.changes.size(); ++i) {
+        const Data::Change &change = d.changes.at(i);
+        switch (change.type) {
+        case TracksInserted:
+            emit tracksInserted(change.a, change.b);
+            break;
+        case TracksRemoved:
+            emit tracksRemoved(change.a, change.b);
+            break;
+        case TrackMoved:
+            emit trackMoved(change.a, change.b);
+            break;
+        case TracksSwapped:
+            emit tracksSwapped(change.a, change.b);
+            break;
+        case TracksChanged:
+            emit tracksChanged(change.a, change.b);
+            break;
+        case PlaylistReset:
+            break;
+        }
+    }
+    if (d.current != d.batchCurrent) {
+        Config::setValue<int>("current", d.current);
+        emit currentTrackChanged(d.current);
+    }
+    // setCurrentTrackIndex() leaves loading the track to us, removing
+    // tracks before it only moves it
+    const QUrl url = d.tracks.value(d.current);
+    if (!url.isEmpty() && url != d.batchUrl) {
+        d.backendThread->post(BackendThread::LoadUrl, url);
+        applyGain(url);
+    }
+    if (d.batchPlay) {
+        d.batchPlay = false;
+        play();
+    }
+    flushChanges();
+    if (d.batchDirty) {
+        d.batchDirty = false;
+        syncToFile();
+    }
+}
+
+// Nothing is sent, loaded or written until all of them have been applied.
+// If one fails the playlist and the current track are put back and the
+// call fails with an error saying which one. Only stop() isn't held
+// back. With THREADED_RECURSIVE_LOAD loadRecursively adds its tracks
+// later, outside the batch, and so do load and loadRecursively without
+// "trustextension".
+bool Tail::applyOperations(const QStringList &operations)
+{
+    const QList<QUrl> tracks = d.tracks;
+    beginBatch();
+    const int sequence = d.sequence;
+    QString error;
+    foreach(const QString &operation, operations) {
+        if (!applyOperation(operation, &error)) {
+            error = QString("%1: %2").arg(operation).arg(error);
+            break;
+        }
+    }
+    if (!error.isEmpty()) {
+        LOG(5) << "rolling back batch" << error;
+        d.tracks = tracks;
+        while (d.changes.size() > d.batchStart)
+            d.changes.removeLast();
+        d.sequence = sequence;
+        d.batchDirty = false;
+        d.batchPlay = false;
+        d.current = d.batchCurrent;
+        failCall(error);
+    }
+    commitBatch();
+    return error.isEmpty();
 }
 
+bool Tail::applyOperation(const QString &operation, QString *error)
+{
+    static const QSet<QString> playlistOperations = QSet<QString>()
+        << "load" << "loadRecursively" << "clear" << "crop" << "removeTrack" << "removeTracks"
+        << "swapTrack" << "moveTrack" << "setCurrentTrackIndex" << "setCurrentTrack";
+    bool ok;
+    QStringList args = ::splitCommand(operation, &ok);
+    if (!ok || args.isEmpty()) {
+        *error = "Can't parse";
+        return false;
+    }
+    const Function function = findFunction(args.takeFirst());
+    if (!playlistOperations.contains(function.name)) {
+        *error = "Not a playlist operation";
+        return false;
+    }
+    foreach(const QList<int> &types, function.args) {
+        if (types.size() != args.size() || types.size() > 2)
+            continue;
+        QVariantList values;
+        for (int i=0; i<types.size(); ++i) {
+            QVariant value = args.at(i);
+            if (!value.convert(static_cast<QVariant::Type>(types.at(i))))
+                break;
+            values.append(value);
+        }
+        if (values.size() != types.size())
+            continue;
+        QGenericArgument argv[2];
+        for (int i=0; i<values.size(); ++i)
+            argv[i] = QGenericArgument(QMetaType::typeName(types.at(i)), values.at(i).constData());
+        bool result = true;
+        const QGenericReturnArgument ret = (function.returnArgument == QMetaType::Bool
+                                            ? Q_RETURN_ARG(bool, result) : QGenericReturnArgument());
+        if (!QMetaObject::invokeMethod(this, qPrintable(function.name), Qt::DirectConnection, ret, argv[0], argv[1])) {
+            *error = "Can't invoke";
+            return false;
+        }
+        if (!result)
+            *error = "Failed";
+        return result;
+    }
+    *error = QString("Wrong arguments for %1").arg(function.name);
+    return false;
+}
+
+int Tail::sequence()
+{
+    flushChanges();
+    return d.sequence;
+}
+
+// Clients that have been away longer than the log reaches back get a
+// PlaylistReset and need to refetch everything.
+IntList Tail::changesSince(int sequence)
+{
+    flushChanges();
+    IntList ret;
+    if (sequence >= d.sequence)
+        return ret;
+    if (sequence < d.trimmedSequence) {
+        ret << d.sequence << PlaylistReset << 0 << d.tracks.size();
+        return ret;
+    }
+    foreach(const Data::Change &change, d.changes) {
+        if (change.sequence > sequence)
+            ret << change.sequence << change.type << change.a << change.b;
+    }
+    return ret;
+}
+
+// The snapshot is only maintained once a head has asked for it
+QDBusUnixFileDescriptor Tail::playlistSnapshot()
+{
+    if (!d.snapshot) {
+        d.snapshot = new PlaylistSnapshot;
+        d.snapshotTimer.setSingleShot(true);
+        d.snapshotTimer.setInterval(Config::value<int>("snapshotdelay", 50));
+        connect(&d.snapshotTimer, SIGNAL(timeout()), this, SLOT(publishSnapshot()));
+        connect(this, SIGNAL(tracksInserted(int, int)), this, SLOT(onSnapshotRowsShifted(int)));
+        connect(this, SIGNAL(tracksRemoved(int, int)), this, SLOT(onSnapshotRowsShifted(int)));
+        connect(this, SIGNAL(tracksChanged(int, int)), this, SLOT(onSnapshotRowsChanged(int, int)));
+        connect(this, SIGNAL(trackMoved(int, int)), this, SLOT(onSnapshotRowsMoved(int, int)));
+        connect(this, SIGNAL(tracksSwapped(int, int)), this, SLOT(onSnapshotRowsMoved(int, int)));
+        connect(this, SIGNAL(currentTrackChanged(int)), this, SLOT(onSnapshotCurrentChanged(int)));
+        onSnapshotRowsShifted(0);
+    }
+    if (d.snapshotTimer.isActive()) {
+        d.snapshotTimer.stop();
+        publishSnapshot();
+    }
+    return QDBusUnixFileDescriptor(d.snapshot->fileDescriptor());
+}
+
+TrackData Tail::cachedTrackData(int index)
+{
+    const QUrl &url = d.tracks.at(index);
+    if (const TrackData *data = d.cache.object(url))
+        return *data;
+    const TrackData data = ::readTrackData(d.tagInterfaces, url, index, All & ~PlaylistIndex);
+    d.cache.insert(url, new TrackData(data));
+    return data;
+}
+
+// Only the dirty rows are rewritten and nothing is parsed here. Rows that
+// aren't cached keep what the segment had for their url if they only
+// moved, otherwise they go out with just the url and are read on the
+// scheduler's workers, see onSnapshotRowsRead().
+void Tail::publishSnapshot()
+{
+    if (!d.snapshot || d.snapshotFrom == -1)
+        return;
+    const int count = d.tracks.size();
+    const int from = qMin(d.snapshotFrom, count);
+    const int to = qMin(d.snapshotTo, count);
+    QHash<QUrl, TrackData> published;
+    bool salvaged = false;
+    QList<TrackData> rows;
+    SnapshotRowsRequest *request = 0;
+    for (int i=from; i<to; ++i) {
+        const QUrl &url = d.tracks.at(i);
+        if (const TrackData *data = d.cache.object(url)) {
+            rows.append(*data);
+            continue;
+        }
+        if (!salvaged) {
+            const int end = qMin(d.snapshotTo, d.snapshot->rowCount());
+            for (int j=from; j<end; ++j) {
+                TrackData data;
+                if (d.snapshot->row(j, &data) && (data.fields & ~(URL|PlaylistIndex)))
+                    published.insert(data.url, data);
+            }
+            salvaged = true;
+        }
+        const QHash<QUrl, TrackData>::const_iterator it = published.find(url);
+        if (it != published.end()) {
+            rows.append(it.value());
+            continue;
+        }
+        TrackData data;
+        data.url = url;
+        data.fields = URL;
+        rows.append(data);
+        if (d.snapshotPending.contains(url))
+            continue;
+        d.snapshotPending.insert(url);
+        if (!request)
+            request = new SnapshotRowsRequest(d.tagInterfaces);
+        request->urls.append(url);
+        request->rows.append(i);
+        if (request->urls.size() == 64) {
+            d.scheduler->schedule(this, "onSnapshotRowsRead", request);
+            request = 0;
+        }
+    }
+    if (request)
+        d.scheduler->schedule(this, "onSnapshotRowsRead", request);
+
+    const bool sameSegment = d.snapshot->publish(from, rows, count, d.current);
+    const int changed = (sameSegment && d.snapshotTo != INT_MAX ? to - from : -1);
+    d.snapshotFrom = d.snapshotTo = -1;
+    emit snapshotChanged(d.snapshot->generation(), sameSegment ? from : 0, changed);
+}
+
+void Tail::onSnapshotRowsRead(const QVariant &rows)
+{
+    bool moved = false;
+    foreach(TrackData data, qVariantValue<TrackDataList>(rows)) {
+        d.snapshotPending.remove(data.url);
+        const int row = data.playlistIndex;
+        data.fields &= ~PlaylistIndex;
+        d.cache.insert(data.url, new TrackData(data));
+        if (d.snapshot && !moved) {
+            if (d.tracks.value(row) == data.url) {
+                onSnapshotRowsChanged(row, 1);
+            } else {
+                moved = true; // they're all in the cache now, rare enough to not go looking
+            }
+        }
+    }
+    if (moved)
+        onSnapshotRowsShifted(0);
+}
+
+void Tail::onSnapshotRowsChanged(int from, int count)
+{
+    if (d.snapshotFrom == -1) {
+        d.snapshotFrom = from;
+        d.snapshotTo = from + count;
+    } else {
+        d.snapshotFrom = qMin(d.snapshotFrom, from);
+        d.snapshotTo = qMax(d.snapshotTo, from + count);
+    }
+    if (!d.snapshotTimer.isActive())
+        d.snapshotTimer.start();
+}
+
+void Tail::onSnapshotRowsShifted(int from)
+{
+    onSnapshotRowsChanged(from, INT_MAX - from);
+}
+
+void Tail::onSnapshotRowsMoved(int from, int to)
+{
+    onSnapshotRowsChanged(qMin(from, to), qAbs(to - from) + 1);
+}
+
+void Tail::onSnapshotCurrentChanged(int current)
+{
+    d.snapshot->setCurrent(current);
+}
 
 void Tail::prev()
 {
@@ -125,124 +913,165 @@ void Tail::next()
     play();
 }
 
+void Tail::onBackendEvent(int type)
+{
+    emit event(type, QList<QVariant>());
+    switch (type) {
+    case Backend::SongFinished:
+        next();
+        break;
+    default:
+        break;
+    }
+}
+
 void Tail::crop()
 {
     if (d.tracks.size() <= 1)
         return;
     Q_ASSERT(d.current != -1);
-    d.blockSync = true;
+    beginBatch();
     if (d.current + 1 < d.tracks.size())
         removeTracks(d.current + 1, d.tracks.size() - 1 - d.current);
     if (d.current > 0)
         removeTracks(0, d.current);
-    d.blockSync = false;
-    syncToFile();
-}
-
-static void addFunction(FunctionNode *node, const QString &string, const Function &function)
-{
-    Q_ASSERT(node);
-    if (string.isEmpty()) {
-        if (node->function.name.isEmpty()) {
-            node->function = function;
-        } else {
-            node->function.args.append(function.args);
-        }
-        return;
-    }
-    FunctionNode *&n = node->nodes[string.at(0).toLower()];
-    if (!n) {
-        n = new FunctionNode;
-    }
-    addFunction(n, string.mid(1), function);
+    commitBatch();
 }
 
-static inline QStringList recurse(const FunctionNode *node)
+static QStringList signatures(const Function &function)
 {
-    Q_ASSERT(node);
     QStringList ret;
-    foreach(const QList<int> &args, node->function.args) {
+    foreach(const QList<int> &args, function.args) {
         QStringList argNames;
         foreach(int arg, args) {
             argNames.append(QMetaType::typeName(arg));
         }
         ret.append(QString("%0 %1(%2)").
-                   arg(QMetaType::typeName(node->function.returnArgument)).
-                   arg(node->function.name).
+                   arg(QMetaType::typeName(function.returnArgument)).
+                   arg(function.name).
                    arg(argNames.join(", ")));
     }
-    for (QHash<QChar, FunctionNode *>::const_iterator it = node->nodes.begin(); it != node->nodes.end(); ++it) {
-        ret += ::recurse(it.value());
-    }
-
     return ret;
 }
 
-static Function findFunction(const FunctionNode *node, const QString &name, QString *error)
+// No allocations, keys are lowercase and the table is sorted by them
+void FunctionTable::range(const QString &prefix, int *from, int *to) const
 {
-    if (name.isEmpty()) {
-        while (node->function.name.isEmpty() && node->nodes.size() == 1) {
-            node = node->nodes.values().first();
+    int lo = 0, hi = entries.size();
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (QString::compare(entries.at(mid).key, prefix, Qt::CaseInsensitive) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        if (error && node->function.name.isEmpty() && node->nodes.size() > 1) {
-            *error = "Ambigous request. Could match: " + ::recurse(node).join("\n");
+    }
+    *from = lo;
+    while (lo < entries.size() && entries.at(lo).key.startsWith(prefix, Qt::CaseInsensitive))
+        ++lo;
+    *to = lo;
+}
+
+const FunctionTable *Tail::functionTable() const
+{
+    if (d.functionTable)
+        return d.functionTable;
+    FunctionTable *table = new FunctionTable;
+    QMap<QString, Function> functions; // overloads share one
+    const QMetaObject *meta = metaObject();
+    const int count = meta->methodCount();
+    for (int i=0; i<count; ++i) {
+        const QMetaMethod method = meta->method(i);
+        if (method.attributes() & QMetaMethod::Scriptable) {
+            QString name = QString::fromLatin1(method.signature());
+            name.truncate(name.indexOf('('));
+            Function &func = functions[name];
+            func.name = name;
+            func.returnArgument = QMetaType::type(method.typeName());
+            QList<int> args;
+            foreach(const QByteArray &parameter, method.parameterTypes()) {
+                args.append(QMetaType::type(parameter.constData()));
+            }
+            func.args.append(args);
         }
-        return node->function;
     }
 
-    FunctionNode *n = node->nodes.value(name.at(0));
-    if (!n) {
-        return Function();
+    // names first so a translation or alias can't shadow another function
+    QSet<QString> used;
+    QList<FunctionTable::Entry> extra;
+    for (QMap<QString, Function>::const_iterator it = functions.begin(); it != functions.end(); ++it) {
+        const int index = table->functions.size();
+        table->functions.append(it.value());
+        const FunctionTable::Entry entry = { it.key().toLower(), it.key(), index };
+        used.insert(entry.key);
+        table->entries.append(entry);
+
+        QStringList names = Config::value<QString>(QLatin1String("Aliases/") + it.key()).split(' ', QString::SkipEmptyParts);
+        names.prepend(tr(qPrintable(it.key()))); // ### need to make sure this is translated
+        foreach(const QString &name, names) {
+            const FunctionTable::Entry alias = { name.toLower(), name, index };
+            extra.append(alias);
+        }
     }
-    return findFunction(n, name.mid(1), error);
+    foreach(const FunctionTable::Entry &entry, extra) {
+        if (!used.contains(entry.key)) { // ### warn about dupe alias?
+            used.insert(entry.key);
+            table->entries.append(entry);
+        }
+    }
+    qSort(table->entries);
+    d.functionTable = table;
+    return table;
 }
 
-
+// A name, translation or alias, or a prefix of only one function
 Function Tail::findFunction(const QString &functionName) const
 {
-    if (!d.root) {
-        d.root = new FunctionNode;
-        const QMetaObject *meta = metaObject();
-        const int count = meta->methodCount();
-        for (int i=0; i<count; ++i) {
-            const QMetaMethod method = meta->method(i);
-            if (method.attributes() & QMetaMethod::Scriptable) {
-                Function func;
-                func.name = QString::fromLatin1(method.signature());
-                func.name.chop(func.name.size() - func.name.indexOf('('));
-                func.returnArgument = QMetaType::type(method.typeName());
-                QList<int> args;
-                foreach(const QByteArray &parameter, method.parameterTypes()) {
-                    args.append(QMetaType::type(parameter.constData()));
-                }
-                func.args.append(args);
-                ::addFunction(d.root, func.name, func);
-                QSet<QString> used;
-                used.insert(func.name);
-                const QString translated = tr(qPrintable(func.name)); // ### need to make sure this is translated
-                if (translated.isEmpty() && translated != func.name) {
-                    used.insert(translated);
-                    ::addFunction(d.root, translated, func);
-                }
-                const QStringList aliases = Config::value<QString>(QLatin1String("Aliases/") + func.name).split(' ', QString::SkipEmptyParts);
-                foreach(const QString &alias, aliases) {
-                    if (!used.contains(alias)) { // ### warn about dupe alias?
-                        used.insert(alias);
-                        ::addFunction(d.root, alias, func);
-                    }
-                }
+    d.lastError.clear();
+    const FunctionTable *table = functionTable();
+    int from, to;
+    table->range(functionName, &from, &to);
+    if (from == to)
+        return Function();
+    const FunctionTable::Entry &first = table->entries.at(from);
+    if (first.key.size() == functionName.size())
+        return table->functions.at(first.function);
+
+    for (int i=from + 1; i<to; ++i) {
+        if (table->entries.at(i).function != first.function) {
+            QStringList matches;
+            int last = -1;
+            for (int j=from; j<to; ++j) {
+                const int function = table->entries.at(j).function;
+                if (function != last)
+                    matches += ::signatures(table->functions.at(function));
+                last = function;
             }
+            matches.removeDuplicates();
+            d.lastError = "Ambigous request. Could match: " + matches.join("\n");
+            return Function();
         }
     }
-    return ::findFunction(d.root, functionName.toLower(), &d.lastError);
+    return table->functions.at(first.function);
 }
 
 QStringList Tail::functions() const
 {
-    if (!d.root) {
-        findFunction(QString());
-    }
-    return ::recurse(d.root);
+    QStringList ret;
+    foreach(const Function &function, functionTable()->functions)
+        ret += ::signatures(function);
+    return ret;
+}
+
+QStringList Tail::completions(const QString &prefix) const
+{
+    const FunctionTable *table = functionTable();
+    int from, to;
+    table->range(prefix, &from, &to);
+    QStringList ret;
+    for (int i=from; i<to; ++i)
+        ret.append(table->entries.at(i).name);
+    return ret;
 }
 
 QString Tail::lastError() const
@@ -250,6 +1079,17 @@ QString Tail::lastError() const
     return d.lastError;
 }
 
+// Fails the D-Bus call being handled with error. The control socket
+// picks it up with takeCallError().
+void Tail::failCall(const QString &error)
+{
+    if (calledFromDBus()) {
+        sendErrorReply(QDBusError::Failed, error);
+    } else {
+        d.callError = error;
+    }
+}
+
 int Tail::count() const
 {
     return d.tracks.size();
@@ -313,15 +1153,28 @@ QList<QUrl> Tail::tracks(int start, int count) const
     return ret;
 }
 
+void Tail::play()
+{
+    Q_ASSERT(d.backendThread);
+    if (d.batchDepth) {
+        d.batchPlay = true;
+    } else {
+        d.backendThread->post(BackendThread::Play);
+    }
+}
+
 bool Tail::setCurrentTrackIndex(int index)
 {
     if (index >= 0 && index < d.tracks.size()) {
         if (index != d.current) { // restart???
             d.current = index;
-            const QUrl &url = d.tracks.at(index);
-            loadUrl(url);
-            emit currentTrackChanged(index); //, trackData(d.tracks.at(index)));
-            Config::setValue<int>("current", d.current);
+            if (!d.batchDepth) { // commitBatch() loads it
+                const QUrl &url = d.tracks.at(index);
+                d.backendThread->post(BackendThread::LoadUrl, url);
+                applyGain(url);
+                emit currentTrackChanged(index); //, trackData(d.tracks.at(index)));
+                Config::setValue<int>("current", d.current);
+            }
         }
         return true;
     } else {
@@ -377,31 +1230,105 @@ TrackData Tail::trackData(int index, int fields) const
         qWarning("Invalid index %d, needs to be between 0-%d", index, d.tracks.size() - 1);
         return TrackData();
     }
-    Log::log(50) << "requsting trackdata for song" << index << "fields" << ::trackInfosToStringList(fields).join("|")
-                 << d.tracks.at(index);
-    // ### this should maybe cache data
-    TrackData data;
-    if (fields & URL) {
-        data.url = d.tracks.at(index);
+    if (calledFromDBus()) {
+        TrackDataRequest *request = new TrackDataRequest(d.tagInterfaces, index, fields, false);
+        request->urls.append(d.tracks.at(index));
+        setDelayedReply(true);
+        d.scheduler->schedule(message(), request, RequestScheduler::Interactive);
+        return TrackData();
     }
-    if (fields & PlaylistIndex) {
-        data.playlistIndex = index;
+    return ::readTrackData(d.tagInterfaces, d.tracks.at(index), index, fields);
+}
+
+TrackDataList Tail::trackDataBatch(int from, int count, int fields) const
+{
+    static const int maxCount = qMax(1, Config::value<int>("trackdatabatch", 1000));
+    TrackDataList ret;
+    if (from < 0 || count < 0)
+        return ret;
+    const int to = from + qMin(qMin(count, maxCount), qMax(0, d.tracks.size() - from));
+    if (calledFromDBus() && from < to) {
+        TrackDataRequest *request = new TrackDataRequest(d.tagInterfaces, from, fields|PlaylistIndex, true);
+        request->urls = d.tracks.mid(from, to - from);
+        setDelayedReply(true);
+        d.scheduler->schedule(message(), request, RequestScheduler::Metadata);
+        return ret;
     }
+    for (int i=from; i<to; ++i)
+        ret.append(::readTrackData(d.tagInterfaces, d.tracks.at(i), i, fields|PlaylistIndex));
+    return ret;
+}
 
-    enum { BackendTypes = Title|TrackLength|Artist|Year|Genre|AlbumIndex };
-    uint backendTypes = fields & BackendTypes;
-    if (backendTypes) {
-        foreach(const TagInterface *tag, d.tagInterfaces) {
-            uint handled = tag->trackData(&data, d.tracks.at(index), backendTypes);
-            backendTypes &= ~handled;
-            if (!backendTypes)
-                break;
+QVariantMap Tail::requestStatistics() const
+{
+    return d.scheduler->statistics();
+}
+
+// Compares the per track encoding trackData() uses with the batch encoding
+// of trackDataBatch() on the current playlist, scaled to 10k tracks. It
+// encodes everything many times over so the result is kept until the
+// playlist changes.
+QVariantMap Tail::trackDataEncodingStatistics()
+{
+    if (sequence() == d.encodingStatisticsSequence)
+        return d.encodingStatistics;
+    QVariantMap ret;
+    const int count = d.tracks.size();
+    if (!count)
+        return ret;
+    TrackDataList list;
+    for (int i=0; i<count; ++i) {
+        TrackData data = cachedTrackData(i);
+        data.playlistIndex = i;
+        data.fields |= PlaylistIndex;
+        list.append(data);
+    }
+    const int iterations = qMax(1, 10000 / count);
+    const double scale = 10000.0 / (double(count) * iterations);
+
+    QTime timer;
+    timer.start();
+    qint64 trackBytes = 0;
+    QList<QByteArray> encoded;
+    for (int i=0; i<iterations; ++i) {
+        encoded.clear();
+        foreach(const TrackData &data, list)
+            encoded.append(::encodeTrackData(data));
+    }
+    const int trackEncodeMs = timer.restart();
+    for (int i=0; i<iterations; ++i) {
+        foreach(const QByteArray &data, encoded) {
+            TrackData trackData;
+            ::decodeTrackData(data, &trackData);
         }
-//        d.backend->trackData(&data, d.tracks.at(index), backendTypes); // ### check return value?
     }
-    data.fields |= fields; // ### should this only be the types we actually found?
-//    ::sleep(250);
-    return data;
+    const int trackDecodeMs = timer.restart();
+    foreach(const QByteArray &data, encoded)
+        trackBytes += data.size() + sizeof(quint32); // each one is its own D-Bus byte array
+
+    QByteArray batch;
+    for (int i=0; i<iterations; ++i)
+        batch = ::encodeTrackDataList(list);
+    const int batchEncodeMs = timer.restart();
+    for (int i=0; i<iterations; ++i) {
+        TrackDataList decoded;
+        ::decodeTrackDataList(batch, &decoded);
+    }
+    const int batchDecodeMs = timer.elapsed();
+
+    const double perTrack = 10000.0 / count;
+    ret.insert("tracks", count);
+    ret.insert("perTrackBytesPer10k", qRound64(trackBytes * perTrack));
+    ret.insert("perTrackEncodeMsPer10k", trackEncodeMs * scale);
+    ret.insert("perTrackDecodeMsPer10k", trackDecodeMs * scale);
+    ret.insert("batchBytesPer10k", qRound64(batch.size() * perTrack));
+    ret.insert("batchEncodeMsPer10k", batchEncodeMs * scale);
+    ret.insert("batchDecodeMsPer10k", batchDecodeMs * scale);
+    LOG(1) << "TrackData encoding per 10k tracks: per track" << ret.value("perTrackBytesPer10k").toLongLong()
+           << "bytes, batch" << ret.value("batchBytesPer10k").toLongLong() << "bytes";
+    d.encodingStatistics = ret;
+    d.encodingStatisticsSequence = d.sequence;
+    return ret;
 }
 
 enum RecursiveLoadFlags {
@@ -460,7 +1387,7 @@ static inline QStringList recursiveLoad(QFileInfo file, uint flags, const QSet<Q
                     if (fi.isFile()) {
                         ret += recursiveLoad(fi, flags, validExtensions);
                     } else {
-                        Log::log(1) << "Don't know what to do with this" << fi.absoluteFilePath();
+                        LOG(1) << "Don't know what to do with this" << fi.absoluteFilePath();
                     }
                 }
             }
@@ -503,17 +1430,39 @@ void Tail::onThreadFinished()
 
 #endif
 
+// Without "trustextension" the backend has to open every file, which
+// would block tail for a large directory. It's asked in chunks so
+// commands posted meanwhile get a turn, the tracks are added as the
+// answers come in.
 void Tail::addTracks(const QStringList &list)
 {
-    QList<QUrl> valid;
     static const bool trustExtension = Config::isEnabled("trustextension", true);
-    foreach(const QString &file, list) {
-        if (trustExtension || isValid(file)) {
-            valid.append(file);
-        }
+    if (trustExtension) {
+        appendTracks(list);
+        return;
     }
+    enum { ValidationChunk = 64 };
+    for (int i=0; i<list.size(); i += ValidationChunk) {
+        d.backendThread->post(BackendThread::ValidTracks, list.mid(i, ValidationChunk),
+                              this, "onTracksValidated");
+    }
+}
+
+void Tail::onTracksValidated(const QVariant &tracks)
+{
+    appendTracks(tracks.toStringList());
+}
+
+void Tail::appendTracks(const QStringList &list)
+{
+    QList<QUrl> valid;
+    foreach(const QString &file, list)
+        valid.append(file);
     if (!valid.isEmpty()) {
         d.tracks.append(valid);
+        static const bool analyze = Config::isEnabled("analyzeloudness", false);
+        if (analyze && d.loudnessAnalyzer)
+            d.loudnessAnalyzer->analyze(valid);
 //         if (d.playlist.isWritable()) {
 //             QTextStream ts(&d.playlist);
 //             for (int i=0; i<valid.size(); ++i) {
@@ -522,7 +1471,9 @@ void Tail::addTracks(const QStringList &list)
 //         } else {
         syncToFile();
 //        }
-        emit tracksInserted(d.tracks.size() - valid.size(), valid.size());
+        recordChange(TracksInserted, d.tracks.size() - valid.size(), valid.size());
+        if (!d.batchDepth)
+            emit tracksInserted(d.tracks.size() - valid.size(), valid.size());
         if (d.current == -1) {
             setCurrentTrackIndex(0);
         }
@@ -556,7 +1507,7 @@ bool Tail::load(const QUrl &url, bool recurse)
     if (ignoreExtension)
         flags |= IgnoreExtension;
 
-    Log::log(5) << path << recurse << file.absoluteFilePath();
+    LOG(5) << path << recurse << file.absoluteFilePath();
     if (!file.exists()) {
         qWarning("%s doesn't seem to exist", qPrintable(file.absoluteFilePath()));
         return false;
@@ -574,7 +1525,7 @@ bool Tail::load(const QUrl &url, bool recurse)
     const QStringList songs = ::recursiveLoad(file, flags, validExtensions);
     addTracks(songs);
     if (file.isFile() && songs.isEmpty()) {
-        Log::log(0) << file.absoluteFilePath() << "doesn't seem to be a valid file";
+        LOG(0) << file.absoluteFilePath() << "doesn't seem to be a valid file";
         return false;
     }
     return true;
@@ -593,8 +1544,8 @@ QString Tail::CWD() const
 
 void Tail::quit()
 {
-    if (d.backend) {
-        d.backend->shutdown();
+    if (d.backendThread) {
+        d.backendThread->call(BackendThread::Shutdown);
     }
     QCoreApplication::quit();
 }
@@ -629,7 +1580,9 @@ bool Tail::removeTracks(int index, int count)
 
     const QList<QUrl>::iterator it = d.tracks.begin() + index;
     d.tracks.erase(it, it + count);
-    emit tracksRemoved(index, count);
+    recordChange(TracksRemoved, index, count);
+    if (!d.batchDepth)
+        emit tracksRemoved(index, count);
     if (d.tracks.isEmpty()) {
         d.current = -1;
         action = EmitCurrentChanged;
@@ -638,19 +1591,18 @@ bool Tail::removeTracks(int index, int count)
     case Nothing:
         break;
     case EmitCurrentChanged:
-        emit currentTrackChanged(d.current);
+        if (!d.batchDepth)
+            emit currentTrackChanged(d.current);
         break;
     case Next:
         next();
         break;
     }
-    if (!d.blockSync) {
-        syncToFile();
-    }
+    syncToFile();
     return true;
 }
 
-bool Tail::removeTracks(const QList<int> &tracks)
+bool Tail::removeTracks(const IntList &tracks)
 {
     QList<int> sorted = tracks;
     qSort(sorted);
@@ -671,7 +1623,15 @@ bool Tail::swapTrack(int from, int to)
     }
 
     d.tracks.swap(from, to);
-    emit tracksSwapped(from, to);
+    recordChange(TracksSwapped, from, to);
+    if (!d.batchDepth)
+        emit tracksSwapped(from, to);
+    // the current track stays current, only its index changes
+    if (d.current == from) {
+        moveCurrentIndex(to);
+    } else if (d.current == to) {
+        moveCurrentIndex(from);
+    }
     syncToFile();
     return true;
 }
@@ -685,16 +1645,38 @@ bool Tail::moveTrack(int from, int to)
     }
 
     d.tracks.move(from, to);
-    emit trackMoved(from, to);
+    recordChange(TrackMoved, from, to);
+    if (!d.batchDepth)
+        emit trackMoved(from, to);
+    if (d.current == from) {
+        moveCurrentIndex(to);
+    } else if (from < d.current && d.current <= to) {
+        moveCurrentIndex(d.current - 1);
+    } else if (to <= d.current && d.current < from) {
+        moveCurrentIndex(d.current + 1);
+    }
     syncToFile();
     return true;
 }
 
+// For when the current track moved in the playlist. It is the same
+// track so nothing is loaded, in a batch commitBatch() sends the signal.
+void Tail::moveCurrentIndex(int index)
+{
+    d.current = index;
+    if (!d.batchDepth) {
+        Config::setValue<int>("current", d.current);
+        emit currentTrackChanged(d.current);
+    }
+}
+
 #ifdef Q_OS_UNIX
 void Tail::onUnixSignal(int)
 {
     Config::setValue("playlist", d.tracks);
     Config::setValue("current", d.current);
+    Config::flush(); // exit() doesn't get to the post routines
+    Log::flush();
     exit(0);
 }
 
@@ -718,7 +1700,7 @@ bool Tail::syncFromFile(bool *foundInvalidSongs)
     const int oldCurrent = d.current;
     const QList<QUrl> oldTracks = d.tracks;
     if (!d.playlist.open(QIODevice::ReadOnly)) {
-        Log::log(0) << "Can't open" << QFileInfo(d.playlist).absoluteFilePath() << "for reading";
+        LOG(0) << "Can't open" << QFileInfo(d.playlist).absoluteFilePath() << "for reading";
         return false;
     }
     d.tracks.clear();
@@ -737,20 +1719,23 @@ bool Tail::syncFromFile(bool *foundInvalidSongs)
 
     if (d.tracks.size() != oldTracks.size()) {
         ::fixCurrent(&d.current, d.tracks.size());
+        recordChange(PlaylistReset, 0, d.tracks.size());
         emit tracksRemoved(0, oldTracks.size());
         emit tracksInserted(0, d.tracks.size());
     } else if (d.tracks != oldTracks) {
         int from = -1;
         for (int i=0; i<d.tracks.size(); ++i) {
-            if (d.tracks.at(i) == oldTracks.at(i)) {
+            if (d.tracks.at(i) != oldTracks.at(i)) {
                 if (from == -1)
-                    from = 1;
+                    from = i;
             } else if (from != -1) {
+                recordChange(TracksChanged, from, i - from);
                 emit tracksChanged(from, i - from);
                 from = -1;
             }
         }
         if (from != -1) {
+            recordChange(TracksChanged, from, d.tracks.size() - from);
             emit tracksChanged(from, d.tracks.size() - from);
         }
     }
@@ -763,12 +1748,16 @@ bool Tail::syncFromFile(bool *foundInvalidSongs)
 
 bool Tail::syncToFile()
 {
-    Log::log(10) << "syncing to file" << QFileInfo(d.playlist.fileName()).absoluteFilePath();
+    if (d.batchDepth) {
+        d.batchDirty = true;
+        return true;
+    }
+    LOG(10) << "syncing to file" << QFileInfo(d.playlist.fileName()).absoluteFilePath();
 //         if (d.playlist.isWritable())
 //             d.playlist.remove();
 //        if (!d.playlist.open(QIODevice::ReadWrite)) {
     if (!d.playlist.open(QIODevice::WriteOnly)) {
-        Log::log(0) << "Can't open" << QFileInfo(d.playlist).absoluteFilePath() << "for writing";
+        LOG(0) << "Can't open" << QFileInfo(d.playlist).absoluteFilePath() << "for writing";
         return false;
     }
     QTextStream ts(&d.playlist);
@@ -783,19 +1772,13 @@ bool Tail::syncToFile()
 QStringList Tail::tags(const QString &filename) const
 {
     const int idx = indexOfTrack(filename);
-    QStringList list;
-    if (idx != -1) {
-        const TrackData data = trackData(idx);
-        const TrackInfo *info = ::trackInfos;
-        while (*info != None) {
-            const QVariant var = data.data(*info);
-//            qDebug() << var << qVariantValue<QUrl>(var).toString() << ::trackInfoToString(*info);
-            if (!var.isNull()) {
-                list.append(QString("%1: \"%2\"").arg(::trackInfoToString(*info)).arg(
-                                (*info == URL ? data.url.toString() : var.toString())));
-            }
-            ++info;
-        }
+    if (idx == -1)
+        return QStringList();
+    if (calledFromDBus()) {
+        setDelayedReply(true);
+        d.scheduler->schedule(message(), new TagsRequest(d.tagInterfaces, d.tracks.at(idx), idx),
+                              RequestScheduler::Background);
+        return QStringList();
     }
-    return list;
+    return ::formatTags(d.tagInterfaces, d.tracks.at(idx), idx);
 }
@@ -29,44 +29,79 @@
 #define TAIL_H
 
 #include <QtCore>
+#include <QtDBus>
 #include <global.h>
 #include "backend.h"
+#include "backendthread.h"
 
 class TagInterface;
-struct FunctionNode;
-class Tail : public QObject
+class LoudnessCache;
+class LoudnessAnalyzer;
+class PluginLoader;
+class ControlServer;
+class RequestScheduler;
+class BackendLoadThread;
+class BackendRetireThread;
+class PlaylistSnapshot;
+struct FunctionTable;
+class Tail : public QObject, protected QDBusContext
 {
     Q_OBJECT
+    // head's client proxy is generated from this, see shared/tokoloshinterface.pri.
+    // Use the global.h typedefs for tokolosh's own D-Bus types
+    Q_CLASSINFO("D-Bus Interface", "com.TokoloshMediaPlayer")
 public:
     Tail(QObject *parent = 0);
     virtual ~Tail();
     bool load(const QUrl &path, bool recursive);
     bool setBackend(Backend *backend);
+    void setPluginLoader(PluginLoader *loader) { d.pluginLoader = loader; }
+    void setControlServer(ControlServer *server) { d.controlServer = server; }
     void statusChange(int status) { emit statusChanged(status); }
+    // the error failCall() set for a call that didn't come over D-Bus
+    QString takeCallError() { const QString ret = d.callError; d.callError.clear(); return ret; }
 public slots:
-    Q_SCRIPTABLE int capabilities() const { Q_ASSERT(d.backend); return d.backend->capabilities(); }
-    Q_SCRIPTABLE bool isValid(const QUrl &url) const { Q_ASSERT(d.backend); return d.backend->isValid(url); }
-    Q_SCRIPTABLE void play() { Q_ASSERT(d.backend); d.backend->play(); }
-    Q_SCRIPTABLE void pause() { Q_ASSERT(d.backend); d.backend->pause(); }
-    Q_SCRIPTABLE void setProgress(int type, int progress) { Q_ASSERT(d.backend); d.backend->setProgress(type, progress); }
-    Q_SCRIPTABLE int progress(int type) { Q_ASSERT(d.backend); return d.backend->progress(type); }
-    Q_SCRIPTABLE void stop() { Q_ASSERT(d.backend); d.backend->stop(); }
-    Q_SCRIPTABLE bool loadUrl(const QUrl &url) { Q_ASSERT(d.backend); return d.backend->loadUrl(url); }
-    Q_SCRIPTABLE int status() const { Q_ASSERT(d.backend); return d.backend->status(); }
-    Q_SCRIPTABLE int volume() const { Q_ASSERT(d.backend); return d.backend->volume(); }
-    Q_SCRIPTABLE void setVolume(int vol) { Q_ASSERT(d.backend); d.backend->setVolume(vol); }
-    Q_SCRIPTABLE bool initBackend() { Q_ASSERT(d.backend); return d.backend->initBackend(); }
-    Q_SCRIPTABLE QString errorMessage() const { Q_ASSERT(d.backend); return d.backend->errorMessage(); }
-    Q_SCRIPTABLE int errorCode() const { Q_ASSERT(d.backend); return d.backend->errorCode(); }
-    Q_SCRIPTABLE void setMute(bool on) { Q_ASSERT(d.backend); d.backend->setMute(on); }
-    Q_SCRIPTABLE bool isMute() const { Q_ASSERT(d.backend); return d.backend->isMute(); }
-    Q_SCRIPTABLE QHash<int, int> equalizerSettings() const { Q_ASSERT(d.backend); return d.backend->equalizerSettings(); }
-    Q_SCRIPTABLE void setEqualizerSettings(const QHash<int, int> &eq) { Q_ASSERT(d.backend); d.backend->setEqualizerSettings(eq); }
+    Q_SCRIPTABLE int capabilities() const { Q_ASSERT(d.backendThread); return d.backendThread->capabilities(); }
+    Q_SCRIPTABLE bool isValid(const QUrl &url) const;
+    Q_SCRIPTABLE void play();
+    Q_SCRIPTABLE void pause() { Q_ASSERT(d.backendThread); d.backendThread->post(BackendThread::Pause); }
+    Q_SCRIPTABLE void setProgress(int type, int progress) { Q_ASSERT(d.backendThread); d.backendThread->post(BackendThread::SetProgress, type, progress); }
+    Q_SCRIPTABLE int progress(int type) { Q_ASSERT(d.backendThread); return d.backendThread->progress(type); }
+    // the last clock sample, see clockChanged
+    Q_SCRIPTABLE QVariantMap playbackClock();
+    Q_SCRIPTABLE void stop() { Q_ASSERT(d.backendThread); d.backendThread->post(BackendThread::Stop); }
+    Q_SCRIPTABLE bool loadUrl(const QUrl &url);
+    Q_SCRIPTABLE int status() const { Q_ASSERT(d.backendThread); return d.backendThread->status(); }
+    Q_SCRIPTABLE int volume() const { Q_ASSERT(d.backendThread); return d.backendThread->volume(); }
+    Q_SCRIPTABLE void setVolume(int vol) { Q_ASSERT(d.backendThread); d.backendThread->post(BackendThread::SetVolume, vol); }
+    Q_SCRIPTABLE bool initBackend();
+    Q_SCRIPTABLE QString errorMessage() const { Q_ASSERT(d.backendThread); return d.backendThread->errorMessage(); }
+    Q_SCRIPTABLE int errorCode() const { Q_ASSERT(d.backendThread); return d.backendThread->errorCode(); }
+    Q_SCRIPTABLE void setMute(bool on) { Q_ASSERT(d.backendThread); d.backendThread->post(BackendThread::SetMute, on); }
+    Q_SCRIPTABLE bool isMute() const { Q_ASSERT(d.backendThread); return d.backendThread->isMute(); }
+    Q_SCRIPTABLE IntHash equalizerSettings() const { Q_ASSERT(d.backendThread); return d.backendThread->equalizerSettings(); }
+    Q_SCRIPTABLE void setEqualizerSettings(const IntHash &eq)
+    { Q_ASSERT(d.backendThread); d.backendThread->post(BackendThread::SetEqualizerSettings, qVariantFromValue<IntHash>(eq)); }
+    Q_SCRIPTABLE QVariantMap backendStatistics() const;
+    // Switches backends at runtime, see backendChanged. Playback goes on
+    // where it was. A paused track ends up stopped at the same position,
+    // with statusChanged(Stopped), since pausing it on the new backend
+    // would mean playing a bit of it.
+    Q_SCRIPTABLE bool setBackend(const QString &names);
+    Q_SCRIPTABLE QString backendName() const { return d.backend ? d.backend->name() : QString(); }
+    Q_SCRIPTABLE void analyzeLoudness();
+    Q_SCRIPTABLE QVariantMap loudnessStatistics() const;
+    Q_SCRIPTABLE QVariantMap controlStatistics() const;
+    Q_SCRIPTABLE QVariantMap requestStatistics() const;
+    Q_SCRIPTABLE QVariantMap settingsStatistics() const;
 
     // playlist stuff
     Q_SCRIPTABLE TrackData trackData(int idx, int fields = All) const;
     Q_SCRIPTABLE TrackData trackData(const QUrl &path, int fields = All) const;
     Q_SCRIPTABLE TrackData trackData(const QString &song, int fields = All) const;
+    // at most "trackdatabatch" tracks (default 1000), ask again for the rest
+    Q_SCRIPTABLE TrackDataList trackDataBatch(int from, int count, int fields = All) const;
+    Q_SCRIPTABLE QVariantMap trackDataEncodingStatistics();
     Q_SCRIPTABLE int count() const;
     Q_SCRIPTABLE QString currentTrackName() const;
     Q_SCRIPTABLE int currentTrackIndex() const;
@@ -88,20 +123,28 @@ public slots:
     Q_SCRIPTABLE void crop();
     Q_SCRIPTABLE Function findFunction(const QString &functionName) const;
     Q_SCRIPTABLE QStringList functions() const;
+    // names and aliases starting with prefix, for tab completion
+    Q_SCRIPTABLE QStringList completions(const QString &prefix) const;
     Q_SCRIPTABLE QString lastError() const;
     Q_SCRIPTABLE QStringList tags(const QString &filename) const;
 
     Q_SCRIPTABLE inline bool load(const QString &path) { return load(QUrl(path), false); }
     Q_SCRIPTABLE inline bool loadRecursively(const QString &path) { return load(QUrl(path), true); }
-    Q_SCRIPTABLE bool removeTracks(const QList<int> &tracks);
+    Q_SCRIPTABLE bool removeTracks(const IntList &tracks);
     Q_SCRIPTABLE bool removeTracks(int index, int count);
     Q_SCRIPTABLE bool removeTrack(int index) { return removeTracks(index, 1); }
     Q_SCRIPTABLE bool swapTrack(int from, int to);
     Q_SCRIPTABLE bool moveTrack(int from, int to);
+    // one command line style edit per string, e.g. "moveTrack 4 0", applied as a single change
+    Q_SCRIPTABLE bool applyOperations(const QStringList &operations);
 
     Q_SCRIPTABLE bool shuffle() const { return d.shuffle; }
     Q_SCRIPTABLE bool toggleShuffle() { setShuffle(!d.shuffle); return d.shuffle; }
     Q_SCRIPTABLE void setShuffle(bool on) { d.shuffle = on; }
+
+    Q_SCRIPTABLE QDBusUnixFileDescriptor playlistSnapshot();
+    Q_SCRIPTABLE int sequence();
+    Q_SCRIPTABLE IntList changesSince(int sequence);
 signals:
     Q_SCRIPTABLE void wakeUp();
     Q_SCRIPTABLE void trackNames(int from, const QStringList &list);
@@ -117,8 +160,30 @@ signals:
     // slider etc
     Q_SCRIPTABLE void event(int type, const QList<QVariant> &data);
     Q_SCRIPTABLE void statusChanged(int status);
+    // position (ms, of length ms) was read at timestamp (monotonicMs())
+    // and advances at rate. Only sent when that stops predicting the
+    // position and as a heartbeat while playing, clients are expected to
+    // extrapolate.
+    Q_SCRIPTABLE void clockChanged(int status, int position, int length, qint64 timestamp, double rate);
+    Q_SCRIPTABLE void backendChanged(const QString &name);
+    // count is -1 when everything from from and on may have changed
+    Q_SCRIPTABLE void snapshotChanged(uint generation, int from, int count);
+    // everything that changed in the last event loop iteration, see PlaylistChange
+    Q_SCRIPTABLE void playlistChanged(int sequence, const IntList &changes);
     Q_SCRIPTABLE void foo(int);
 private slots:
+    void onBackendEvent(int type);
+    void onBackendLoaded();
+    void onBackendRetired();
+    void onClockChanged(int status, int position, qint64 timestamp);
+    void publishSnapshot();
+    void flushChanges();
+    void onSnapshotRowsShifted(int from);
+    void onSnapshotRowsChanged(int from, int count);
+    void onSnapshotRowsMoved(int from, int to);
+    void onSnapshotCurrentChanged(int current);
+    void onSnapshotRowsRead(const QVariant &rows);
+    void onTracksValidated(const QVariant &tracks);
 #ifdef THREADED_RECURSIVE_LOAD
     void onThreadFinished();
 #endif
@@ -132,19 +197,64 @@ protected:
 //    bool sync(SyncMode sync, bool *removedSongs);
     enum RepeatMode { NoRepeat, RepeatOne, RepeatAll };
     void addTracks(const QStringList &list);
+    void appendTracks(const QStringList &list);
+    bool postDelayedReply(BackendThread::Type type, const QVariant &arg = QVariant()) const;
+    void failCall(const QString &error);
+    void applyGain(const QUrl &url);
+    TrackData cachedTrackData(int index);
+    int currentTrackLength();
+    void recordChange(PlaylistChange type, int a, int b);
+    void moveCurrentIndex(int index);
+    void beginBatch();
+    void commitBatch();
+    bool applyOperation(const QString &operation, QString *error);
+    const FunctionTable *functionTable() const;
     struct Data {
-        Data() : current(-1), root(0), blockSync(false), backend(0), shuffle(false), repeat(NoRepeat) {}
+        Data() : current(-1), functionTable(0), backend(0), backendThread(0),
+                 loudnessCache(0), loudnessAnalyzer(0), pluginLoader(0), controlServer(0), scheduler(0), backendLoader(0),
+                 backendRetirer(0), snapshot(0), snapshotFrom(-1), snapshotTo(-1),
+                 sequence(0), trimmedSequence(0), flushedChanges(0), encodingStatisticsSequence(-1),
+                 batchDepth(0), batchStart(0), batchCurrent(-1), batchDirty(false), batchPlay(false),
+                 shuffle(false), repeat(NoRepeat) {}
         int current;
         QFile playlist;
         QList<QUrl> tracks;
-        QMap<QUrl, TrackData> cache;
-        mutable FunctionNode *root;
-        bool blockSync;
+        QCache<QUrl, TrackData> cache; // "trackcache" entries
+        mutable FunctionTable *functionTable;
         Backend *backend;
+        BackendThread *backendThread;
+        LoudnessCache *loudnessCache;
+        LoudnessAnalyzer *loudnessAnalyzer;
+        PluginLoader *pluginLoader;
+        ControlServer *controlServer;
+        RequestScheduler *scheduler;
+        BackendLoadThread *backendLoader;
+        BackendRetireThread *backendRetirer;
+        PlaylistSnapshot *snapshot;
+        QTimer snapshotTimer;
+        int snapshotFrom, snapshotTo; // dirty rows, snapshotTo is exclusive, INT_MAX means to the end
+        QSet<QUrl> snapshotPending; // being read for the snapshot
+        struct Change {
+            int sequence;
+            PlaylistChange type;
+            int a, b;
+        };
+        int sequence, trimmedSequence; // changes up to trimmedSequence are no longer in the log
+        QList<Change> changes;
+        int flushedChanges; // the rest haven't been signalled yet and may still be merged
+        QTimer changeTimer;
+        QVariantMap encodingStatistics; // for the playlist at encodingStatisticsSequence
+        int encodingStatisticsSequence;
+        // while batchDepth is non-zero per change signals and syncToFile() are
+        // held back, commitBatch() sends them for changes from batchStart on
+        int batchDepth, batchStart, batchCurrent;
+        QUrl batchUrl; // the current track when the batch started
+        bool batchDirty, batchPlay; // batchPlay: play() was called, after loading the current track
         QList<TagInterface*> tagInterfaces;
         bool shuffle;
         RepeatMode repeat;
         mutable QString lastError;
+        QString callError;
     } d;
 };
 
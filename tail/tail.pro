@@ -3,6 +3,8 @@ CONFIG += ordered
 SUBDIRS = app.pro
 !no_phonon:SUBDIRS += phononbackend.pro 
 !no_xine:SUBDIRS += xinebackend.pro 
+!no_null:SUBDIRS += nullbackend.pro
+!no_native:SUBDIRS += nativebackend.pro
 unix:system(mkdir -p $$PWD/../plugins)
 win:system(md $$PWD/../plugins)
 linux {
@@ -29,26 +29,17 @@
 #include <xine.h>
 #include <xine/xineutils.h>
 #include <tail.h>
-
-#ifndef XINE_STREAM_COUNT
-#define XINE_STREAM_COUNT 3
-#endif
+#include <log.h>
+#include "seekindex.h"
+#include <math.h>
 
 struct Node {
-    Node() : stream(0), next(0) {}
+    Node() : stream(0) {}
 
     xine_stream_t *stream;
     QUrl url;
-    Node *next;
 };
 
-void swap(Node *left, Node *right)
-{
-    qSwap(left->stream, right->stream);
-    qSwap(left->url, right->url);
-    qSwap(left->next, right->next);
-}
-
 static bool initStream(Node *node, const QUrl &url)
 {
     Q_ASSERT(node->stream);
@@ -56,6 +47,7 @@ static bool initStream(Node *node, const QUrl &url)
 
     if (!xine_open(node->stream, url.toString().toLocal8Bit().constData())) {
 //        fprintf(stderr, "Unable to open path '%s'\n", fileName.toLocal8Bit().constData());
+        node->url.clear();
         return false;
     }
     Q_ASSERT(node->url != url);
@@ -63,57 +55,223 @@ static bool initStream(Node *node, const QUrl &url)
     return true;
 }
 
-struct Private : public QObject
+/* Streams used for isValid() and trackData() on files that aren't
+   loaded for playback. They're opened on a silent audio port so probing
+   never touches the playback streams. Bounded, least recently used
+   streams get reopened first. */
+class ProbeCache
 {
-    Private() : xine(0), first(0), ao_port(0), event_queue(0),
-                status(Backend::Uninitalized), error(XINE_ERROR_NONE),
-                progressType(Backend::Seconds), pendingProgress(0)
+public:
+    ProbeCache()
+        : xine(0), ao_port(0), capacity(0), count(0), first(0), last(0),
+          hits(0), misses(0), evictions(0)
     {}
 
-    xine_stream_t *stream(const QUrl &url, Node **out = 0)
+    void init(xine_t *x, xine_audio_port_t *port, int cap)
     {
-        if (main.url == url) {
-            if (out)
-                *out = &main;
-            return main.stream;
-        } else if (!first) {
-            if (!::initStream(&main, url)) {
-                if (out)
-                    *out = 0;
-                return 0;
-            }
-            if (out)
-                *out = &main;
-            return main.stream;
+        xine = x;
+        ao_port = port;
+        capacity = qMax(1, cap);
+    }
+
+    void clear()
+    {
+        while (first) {
+            ProbeNode *node = first;
+            first = first->next;
+            xine_close(node->stream);
+            xine_dispose(node->stream);
+            delete node;
         }
-        Node *last = 0;
-        Node *node = first;
-        Q_ASSERT(first);
-        forever {
-            if (node->url == url) {
-                if (out)
-                    *out = node;
-                return node->stream;
-            } else if (node->next) {
-                last = node;
-                node = node->next;
+        last = 0;
+        count = 0;
+        nodes.clear();
+    }
+
+    xine_stream_t *stream(const QUrl &url)
+    {
+        ProbeNode *node = nodes.value(url.toString());
+        if (node) {
+            ++hits;
+            moveToFront(node);
+            return node->stream;
+        }
+        ++misses;
+        if (count < capacity) {
+            xine_stream_t *stream = xine_stream_new(xine, ao_port, NULL);
+            if (!stream)
+                return 0;
+            node = new ProbeNode;
+            node->stream = stream;
+            node->prev = 0;
+            node->next = first;
+            if (first) {
+                first->prev = node;
             } else {
-                break;
+                last = node;
+            }
+            first = node;
+            ++count;
+        } else {
+            node = last;
+            Q_ASSERT(node);
+            if (!node->url.isEmpty()) {
+                nodes.remove(node->url.toString());
+                ++evictions;
             }
+            moveToFront(node);
         }
-
-        Q_ASSERT(node);
         if (!::initStream(node, url)) {
-            if (out)
-                *out = 0;
+            moveToBack(node); // reuse this one first
             return 0;
         }
-        last->next = 0;
+        nodes[url.toString()] = node;
+        return node->stream;
+    }
+
+    void statistics(QVariantMap *map) const
+    {
+        map->insert("probeStreams", count);
+        map->insert("probeCapacity", capacity);
+        map->insert("probeHits", hits);
+        map->insert("probeMisses", misses);
+        map->insert("probeEvictions", evictions);
+    }
+private:
+    struct ProbeNode : public Node {
+        ProbeNode *prev, *next;
+    };
+
+    void unlink(ProbeNode *node)
+    {
+        if (node->prev) {
+            node->prev->next = node->next;
+        } else {
+            first = node->next;
+        }
+        if (node->next) {
+            node->next->prev = node->prev;
+        } else {
+            last = node->prev;
+        }
+    }
+
+    void moveToFront(ProbeNode *node)
+    {
+        if (node == first)
+            return;
+        unlink(node);
+        node->prev = 0;
         node->next = first;
+        first->prev = node;
         first = node;
-        if (out)
-            *out = node;
-        return node->stream;
+    }
+
+    void moveToBack(ProbeNode *node)
+    {
+        if (node == last)
+            return;
+        unlink(node);
+        node->next = 0;
+        node->prev = last;
+        last->next = node;
+        last = node;
+    }
+
+    xine_t *xine;
+    xine_audio_port_t *ao_port;
+    int capacity, count;
+    ProbeNode *first, *last;
+    QHash<QString, ProbeNode*> nodes;
+    int hits, misses, evictions;
+};
+
+struct Private : public QObject
+{
+    Private(XineBackend *b) : backend(b), xine(0), ao_port(0), probe_ao_port(0),
+                status(Backend::Uninitalized), error(XINE_ERROR_NONE),
+                progressType(Backend::Seconds), pendingProgress(-1), startupMs(-1)
+    {}
+
+    // The stream that's open for playback is reused for metadata,
+    // everything else goes through the probe cache.
+    xine_stream_t *probeStream(const QUrl &url)
+    {
+        if (main.url == url)
+            return main.stream;
+        return probeCache.stream(url);
+    }
+
+    bool load(const QUrl &url)
+    {
+        if (main.url == url)
+            return true;
+        return ::initStream(&main, url);
+    }
+
+    void setStatus(Backend::Status s)
+    {
+        {
+            QMutexLocker locker(&mutex);
+            status = s;
+        }
+        backend->statusChanged(s);
+    }
+
+    bool listen(xine_stream_t *stream)
+    {
+        xine_event_queue_t *queue = xine_event_new_queue(stream);
+        if (!queue)
+            return false;
+        xine_event_create_listener_thread(queue, eventListener, this);
+        eventQueues.append(queue);
+        return true;
+    }
+
+    // xine's time based seeking guesses from the bitrate which is way
+    // off for VBR files so use a byte position from the seek index
+    // where we can.
+    void startPosition(int type, int progress, int *start_pos, int *start_time)
+    {
+        *start_pos = 0;
+        *start_time = 0;
+        const QString path = main.url.toLocalFile();
+        if (!path.isEmpty() && SeekIndex::canIndex(path)) {
+            if (seekIndexUrl != main.url) {
+                seekIndex = SeekIndex::index(path);
+                seekIndexUrl = main.url;
+            }
+            if (!seekIndex.isNull()) {
+                const int msec = (type == Backend::Seconds ? progress * 1000
+                                  : type == Backend::Milliseconds ? progress
+                                  : int(qint64(progress) * seekIndex.length() / 10000));
+                *start_pos = int(double(seekIndex.offset(msec)) / double(seekIndex.size()) * 65535.0);
+                return;
+            }
+        }
+        if (type == Backend::Seconds) {
+            *start_time = progress * 1000;
+        } else if (type == Backend::Milliseconds) {
+            *start_time = progress;
+        } else {
+            *start_pos = int(double(progress) / 10000.0 * 65535.0);
+        }
+    }
+
+    // runs in xine's listener thread for the playback stream
+    static void eventListener(void *user_data, const xine_event_t *event)
+    {
+        if (event->type != XINE_EVENT_UI_PLAYBACK_FINISHED)
+            return;
+        Private *d = static_cast<Private*>(user_data);
+        {
+            QMutexLocker locker(&d->mutex);
+            if (event->stream != d->main.stream || d->status != Backend::Playing)
+                return; // stopped since
+            d->status = Backend::Stopped;
+        }
+        d->backend->statusChanged(Backend::Stopped);
+        d->backend->sendEvent(Backend::SongFinished);
     }
 
     inline void updateError(xine_stream_t *stream)
@@ -123,21 +281,25 @@ struct Private : public QObject
         error = xine_get_error(stream);
     }
 
+    XineBackend *backend;
     xine_t *xine;
     Node main;
-    Node *first;
-    xine_audio_port_t *ao_port;
-    xine_event_queue_t *event_queue;
+    ProbeCache probeCache;
+    xine_audio_port_t *ao_port, *probe_ao_port;
+    QList<xine_event_queue_t*> eventQueues;
     QString filePath, extraPath;
-    QBasicTimer pollTimer;
-    Backend::Status status;
+    QMutex mutex; // main.stream and status, for the listener thread
+    QAtomicInt status; // Backend::Status, written under mutex
     int error;
     Backend::ProgressType progressType;
-    int pendingProgress;
+    int pendingProgress; // -1 means no seek pending
+    int startupMs; // time xine_play() took for the last track
+    SeekIndex seekIndex;
+    QUrl seekIndexUrl;
 };
 
 XineBackend::XineBackend(QObject *tail)
-    : Backend("XineBackend", tail), d(new Private)
+    : Backend("XineBackend", tail), d(new Private(this))
 {
 }
 
@@ -164,29 +326,27 @@ bool XineBackend::initBackend()
         return false;
     }
 
-    if (!(d->main.stream = xine_stream_new(d->xine, d->ao_port, NULL))) {
+    {
+        QMutexLocker locker(&d->mutex);
+        d->main.stream = xine_stream_new(d->xine, d->ao_port, NULL);
+    }
+    if (!d->main.stream) {
         d->updateError(0);
         return false;
     }
 
-    if (!(d->event_queue = xine_event_new_queue(d->main.stream))) {
+    if (!d->listen(d->main.stream)) {
         d->error = -1;
         return false;
     }
 
-    d->first = 0;
-    Node **node = &d->first;
-
-    for (int i=0; i<XINE_STREAM_COUNT; ++i) {
-        *node = new Node;
-        (*node)->stream = xine_stream_new(d->xine, d->ao_port, NULL);
-        // can I pass 0 as ao_port?
-        if (!(*node)->stream) {
-            d->updateError(0);
-            return false;
-        }
-        node = &((*node)->next);
-    }
+    // metadata probes shouldn't be able to make any noise. They're never
+    // played so the playback port will do if xine has no "none" driver
+    d->probe_ao_port = xine_open_audio_driver(d->xine, "none", NULL);
+    if (!d->probe_ao_port)
+        LOG(1) << "Can't open xine's none audio driver, probing on the playback port";
+    d->probeCache.init(d->xine, d->probe_ao_port ? d->probe_ao_port : d->ao_port,
+                       Config::value<int>("probestreams", 8));
 
     d->status = Stopped;
 
@@ -197,11 +357,11 @@ void XineBackend::shutdown()
 {
     if (d->status == Uninitalized)
         return;
-    if (d->event_queue) {
-        xine_event_dispose_queue(d->event_queue);
-        d->event_queue = 0;
-    }
-
+    // joins the listener threads, nothing can race with us after this
+    foreach(xine_event_queue_t *queue, d->eventQueues)
+        xine_event_dispose_queue(queue);
+    d->eventQueues.clear();
+    d->probeCache.clear(); // before the port they might be using is closed
 
     if (d->main.stream) {
         xine_stop(d->main.stream);
@@ -214,20 +374,14 @@ void XineBackend::shutdown()
         d->main.stream = 0;
     }
 
-    while (d->first) {
-        if (d->first->stream) {
-            xine_close(d->first->stream);
-            xine_dispose(d->first->stream);
-        }
-        Node *tmp = d->first;
-        d->first = d->first->next;
-        delete tmp;
+    if (d->probe_ao_port) {
+        xine_close_audio_driver(d->xine, d->probe_ao_port);
+        d->probe_ao_port = 0;
     }
 
     xine_exit(d->xine);
     d->xine = 0;
-    d->status = Uninitalized;
-    statusChanged(d->status);
+    d->setStatus(Uninitalized);
 }
 
 typedef QVariant (*Xine_Get_Meta_Info_Func)(xine_stream_t *stream, int info);
@@ -273,7 +427,7 @@ bool XineBackend::trackData(TrackData *data, const QUrl &url, int mask) const
     if (!(mask & BackendTypes)) // shouldn't really happen
         return true;
 
-    xine_stream_t *stream = d->stream(url);
+    xine_stream_t *stream = d->probeStream(url);
     if (!stream)
         return false; // set error codes? warn?
 
@@ -283,7 +437,7 @@ bool XineBackend::trackData(TrackData *data, const QUrl &url, int mask) const
         const Xine_Get_Meta_Info_Func info;
         const VariableSetter_Func setter;
         void *target;
-    } static const fields[] = {
+    } const fields[] = {
         { Title, XINE_META_INFO_TITLE, xine_get_meta_data, Setter<QString>::set, &data->title },
         { TrackLength, 2, xine_get_track_length, Setter<int>::set, &data->trackLength },
         { Artist, XINE_META_INFO_ARTIST, xine_get_meta_data, Setter<QString>::set, &data->artist },
@@ -305,51 +459,72 @@ bool XineBackend::trackData(TrackData *data, const QUrl &url, int mask) const
 
 bool XineBackend::isValid(const QUrl &url) const
 {
-    return status() != Uninitalized && (url.toLocalFile().isEmpty() || d->stream(url)); // ### should maybe not do this for remote files
+    return status() != Uninitalized && (url.toLocalFile().isEmpty() || d->probeStream(url)); // ### should maybe not do this for remote files
 }
 
 
 void XineBackend::play()
 {
-    if (status() != Uninitalized) {
-        if (status() == Paused) {
-            qWarning("%s:%d unimplemented. Needs to restart at the right time", __FILE__, __LINE__);
-        }
-        const bool ok = xine_play(d->main.stream, 0, 0);
-        if (ok) {
-            d->pollTimer.start(500, d); // what is this timer doing?
-            d->status = Playing;
-            statusChanged(d->status);
-        } else {
+    switch (status()) {
+    case Uninitalized:
+    case Playing:
+        return;
+    case Paused:
+        if (d->pendingProgress == -1) {
+            // the stream is still open and demuxed, only the clock was halted
+            QTime timer;
+            timer.start();
+            xine_set_param(d->main.stream, XINE_PARAM_SPEED, XINE_SPEED_NORMAL);
             d->updateError(d->main.stream);
+            LOG(10) << "resumed in" << timer.elapsed() << "ms";
+            d->setStatus(Playing);
+            return;
         }
+        // seek requested while paused, need to restart the stream there
+        xine_set_param(d->main.stream, XINE_PARAM_SPEED, XINE_SPEED_NORMAL);
+        break;
+    default:
+        break;
+    }
+
+    int start_pos = 0, start_time = 0;
+    if (d->pendingProgress != -1)
+        d->startPosition(d->progressType, d->pendingProgress, &start_pos, &start_time);
+    QTime startup;
+    startup.start();
+    const bool ok = xine_play(d->main.stream, start_pos, start_time);
+    d->startupMs = startup.elapsed();
+    d->progressType = Seconds;
+    d->pendingProgress = -1;
+    if (ok) {
+        d->setStatus(Playing);
+    } else {
+        d->updateError(d->main.stream);
     }
 }
 
 void XineBackend::pause()
 {
     if (status() == Playing) {
-        d->pollTimer.stop();
-        d->pendingProgress = progress(Portion);
-        d->progressType = Portion;
-        d->pollTimer.stop();
-        xine_stop(d->main.stream);
+        QTime timer;
+        timer.start();
+        xine_set_param(d->main.stream, XINE_PARAM_SPEED, XINE_SPEED_PAUSE);
         d->updateError(d->main.stream);
-        d->status = Paused;
-        statusChanged(d->status);
+        LOG(10) << "paused in" << timer.elapsed() << "ms";
+        d->setStatus(Paused);
     }
 }
 
 void XineBackend::stop()
 {
-    if (status() == Playing) {
-        d->pendingProgress = 0;
+    if (status() == Playing || status() == Paused) {
+        d->pendingProgress = -1;
         d->progressType = Seconds;
+        if (status() == Paused)
+            xine_set_param(d->main.stream, XINE_PARAM_SPEED, XINE_SPEED_NORMAL);
         xine_stop(d->main.stream);
         d->updateError(d->main.stream);
-        d->pollTimer.stop();
-        d->status = Stopped;
-        statusChanged(d->status);
+        d->setStatus(Stopped);
     }
 
 }
@@ -357,14 +532,10 @@ void XineBackend::stop()
 bool XineBackend::loadUrl(const QUrl &url)
 {
     stop();
-    Node *node;
-    xine_stream_t *s = d->stream(url, &node);
-    if (!s)
+    if (!d->load(url)) {
+        d->updateError(d->main.stream);
         return false;
-    if (node != &d->main) {
-        ::swap(node, &d->main);
     }
-
     return true;
 }
 
@@ -403,30 +574,32 @@ bool XineBackend::isMute() const
 void XineBackend::setProgress(int type, int progress)
 {
     if (status() != Playing) {
+        // applied on the next play()
         d->progressType = static_cast<ProgressType>(type);
         d->pendingProgress = progress;
     } else {
         d->progressType = Seconds;
-        d->pendingProgress = 0;
-        int start_pos = 0;
-        int start_time = 0;
-        if (type == Seconds) {
-            start_time = progress * 1000;
-        } else {
-            start_pos = int(double(progress) / 10000.0 * 65535.0);
-        }
+        d->pendingProgress = -1;
+        QTime timer;
+        timer.start();
+        int start_pos, start_time;
+        d->startPosition(type, progress, &start_pos, &start_time);
         xine_play(d->main.stream, start_pos, start_time);
         d->updateError(d->main.stream);
+        LOG(10) << "seeked to" << progress << (type == Seconds ? "seconds" : type == Milliseconds ? "ms" : "portion")
+                << "in" << timer.elapsed() << "ms";
     }
 }
 
 int XineBackend::progress(int type)
 {
-    const QVariant var = ::xine_get_track_length(d->main.stream, type == Seconds ? 1 : 0);
+    const QVariant var = ::xine_get_track_length(d->main.stream, type == Portion ? 0 : 1);
     if (var.isNull())
         return -1;
     if (type == Seconds) {
-        return var.toInt() * 1000;
+        return var.toInt() / 1000;
+    } else if (type == Milliseconds) {
+        return var.toInt();
     } else {
         return int(double(var.toInt()) * 10000.0 / 65535.0);
         // 100th of a percent
@@ -453,7 +626,59 @@ int XineBackend::errorCode() const
     return d->error;
 }
 
-int XineBackend::flags() const
+bool XineBackend::decode(const QUrl &url, AudioSink *sink) const
+{
+    if (status() == Uninitalized)
+        return false;
+    // every call gets its own stream and port so this can run on several
+    // threads at once
+    xine_audio_port_t *port = xine_new_framegrab_audio_port(d->xine);
+    if (!port)
+        return false;
+    bool ok = false;
+    if (xine_stream_t *stream = xine_stream_new(d->xine, port, NULL)) {
+        if (xine_open(stream, url.toString().toLocal8Bit().constData()) && xine_play(stream, 0, 0)) {
+            bool formatSet = false;
+            ok = true;
+            xine_audio_frame_t frame;
+            while (xine_get_next_audio_frame(port, &frame)) {
+                if (frame.bits_per_sample != 16
+                    || (!formatSet && !(formatSet = sink->format(frame.sample_rate, frame.num_channels)))) {
+                    xine_free_audio_frame(port, &frame);
+                    ok = false;
+                    break;
+                }
+                ok = sink->write(reinterpret_cast<const qint16*>(frame.data), frame.num_samples);
+                xine_free_audio_frame(port, &frame);
+                if (!ok)
+                    break;
+            }
+            ok = ok && formatSet;
+        }
+        xine_close(stream);
+        xine_dispose(stream);
+    }
+    xine_close_audio_driver(d->xine, port);
+    return ok;
+}
+
+void XineBackend::setGain(double gain)
+{
+    // 100 is unity, xine clamps at 200
+    const int level = qBound(0, qRound(100.0 * pow(10.0, gain / 20.0)), 200);
+    xine_set_param(d->main.stream, XINE_PARAM_AUDIO_AMP_LEVEL, level);
+    d->updateError(d->main.stream);
+}
+
+QVariantMap XineBackend::statistics() const
+{
+    QVariantMap ret;
+    ret.insert("startupMs", d->startupMs);
+    d->probeCache.statistics(&ret);
+    return ret;
+}
+
+int XineBackend::capabilities() const
 {
     return SupportsEqualizer;
 }
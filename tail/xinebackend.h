@@ -55,11 +55,15 @@ public:
     virtual int errorCode() const;
     virtual void setMute(bool on);
     virtual bool isMute() const;
-    virtual int flags() const;
+    virtual int capabilities() const;
     virtual QHash<int, int> equalizerSettings() const;
     virtual void setEqualizerSettings(const QHash<int, int> &eq);
+    virtual QVariantMap statistics() const;
+    virtual bool decode(const QUrl &url, AudioSink *sink) const;
+    virtual void setGain(double gain);
 private:
     Private *d;
+    friend struct Private;
 };
 
 class Q_DECL_EXPORT XineBackendPlugin : public BackendPlugin
@@ -1,6 +1,6 @@
-HEADERS += xinebackend.h
-SOURCES += xinebackend.cpp
-DEFINES += XINE_STREAM_COUNT=0 BACKEND=XineBackend
+HEADERS += xinebackend.h seekindex.h
+SOURCES += xinebackend.cpp seekindex.cpp
+DEFINES += BACKEND=XineBackend
 LIBS += -lxine
 macx {
     INCLUDEPATH+=/opt/local/include
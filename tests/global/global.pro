@@ -0,0 +1,9 @@
+TEMPLATE = app
+TARGET = tst_global
+CONFIG += qtestlib
+QT -= gui
+DEPENDPATH += .
+INCLUDEPATH += .
+SOURCES += tst_global.cpp
+include(../../shared/shared.pri)
+OBJECTS_DIR = .objtest
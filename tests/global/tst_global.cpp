@@ -0,0 +1,96 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+
+#include <QtTest>
+#include "global.h"
+
+class GlobalTest : public QObject
+{
+    Q_OBJECT
+private slots:
+    void urlRoundTrip_data();
+    void urlRoundTrip();
+    void trackDataListRoundTrip();
+};
+
+static const char *const paths[] = {
+    "/music/plain.mp3",
+    "/music/what#ever.mp3",
+    "/music/why?.mp3",
+    "/music/100%.mp3",
+    "/music/%41 with an escape.mp3",
+    "/music/Sigur Rós/Hoppípolla.mp3",
+    0
+};
+
+void GlobalTest::urlRoundTrip_data()
+{
+    QTest::addColumn<QUrl>("url");
+    for (int i=0; paths[i]; ++i)
+        QTest::newRow(paths[i]) << QUrl::fromLocalFile(QString::fromUtf8(paths[i]));
+    QTest::newRow("remote") << QUrl::fromEncoded("http://example.com/a%23b.mp3?x=1#frag");
+}
+
+void GlobalTest::urlRoundTrip()
+{
+    QFETCH(QUrl, url);
+    const QUrl decoded = ::urlFromString(::urlToString(url));
+    QCOMPARE(decoded, url);
+    QCOMPARE(decoded.toLocalFile(), url.toLocalFile());
+}
+
+// same directory prefix for most of them so the string table is shared
+void GlobalTest::trackDataListRoundTrip()
+{
+    TrackDataList list;
+    for (int i=0; paths[i]; ++i) {
+        TrackData data;
+        data.url = QUrl::fromLocalFile(QString::fromUtf8(paths[i]));
+        data.title = QString("Title %1").arg(i);
+        data.artist = "Artist";
+        data.trackLength = 100 + i;
+        data.playlistIndex = i * 3;
+        data.fields = URL|Title|Artist|TrackLength|PlaylistIndex;
+        list.append(data);
+    }
+    TrackDataList decoded;
+    QVERIFY(::decodeTrackDataList(::encodeTrackDataList(list), &decoded));
+    QCOMPARE(decoded.size(), list.size());
+    for (int i=0; i<list.size(); ++i) {
+        QCOMPARE(decoded.at(i).fields, list.at(i).fields);
+        QCOMPARE(decoded.at(i).url, list.at(i).url);
+        QCOMPARE(decoded.at(i).url.toLocalFile(), list.at(i).url.toLocalFile());
+        QCOMPARE(decoded.at(i).title, list.at(i).title);
+        QCOMPARE(decoded.at(i).artist, list.at(i).artist);
+        QCOMPARE(decoded.at(i).trackLength, list.at(i).trackLength);
+        QCOMPARE(decoded.at(i).playlistIndex, list.at(i).playlistIndex);
+    }
+}
+
+QTEST_MAIN(GlobalTest)
+#include "tst_global.moc"
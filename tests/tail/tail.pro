@@ -0,0 +1,19 @@
+TEMPLATE = app
+TARGET = tst_tail
+CONFIG += qtestlib
+DEPENDPATH += . ../../tail
+INCLUDEPATH += . ../../tail
+SOURCES += tst_tail.cpp
+# everything tokoloshtail is built from except main.cpp
+SOURCES += ../../tail/tail.cpp ../../tail/backendthread.cpp ../../tail/loudness.cpp ../../tail/routerbackend.cpp \
+           ../../tail/pluginmanifest.cpp ../../tail/pluginloader.cpp ../../tail/playlistsnapshot.cpp \
+           ../../tail/controlserver.cpp ../../tail/requestscheduler.cpp
+HEADERS += ../../tail/tail.h ../../tail/backend.h ../../tail/backendthread.h ../../tail/loudness.h \
+           ../../tail/routerbackend.h ../../tail/pluginmanifest.h ../../tail/pluginloader.h \
+           ../../tail/playlistsnapshot.h ../../tail/controlserver.h ../../tail/requestscheduler.h \
+           ../../tail/taginterface.h ../../tail/id3taginterface.h
+
+include(../../shared/shared.pri)
+CONFIG += qdbus
+LIBS += -lid3
+OBJECTS_DIR = .objtest
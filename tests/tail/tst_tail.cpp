@@ -0,0 +1,183 @@
+/*
+    Copyright (c) 2010 Anders Bakken
+    Copyright (c) 2010 Donald Carr
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    Redistributions of source code must retain the above copyright notice, this
+    list of conditions and the following disclaimer. Redistributions in binary
+    form must reproduce the above copyright notice, this list of conditions and
+    the following disclaimer in the documentation and/or other materials
+    provided with the distribution. Neither the name of any associated
+    organizations nor the names of its contributors may be used to endorse or
+    promote products derived from this software without specific prior written
+    permission. THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+    CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT
+    NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER
+    OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+    EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+    PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+    OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+
+#include <QtTest>
+#include "global.h"
+#include "tail.h"
+#include "backend.h"
+
+// Remembers what it was asked to load, plays nothing
+class RecordingBackend : public Backend
+{
+public:
+    RecordingBackend(QObject *tail) : Backend("recording", tail), state(Stopped) {}
+    virtual bool trackData(TrackData *, const QUrl &, int) const { return false; }
+    virtual void shutdown() {}
+    virtual bool isValid(const QUrl &) const { return true; }
+    virtual void play() { state = Playing; }
+    virtual void pause() { state = Paused; }
+    virtual void setProgress(int, int) {}
+    virtual int progress(int) { return 0; }
+    virtual void stop() { state = Stopped; }
+    virtual bool loadUrl(const QUrl &url)
+    {
+        QMutexLocker locker(&mutex);
+        loaded.append(url);
+        return true;
+    }
+    virtual int status() const { return state; }
+    virtual int volume() const { return 100; }
+    virtual void setVolume(int) {}
+    virtual bool initBackend() { return true; }
+    virtual void setMute(bool) {}
+    virtual bool isMute() const { return false; }
+
+    QList<QUrl> takeLoaded()
+    {
+        QMutexLocker locker(&mutex);
+        const QList<QUrl> ret = loaded;
+        loaded.clear();
+        return ret;
+    }
+private:
+    QAtomicInt state;
+    QMutex mutex;
+    QList<QUrl> loaded;
+};
+
+class TailTest : public QObject
+{
+    Q_OBJECT
+public:
+    TailTest(const QString &directory) : dir(directory) {}
+private slots:
+    void initTestCase();
+    void moveCurrentInBatch();
+    void swapCurrentInBatch();
+private:
+    Tail *createTail(RecordingBackend **backend);
+    void waitForBackend(Tail *tail) { (void)tail->isValid(QUrl()); } // commands are run in order
+    QUrl track(int index) const { return QUrl::fromLocalFile(QString("%1/%2.mp3").arg(dir).arg(index)); }
+
+    const QString dir;
+};
+
+void TailTest::initTestCase()
+{
+    for (int i=0; i<3; ++i) {
+        QFile file(track(i).toLocalFile());
+        QVERIFY(file.open(QIODevice::WriteOnly));
+    }
+}
+
+Tail *TailTest::createTail(RecordingBackend **backend)
+{
+    Tail *tail = new Tail;
+    tail->setPlaylist(dir + "/tst_tail.m3u");
+    *backend = new RecordingBackend(tail);
+    if (!tail->setBackend(*backend)) {
+        delete tail;
+        return 0;
+    }
+    for (int i=0; i<3; ++i)
+        tail->load(track(i), false);
+    return tail;
+}
+
+// Moving the playing track must not replace it with whatever is at its
+// old index now
+void TailTest::moveCurrentInBatch()
+{
+    RecordingBackend *backend;
+    Tail *tail = createTail(&backend);
+    QVERIFY(tail);
+    QCOMPARE(tail->count(), 3);
+    QVERIFY(tail->setCurrentTrackIndex(1));
+    waitForBackend(tail);
+    backend->takeLoaded();
+
+    QVERIFY(tail->applyOperations(QStringList() << "moveTrack 1 0"));
+    QCOMPARE(tail->currentTrackIndex(), 0);
+    QCOMPARE(tail->tracks(0, 1).value(0), track(1));
+    QVERIFY(tail->applyOperations(QStringList() << "moveTrack 2 0" << "moveTrack 1 2"));
+    QCOMPARE(tail->currentTrackIndex(), 2);
+    QCOMPARE(tail->tracks(2, 1).value(0), track(1));
+    waitForBackend(tail);
+    QVERIFY(backend->takeLoaded().isEmpty());
+    delete tail;
+}
+
+void TailTest::swapCurrentInBatch()
+{
+    RecordingBackend *backend;
+    Tail *tail = createTail(&backend);
+    QVERIFY(tail);
+    QVERIFY(tail->setCurrentTrackIndex(2));
+    waitForBackend(tail);
+    backend->takeLoaded();
+
+    QVERIFY(tail->applyOperations(QStringList() << "swapTrack 0 2"));
+    QCOMPARE(tail->currentTrackIndex(), 0);
+    QCOMPARE(tail->tracks(0, 1).value(0), track(2));
+    waitForBackend(tail);
+    QVERIFY(backend->takeLoaded().isEmpty());
+    delete tail;
+}
+
+// Tail reads its settings through Config, point it at a scratch
+// directory so the real settings, playlist and caches aren't touched
+int main(int argc, char **argv)
+{
+    const QString dir = QString("%1/tst_tail-%2").arg(QDir::tempPath()).arg(QCoreApplication::applicationPid());
+    QDir().mkpath(dir);
+    QByteArray cacheDir = "--cachedir=" + QFile::encodeName(dir);
+    char conf[] = "--conf=none";
+    QVector<char*> args;
+    args.append(argv[0]);
+    args.append(conf);
+    args.append(cacheDir.data());
+    int count = args.size();
+    args.append(0);
+    ::initApp("tst_tail", count, args.data());
+    QCoreApplication app(count, args.data());
+
+    QStringList testArgs;
+    for (int i=0; i<argc; ++i)
+        testArgs.append(QString::fromLocal8Bit(argv[i]));
+    int ret;
+    {
+        TailTest test(dir);
+        ret = QTest::qExec(&test, testArgs);
+    }
+    foreach(const QString &file, QDir(dir).entryList(QDir::Files))
+        QFile::remove(dir + '/' + file);
+    QDir().rmdir(dir);
+    return ret;
+}
+
+#include "tst_tail.moc"
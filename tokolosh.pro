@@ -1,5 +1,6 @@
 TEMPLATE = subdirs
 SUBDIRS += head \
-	   tail
+	   tail \
+	   tests
 unix:system(mkdir -p $$PWD/bin)
 win:system(md $$PWD/bin)